@@ -7,6 +7,7 @@
 #include <voxblox/core/common.h>
 
 #include "global_segment_map/label_voxel.h"
+#include "global_segment_map/utils/compact_label_voxel.h"
 
 namespace voxblox {
 
@@ -17,6 +18,14 @@ void Block<LabelVoxel>::deserializeFromIntegers(
 template <>
 void Block<LabelVoxel>::serializeToIntegers(std::vector<uint32_t>* data) const;
 
+template <>
+void Block<CompactLabelVoxel>::deserializeFromIntegers(
+    const std::vector<uint32_t>& data);
+
+template <>
+void Block<CompactLabelVoxel>::serializeToIntegers(
+    std::vector<uint32_t>* data) const;
+
 }  // namespace voxblox
 
 #endif  // GLOBAL_SEGMENT_MAP_LABEL_BLOCK_SERIALIZATION_H_
@@ -1,7 +1,14 @@
 #ifndef GLOBAL_SEGMENT_MAP_LABEL_TSDF_INTEGRATOR_H_
 #define GLOBAL_SEGMENT_MAP_LABEL_TSDF_INTEGRATOR_H_
 
+#include <cmath>
+#include <deque>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <glog/logging.h>
@@ -17,6 +24,11 @@
 #include "global_segment_map/label_tsdf_map.h"
 #include "global_segment_map/segment.h"
 #include "global_segment_map/semantic_instance_label_fusion.h"
+#include "global_segment_map/utils/active_block_set.h"
+#include "global_segment_map/utils/batch_ray_caster.h"
+#include "global_segment_map/utils/image_utils.h"
+#include "global_segment_map/utils/label_set.h"
+#include "global_segment_map/utils/thread_pool.h"
 
 namespace voxblox {
 
@@ -59,6 +71,65 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
     // ICP params.
     bool enable_icp = false;
     bool keep_track_of_icp_correction = false;
+
+    // Ray integration scheduling.
+    // If enabled, the voxels of all rays are grouped by the block region they
+    // fall into and every region is updated by a single worker, so that the
+    // label voxels can be updated without locking. Otherwise every worker
+    // integrates a stripe of the rays.
+    bool enable_spatially_partitioned_integration = false;
+    // Side length in blocks of the regions assigned to the workers.
+    int partition_region_size_blocks = 2;
+    // Update the label voxels with compare-and-swap loops instead of
+    // locking them. Requires building with GSM_LOCK_FREE_LABEL_UPDATES for a
+    // CPU with a 16 byte compare-and-swap instruction.
+    bool enable_lock_free_label_updates = false;
+    // Cast the merged rays in batches with SIMD instructions instead of one
+    // by one. Visits the same voxels.
+    bool enable_batch_ray_casting = false;
+
+    // Label voxels are only allocated within this factor times the
+    // truncation distance from the surface, measured along the ray. Outside
+    // of the band, only already allocated label voxels are updated. Zero or
+    // less allocates label voxels along the whole ray.
+    float label_band_truncation_factor = 0.0f;
+
+    // Collapse the points of a segment that fall into the same voxel before
+    // label propagation, so that every voxel votes once with the number of
+    // its points. The candidate counts are the same.
+    bool enable_voxel_deduplicated_propagation = false;
+
+    // Keep the label voxels every segment voted with, so that the segments
+    // that vote again after one of their labels got assigned are served
+    // without reading the map. Same result, at the cost of memory that
+    // grows with the number of points of the frame.
+    bool enable_label_propagation_cache = false;
+
+    // Render the label layer into the camera once per frame and let the
+    // segments vote with the rendered voxels of the pixels their points
+    // project into, instead of looking up the voxel of every point. Only
+    // used with depth image input, where the camera intrinsics are known.
+    bool enable_rendered_label_propagation = false;
+
+    // Reuse the label rendering of a previous frame while the camera moved
+    // less than the maximum translation and rotation, and the labels of
+    // fewer voxels changed since it was rendered. Merging labels always
+    // invalidates the rendering. Requires rendered label propagation.
+    bool enable_temporal_label_cache = false;
+    float temporal_cache_max_translation = 0.02f;
+    float temporal_cache_max_rotation = 0.02f;
+    int temporal_cache_max_voxel_label_changes = 1000;
+
+    // Transform and voxelize the points of a frame once, to be shared by
+    // label propagation, ICP and the one pass segment integration.
+    bool enable_frame_preprocessing = false;
+
+    // Reuse the labels that no voxel carries anymore, e.g. the labels merged
+    // into other ones, once they have been dead for the given number of
+    // frames. Their pairwise and instance counts are dropped. Otherwise a
+    // long session fails after all 16 bit labels were issued.
+    bool enable_label_recycling = false;
+    int label_recycling_min_frames = 30;
   };
 
   LabelTsdfIntegrator(const Config& tsdf_config,
@@ -69,7 +140,53 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
   void computeSegmentLabelCandidates(
       Segment* segment, std::map<Label, std::map<Segment*, size_t>>* candidates,
       std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
-      const std::set<Label>& assigned_labels = std::set<Label>());
+      const LabelSet& assigned_labels = LabelSet());
+
+  // Computes the label candidates of all segments of a frame concurrently on
+  // the thread pool. Same result as calling computeSegmentLabelCandidates()
+  // for every segment in order.
+  void computeFrameLabelCandidates(
+      const std::vector<Segment*>& segments,
+      std::map<Label, std::map<Segment*, size_t>>* candidates,
+      std::map<Segment*, std::vector<Label>>* segment_merge_candidates);
+
+  // Transforms the points of all segments of a frame into the world frame
+  // and computes their voxel and block indices once. Until the frame is
+  // cleared, label propagation and integrateSegments() use these instead of
+  // transforming the points again, as long as the segment poses are
+  // unchanged. All segments need to share the same T_G_C_.
+  void preprocessFrame(const std::vector<Segment*>& segments);
+
+  void clearPreprocessedFrame();
+
+  // The points of the preprocessed frame in the camera frame, concatenated
+  // in segment order.
+  inline const Pointcloud& getPreprocessedPointsC() const {
+    return preprocessed_frame_.points_C;
+  }
+
+  // Collects the allocated blocks in the view frustum of the camera at T_G_C.
+  // Until the set is cleared, label propagation, the label rendering, ICP and
+  // the block allocation of the integration look blocks up in it first.
+  void updateActiveBlocks(const Transformation& T_G_C,
+                          const CameraIntrinsics& intrinsics);
+
+  // Same for point cloud frames, collects the allocated blocks in the
+  // bounding box of the camera origin and the points of the segments, padded
+  // by the truncation distance.
+  void updateActiveBlocks(const Transformation& T_G_C,
+                          const std::vector<Segment*>& segments);
+
+  // Blocks allocated by the integration are not part of the set, it is
+  // cleared once the frame is integrated. Unless the map keeps inactive label
+  // blocks dense, the label blocks outside of the set are packed then.
+  void clearActiveBlocks();
+
+  // Renders the label voxels close to the surface into the camera at T_G_C.
+  // Until the labels of the frame are decided, the label candidates are
+  // then voted from the rendering instead of the map.
+  void renderLabelImage(const Transformation& T_G_C,
+                        const CameraIntrinsics& intrinsics);
 
   void decideLabelPointClouds(
       std::vector<voxblox::Segment*>* segments_to_integrate,
@@ -81,6 +198,33 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
                            const Pointcloud& points_C, const Colors& colors,
                            const Label& label, const bool freespace_points);
 
+  // Integrates a pointcloud in which every point carries its own label.
+  void integratePointCloud(const Transformation& T_G_C,
+                           const Pointcloud& points_C, const Colors& colors,
+                           const Labels& labels, const bool freespace_points);
+
+  // Frame integration.
+  // Integrates all labelled segments of a frame at once. The rays of all
+  // segments are bundled together, so that voxels observed by several
+  // segments are only traversed once and new blocks are only merged into
+  // the layers once per frame. All segments need to share the same T_G_C_.
+  // Points of several segments in the same voxel are merged into one ray
+  // that votes for their majority label, unlike integratePointCloud(). The
+  // surface and clearing rays are also integrated in a single pass.
+  void integrateSegments(const std::vector<Segment*>& segments,
+                         const bool freespace_points);
+
+  // Integrates a depth image projectively. Instead of casting a ray per
+  // point, every voxel of the blocks in the camera frustum is projected into
+  // the image and updated with the depth of the pixel it falls into.
+  // segment_index_image holds per pixel the index into segment_labels of the
+  // label to integrate, or kNoSegmentIndex.
+  void integrateDepthImage(const Transformation& T_G_C,
+                           const DepthImage& depth_image,
+                           const SegmentIndexImage& segment_index_image,
+                           const CameraIntrinsics& intrinsics,
+                           const Labels& segment_labels);
+
   // Segment merging.
   // Not thread safe.
   void mergeLabels(LLSet* merges_to_publish);
@@ -89,32 +233,275 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
   void getLabelsToPublish(
       std::vector<voxblox::Label>* segment_labels_to_publish);
 
+  // Aligns the point cloud to the active blocks, or to the whole tsdf layer
+  // if there is no active block set.
   Transformation getIcpRefined_T_G_C(const Transformation& T_G_C_init,
                                      const Pointcloud& point_cloud);
 
  protected:
+  // Ray bundled from all points that ended in the same voxel.
+  struct MergedRay {
+    Point point_G;
+    Color color;
+    FloatingPoint weight;
+    Label label;
+    LabelConfidence confidence;
+  };
+
+  // Voxel traversed by a merged ray.
+  struct VoxelUpdate {
+    GlobalIndex global_voxel_idx;
+    size_t ray_idx;
+  };
+
+  // Merged rays of one stripe and their voxels, queued per region owner.
+  // The voxels of surface and clearing rays are queued separately, so that
+  // every voxel sees all surface updates before the clearing ones.
+  struct RayPartition {
+    AlignedVector<MergedRay> rays;
+    std::vector<AlignedVector<VoxelUpdate>> surface_voxel_updates;
+    std::vector<AlignedVector<VoxelUpdate>> clearing_voxel_updates;
+  };
+
+  // Blocks holding the last updated voxel. Both layers share the same block
+  // grid, so as long as the following voxels stay in these blocks no hash
+  // map lookup is needed.
+  struct BlockCache {
+    BlockIndex tsdf_block_idx;
+    Block<TsdfVoxel>::Ptr tsdf_block = nullptr;
+    BlockIndex label_block_idx;
+    Block<LabelVoxel>::Ptr label_block = nullptr;
+    // Label block and label of the last vote recorded by recordLabelVote().
+    const Block<LabelVoxel>* voted_label_block = nullptr;
+    Label voted_label = 0u;
+  };
+
+  // Merged rays that are cast together with the batch ray caster.
+  struct RayBatch {
+    AlignedVector<MergedRay> merged_rays;
+    AlignedVector<Point> points_G;
+    // Voxel the points of every ray ended in.
+    GlobalIndexVector end_voxel_indices;
+    std::vector<GlobalIndexVector> voxel_indices;
+  };
+
+  typedef std::unordered_map<Label, int> LabelCountDeltas;
+
+  // Labels that voted in the label block at the index.
+  typedef AlignedVector<std::pair<Label, BlockIndex>> LabelBlockVotes;
+
+  // Local indices of voxels, grouped by the block they lie in.
+  typedef AnyIndexHashMapType<VoxelIndexList>::type BlockVoxelsMap;
+
+  // Label votes of the points of a single segment.
+  struct SegmentLabelVotes {
+    // Sorted by label.
+    std::vector<std::pair<Label, size_t>> label_counts;
+    Labels merge_candidate_labels;
+  };
+
+  // Scratch space of a worker for counting the votes of a segment. Counts
+  // and flags are indexed by label, and only the entries of the voted
+  // labels are reset after every segment, so the memory is reused.
+  struct LabelVoteArena {
+    std::vector<size_t> label_counts;
+    std::vector<uint8_t> is_merge_candidate;
+    Labels voted_labels;
+    Labels merge_candidate_labels;
+  };
+
+  // Label voxel a segment voted with, copied from the map, and the number of
+  // segment points that fell into it.
+  struct CachedVoxelLabels {
+    LabelVoxel label_voxel;
+    size_t num_points;
+  };
+
+  // Voxels of a segment that passed the distance test, in voting order.
+  typedef AlignedVector<CachedVoxelLabels> SegmentVoxelLabels;
+
+  // Points of all segments of a frame, transformed and voxelized once. The
+  // world frame points and indices are stored one coordinate per column.
+  struct PreprocessedFrame {
+    Transformation T_G_C;
+    std::vector<const Segment*> segments;
+    // First point and number of points of every segment.
+    std::unordered_map<const Segment*, std::pair<size_t, size_t>>
+        segment_ranges;
+    Pointcloud points_C;
+    Colors colors;
+    // One column per point, so that the coordinates of a point are
+    // contiguous.
+    Eigen::Matrix<FloatingPoint, 3, Eigen::Dynamic> points_G;
+    Eigen::Matrix<LongIndexElement, 3, Eigen::Dynamic> global_voxel_indices;
+    Eigen::Matrix<IndexElement, 3, Eigen::Dynamic> block_indices;
+    bool is_valid = false;
+  };
+
+  // Label voxels rendered into the camera of a frame. Every pixel holds the
+  // closest voxel that passes the label propagation distance test and
+  // covers the pixel, pixels without one have an infinite depth.
+  struct RenderedLabels {
+    Transformation T_C_G;
+    CameraIntrinsics intrinsics;
+    DepthImage depth_image;
+    // Row-major, like the images.
+    AlignedVector<LabelVoxel> label_voxels;
+    // Whether the segments of the current frame vote from the rendering.
+    bool is_valid = false;
+    // Whether the rendering can be reused by the temporal label cache, and
+    // the net number of voxel label changes since it was rendered.
+    bool is_reusable = false;
+    size_t num_voxel_label_changes = 0u;
+  };
+
+  // Segment label pair of the greedy label assignment. Pairs are ordered by
+  // count, ties are won by the smaller label and then the smaller segment,
+  // which is the order a scan over the candidates map finds them in.
+  struct LabelAssignmentCandidate {
+    size_t count;
+    Label label;
+    Segment* segment;
+
+    inline bool operator<(const LabelAssignmentCandidate& other) const {
+      if (count != other.count) {
+        return count < other.count;
+      }
+      if (label != other.label) {
+        return label > other.label;
+      }
+      return std::less<Segment*>()(other.segment, segment);
+    }
+  };
+
+  // State of the greedy label assignment of a frame. Cleared rather than
+  // reallocated for every frame.
+  struct LabelAssignment {
+    // Max-heap of the candidate pairs, kept with std::push_heap() and
+    // std::pop_heap(). Pairs are not removed when their count changes or
+    // their label or segment gets assigned, instead they are skipped once
+    // they reach the top.
+    std::vector<LabelAssignmentCandidate> queue;
+    // Labels every segment is a candidate of.
+    std::unordered_map<Segment*, Labels> segment_labels;
+  };
+
+  // Voxel of a block and the number of segment points that fell into it.
+  struct VoxelMultiplicity {
+    VoxelIndex voxel_idx;
+    size_t num_points;
+  };
+
+  static constexpr size_t kNumRaysPerBatch = 8u * BatchRayCaster::kNumLanes;
+
+  static constexpr size_t kNumRegionOwnersPerThread = 4u;
+
   // Label propagation.
+  // Queues the pairs of the candidates that are eligible for assignment.
+  void initLabelAssignment(
+      const std::map<Label, std::map<Segment*, size_t>>& candidates,
+      LabelAssignment* label_assignment);
+
+  // Queues the pairs of segment with labels and indexes them.
+  void queueLabelCandidates(
+      Segment* segment, const Labels& labels,
+      const std::map<Label, std::map<Segment*, size_t>>& candidates,
+      LabelAssignment* label_assignment);
+
   // Fetch the next segment label pair which has overall
   // the highest voxel count.
   bool getNextSegmentLabelPair(
       const std::set<Segment*>& labelled_segments,
-      std::set<Label>* assigned_labels,
+      LabelSet* assigned_labels,
       std::map<voxblox::Label, std::map<voxblox::Segment*, size_t>>* candidates,
       std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
+      LabelAssignment* label_assignment,
       std::pair<Segment*, Label>* segment_label_pair);
 
-  Label getNextUnassignedLabel(const LabelVoxel& voxel,
-                               const std::set<Label>& assigned_labels);
+  // Gets the voxels of the segment points, grouped by block, so that every
+  // block only needs to be looked up once per segment.
+  void getSegmentVoxelsByBlock(const Segment& segment,
+                               BlockVoxelsMap* block_voxels) const;
 
-  void checkForSegmentLabelMergeCandidate(
-      const Label& label, const int label_points_count,
-      const int segment_points_count,
-      std::unordered_set<Label>* merge_candidate_labels);
+  // Same as getSegmentVoxelsByBlock(), from the indices of the preprocessed
+  // frame. Returns false if the segment is not part of it or has moved.
+  bool getPreprocessedSegmentVoxelsByBlock(const Segment& segment,
+                                           BlockVoxelsMap* block_voxels) const;
 
-  void increaseLabelCountForSegment(
-      Segment* segment, const Label& label, const int segment_points_count,
+  // Same as MergedTsdfIntegrator::bundleRays() for the points of the
+  // preprocessed frame, with the precomputed voxel indices.
+  void bundlePreprocessedRays(
+      const bool freespace_points,
+      LongIndexHashMapType<AlignedVector<size_t>>::type* voxel_map,
+      LongIndexHashMapType<AlignedVector<size_t>>::type* clear_map) const;
+
+  // Collapses the duplicates in voxel_indices, which all lie in one block.
+  void countUniqueVoxels(const VoxelIndexList& voxel_indices,
+                         std::vector<VoxelMultiplicity>* unique_voxels) const;
+
+  Label getNextUnassignedLabel(const LabelVoxel& voxel,
+                               const LabelSet& assigned_labels);
+
+  void checkForSegmentLabelMergeCandidate(const Label& label,
+                                          const int label_points_count,
+                                          const int segment_points_count,
+                                          LabelVoteArena* vote_arena);
+
+  // Adds num_points points of a segment to the count of label.
+  void increaseLabelCountForSegment(const Label& label,
+                                    const int segment_points_count,
+                                    const size_t num_points,
+                                    LabelVoteArena* vote_arena);
+
+  // Moves the votes counted in vote_arena to votes and resets the arena.
+  void collectSegmentLabelVotes(LabelVoteArena* vote_arena,
+                                SegmentLabelVotes* votes);
+
+  // Counts the votes of the voxels of segment for the labels that are not
+  // in assigned_labels. Only reads the map, thread safe as long as no two
+  // threads use the same worker_idx. If given, voxel_labels is set to the
+  // voxels that were voted with.
+  void voteSegmentLabels(const Segment& segment,
+                         const LabelSet& assigned_labels,
+                         const size_t worker_idx, SegmentLabelVotes* votes,
+                         SegmentVoxelLabels* voxel_labels = nullptr);
+
+  // Gets the blocks of both layers at block_idx, from the active block set
+  // if it holds them and otherwise from the layers.
+  void getTsdfAndLabelBlocks(const BlockIndex& block_idx,
+                             Block<TsdfVoxel>::ConstPtr* tsdf_block,
+                             Block<LabelVoxel>::ConstPtr* label_block) const;
+
+  // Whether the last label rendering is close enough to the camera at T_G_C
+  // and recent enough to be reused by the temporal label cache.
+  bool canReuseRenderedLabels(const Transformation& T_G_C,
+                              const CameraIntrinsics& intrinsics) const;
+
+  // Same as voteSegmentLabels(), but votes with the rendered voxels of the
+  // pixels the segment points project into. Points farther than the label
+  // propagation distance from the rendered surface do not vote.
+  void voteRenderedSegmentLabels(const Segment& segment,
+                                 const LabelSet& assigned_labels,
+                                 const size_t worker_idx,
+                                 SegmentLabelVotes* votes,
+                                 SegmentVoxelLabels* voxel_labels);
+
+  // Same as voteSegmentLabels(), but votes with the voxels recorded by it
+  // instead of reading them from the map.
+  void voteCachedSegmentLabels(const SegmentVoxelLabels& voxel_labels,
+                               const int segment_points_count,
+                               const LabelSet& assigned_labels,
+                               const size_t worker_idx,
+                               SegmentLabelVotes* votes);
+
+  // Adds the votes of segment to the candidates. A segment without any vote
+  // becomes the candidate of a fresh label. If given, candidate_labels is
+  // set to the labels segment was added to. Not thread safe.
+  void addSegmentLabelCandidates(
+      Segment* segment, const SegmentLabelVotes& votes,
       std::map<Label, std::map<Segment*, size_t>>* candidates,
-      std::unordered_set<Label>* merge_candidate_labels);
+      std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
+      Labels* candidate_labels = nullptr);
 
   void increasePairwiseConfidenceCount(
       const std::vector<Label>& merge_candidates);
@@ -132,45 +519,277 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
   void changeLabelCount(const Label& label, const int count);
 
   // Will return a pointer to a voxel located at global_voxel_idx in the label
-  // layer. Thread safe.
+  // layer. Thread safe as long as no two threads use the same worker_idx.
   // Takes in the last_block_idx and last_block to prevent unneeded map
   // lookups. If the block this voxel would be in has not been allocated, a
-  // block in temp_label_block_map_ is created/accessed and a voxel from this
-  // map is returned instead. Unlike the layer, accessing
-  // temp_label_block_map_ is controlled via a mutex allowing it to grow
-  // during integration. These temporary blocks can be merged into the layer
-  // later by calling updateLayerWithStoredBlocks()
+  // block in the temporary block map of the worker is created/accessed and a
+  // voxel from this map is returned instead. These temporary blocks can be
+  // merged into the layer later by calling updateLabelLayerWithStoredBlocks()
   LabelVoxel* allocateStorageAndGetLabelVoxelPtr(
-      const GlobalIndex& global_voxel_idx, Block<LabelVoxel>::Ptr* last_block,
-      BlockIndex* last_block_idx);
+      const GlobalIndex& global_voxel_idx, const size_t worker_idx,
+      Block<LabelVoxel>::Ptr* last_block, BlockIndex* last_block_idx);
+
+  // Same as allocateStorageAndGetLabelVoxelPtr(), but returns nullptr instead
+  // of allocating a block if none exists for the voxel.
+  LabelVoxel* getAllocatedLabelVoxelPtr(const GlobalIndex& global_voxel_idx,
+                                        const size_t worker_idx,
+                                        Block<LabelVoxel>::Ptr* last_block,
+                                        BlockIndex* last_block_idx);
+
+  // Adds the votes of source_voxel to target_voxel. If not all labels fit
+  // into the voxel, the most confident ones are kept.
+  void mergeLabelVoxelVotes(const LabelVoxel& source_voxel,
+                            LabelVoxel* target_voxel);
+
+  // Combines the votes of blocks that several workers allocated at the same
+  // index into the first one and corrects the label counts.
+  void mergeDuplicateLabelBlocks(
+      const std::vector<Block<LabelVoxel>::Ptr>& label_blocks,
+      const size_t worker_idx);
 
   // NOT thread safe
   void updateLabelLayerWithStoredBlocks();
 
+  // Merges the temporary blocks of both layers into them, and combines the
+  // new blocks if the map uses combined blocks. NOT thread safe.
+  void updateLayersWithStoredBlocks();
+
+  // Gets the label block at block_idx unpacked for writing, if it is packed
+  // in the map, or nullptr. The unpacked blocks are shared by all workers and
+  // moved into the label layer by updateLabelLayerWithStoredBlocks(). Thread
+  // safe.
+  Block<LabelVoxel>::Ptr getUnpackedLabelBlockPtr(const BlockIndex& block_idx);
+
+  // Unpacks the label blocks of the active blocks, so that the integration
+  // finds them in the set.
+  void unpackActiveLabelBlocks();
+
   // Updates label_voxel. Thread safe.
+  // The label count changes are accumulated for the worker worker_idx and
+  // only applied to the map by reduceLabelCountDeltas().
   void updateLabelVoxel(const Point& point_G, const Label& label,
-                        LabelVoxel* label_voxel,
-                        const LabelConfidence& confidence = 1u);
+                        const LabelConfidence& confidence,
+                        const size_t worker_idx, LabelVoxel* label_voxel);
+
+  // Updates label_voxel without locking it, the caller needs to be the only
+  // one accessing it.
+  void updateLabelVoxelUnlocked(const Label& label,
+                                const LabelConfidence& confidence,
+                                const size_t worker_idx,
+                                LabelVoxel* label_voxel);
+
+  // Updates label_voxel with a compare-and-swap loop on the whole voxel
+  // instead of locking it. Thread safe.
+  void updateLabelVoxelLockFree(const Label& label,
+                                const LabelConfidence& confidence,
+                                const size_t worker_idx,
+                                LabelVoxel* label_voxel);
+
+  // Records the label count changes after the label of a voxel changed.
+  // Thread safe as long as no two threads use the same worker_idx.
+  void updateChangedVoxelLabel(const Label& previous_label,
+                               const Label& new_label,
+                               const size_t worker_idx);
+
+  // Applies the label count changes of all workers to the map and marks the
+  // changed labels as updated. NOT thread safe.
+  void reduceLabelCountDeltas();
+
+  // Records that label voted in the label block of the cache, for the label
+  // block index used by label recycling. Consecutive votes of the same
+  // label in the same block are only recorded once. Thread safe as long as
+  // no two threads use the same worker_idx.
+  inline void recordLabelVote(const Label& label, const size_t worker_idx,
+                              BlockCache* block_cache) {
+    if (!label_tsdf_config_.enable_label_recycling || label == 0u ||
+        (block_cache->voted_label == label &&
+         block_cache->voted_label_block == block_cache->label_block.get())) {
+      return;
+    }
+    block_cache->voted_label = label;
+    block_cache->voted_label_block = block_cache->label_block.get();
+    label_block_votes_[worker_idx].emplace_back(label,
+                                                block_cache->label_block_idx);
+  }
+
+  // Adds the label votes recorded by all workers to the label block index.
+  // NOT thread safe.
+  void reduceLabelBlockVotes();
+
+  // Adds every label with votes in the label block to the label block index.
+  void indexLabelBlock(const BlockIndex& block_idx,
+                       const Block<LabelVoxel>& label_block);
+
+  // Merges all points that ended in the same voxel into a single ray.
+  MergedRay mergeRay(const Transformation& T_G_C, const Pointcloud& points_C,
+                     const Colors& colors, const Labels& labels,
+                     const bool clearing_ray,
+                     const VoxelMapElement& global_voxel_idx_to_point_indices);
+
+  // Updates the tsdf and label voxel at global_voxel_idx with a merged ray.
+  // The voxels are only locked if lock_voxel is set, otherwise the caller
+  // needs to be the only one updating them.
+  void updateRayVoxel(const Point& origin, const MergedRay& merged_ray,
+                      const GlobalIndex& global_voxel_idx,
+                      const bool lock_voxel, const size_t worker_idx,
+                      BlockCache* block_cache);
+
+  // Fills a miss of the block cache from the active blocks, so that only the
+  // blocks outside of the set are looked up in the layers.
+  inline void getActiveBlocks(const GlobalIndex& global_voxel_idx,
+                              BlockCache* block_cache) const {
+    if (!active_blocks_.isValid()) {
+      return;
+    }
+    const BlockIndex block_idx = getBlockIndexFromGlobalVoxelIndex(
+        global_voxel_idx, voxels_per_side_inv_);
+    if (block_cache->tsdf_block != nullptr &&
+        block_cache->tsdf_block_idx == block_idx) {
+      return;
+    }
+    const ActiveBlockSet::ActiveBlock* active_block =
+        active_blocks_.getBlock(block_idx);
+    if (active_block == nullptr) {
+      return;
+    }
+    block_cache->tsdf_block = active_block->tsdf_block;
+    block_cache->tsdf_block_idx = block_idx;
+    if (active_block->label_block != nullptr) {
+      block_cache->label_block = active_block->label_block;
+      block_cache->label_block_idx = block_idx;
+    }
+  }
+
+  // Fills a miss of the block cache from the combined blocks of the map, so
+  // that the tsdf and the label block are found with a single lookup.
+  inline void getCombinedBlocks(const GlobalIndex& global_voxel_idx,
+                                BlockCache* block_cache) const {
+    if (!map_->usesCombinedBlocks()) {
+      return;
+    }
+    const BlockIndex block_idx = getBlockIndexFromGlobalVoxelIndex(
+        global_voxel_idx, voxels_per_side_inv_);
+    if (block_cache->tsdf_block != nullptr &&
+        block_cache->tsdf_block_idx == block_idx) {
+      return;
+    }
+    const LabelTsdfMap::CombinedBlock* combined_block =
+        map_->getCombinedBlockPtrByIndex(block_idx);
+    if (combined_block == nullptr) {
+      return;
+    }
+    block_cache->tsdf_block = combined_block->tsdf_block;
+    block_cache->tsdf_block_idx = block_idx;
+    block_cache->label_block = combined_block->label_block;
+    block_cache->label_block_idx = block_idx;
+  }
+
+  // Same as TsdfIntegratorBase::updateTsdfVoxel() without locking the voxel.
+  void updateTsdfVoxelUnlocked(const Point& origin, const Point& point_G,
+                               const GlobalIndex& global_voxel_idx,
+                               const Color& color, const float weight,
+                               TsdfVoxel* tsdf_voxel) const;
+
+  // Label of a merged ray, the most frequent label among its points.
+  Label getMergedLabel(const Labels& labels,
+                       const AlignedVector<size_t>& point_indices,
+                       const bool clearing_ray) const;
+
+  // Whether a voxel traversed by a ray is skipped by anti-grazing, because
+  // points of another ray ended in it.
+  bool isGrazingVoxel(
+      const GlobalIndex& global_voxel_idx, const GlobalIndex& end_voxel_idx,
+      const bool clearing_ray,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map)
+      const;
 
   void integrateVoxel(
       const Transformation& T_G_C, const Pointcloud& points_C,
-      const Colors& colors, const Label& label, const bool enable_anti_grazing,
-      const bool clearing_ray,
+      const Colors& colors, const Labels& labels,
+      const bool enable_anti_grazing, const bool clearing_ray,
       const VoxelMapElement& global_voxel_idx_to_point_indices,
-      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map);
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
+      const size_t worker_idx);
 
   void integrateVoxels(
       const Transformation& T_G_C, const Pointcloud& points_C,
-      const Colors& colors, const Label& label, const bool enable_anti_grazing,
-      const bool clearing_ray,
+      const Colors& colors, const Labels& labels,
+      const bool enable_anti_grazing, const bool clearing_ray,
       const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
       const LongIndexHashMapType<AlignedVector<size_t>>::type& clear_map,
-      const size_t thread_idx);
+      const size_t thread_idx, const size_t worker_idx);
+
+  // Casts the merged rays of ray_batch together and integrates them. Clears
+  // the batch afterwards.
+  void integrateRayBatch(
+      const Point& origin, const bool enable_anti_grazing,
+      const bool clearing_ray,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
+      const size_t worker_idx, RayBatch* ray_batch);
+
+  // Merges the rays of one stripe of ray_map and queues their voxels for the
+  // workers owning the block regions the voxels fall into.
+  void queueRayVoxels(
+      const Transformation& T_G_C, const Pointcloud& points_C,
+      const Colors& colors, const Labels& labels,
+      const bool enable_anti_grazing, const bool clearing_ray,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& ray_map,
+      const size_t thread_idx, RayPartition* ray_partition);
+
+  // Integrates the rays with every block region being updated by exactly one
+  // worker.
+  void integrateRaysPartitioned(
+      const Transformation& T_G_C, const Pointcloud& points_C,
+      const Colors& colors, const Labels& labels,
+      const bool enable_anti_grazing,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
+      const LongIndexHashMapType<AlignedVector<size_t>>::type& clear_map);
 
+  inline bool hasLabelBand() const {
+    return label_tsdf_config_.label_band_truncation_factor > 0.0f;
+  }
+
+  // Whether label voxels are allocated at this distance to the surface.
+  inline bool isInLabelBand(const FloatingPoint sdf) const {
+    return !hasLabelBand() ||
+           std::abs(sdf) < label_tsdf_config_.label_band_truncation_factor *
+                               config_.default_truncation_distance;
+  }
+
+  // Gets the label voxel at global_voxel_idx. It is allocated if the voxel
+  // is in the label band, otherwise nullptr is returned if it does not exist.
+  LabelVoxel* getLabelVoxelPtrInBand(const GlobalIndex& global_voxel_idx,
+                                     const FloatingPoint sdf,
+                                     const size_t worker_idx,
+                                     BlockCache* block_cache);
+
+  // Allocates the tsdf blocks within the truncation distance of the depth
+  // measurements and gets them, together with the allocated blocks in the
+  // camera frustum if voxel carving is enabled.
+  void getProjectiveBlocks(const Transformation& T_G_C,
+                           const DepthImage& depth_image,
+                           const CameraIntrinsics& intrinsics,
+                           BlockIndexList* block_indices);
+
+  // Projects every voxel of the block at block_idx into the images and
+  // updates it. Thread safe as long as no two threads update the same block.
+  void integrateBlockProjectively(const Transformation& T_G_C,
+                                  const DepthImage& depth_image,
+                                  const SegmentIndexImage& segment_index_image,
+                                  const CameraIntrinsics& intrinsics,
+                                  const Labels& segment_labels,
+                                  const BlockIndex& block_idx,
+                                  const size_t worker_idx);
+
+  // Integrates the surface rays and then the clearing rays. With
+  // fuse_ray_passes every worker integrates its stripe of both in a single
+  // pass instead, which saves a pass and a merge of the new blocks, but lets
+  // clearing rays update a voxel before surface rays of other stripes.
   void integrateRays(
       const Transformation& T_G_C, const Pointcloud& points_C,
-      const Colors& colors, const Label& label, const bool enable_anti_grazing,
-      const bool clearing_ray,
+      const Colors& colors, const Labels& labels,
+      const bool enable_anti_grazing, const bool fuse_ray_passes,
       const LongIndexHashMapType<AlignedVector<size_t>>::type& voxel_map,
       const LongIndexHashMapType<AlignedVector<size_t>>::type& clear_map);
 
@@ -193,26 +812,28 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
 
   bool getNextMerge(Label* new_label, Label* old_label);
 
-  inline Label getFreshLabel() {
-    CHECK_LT(*highest_label_ptr_, std::numeric_limits<unsigned short>::max());
-    return ++(*highest_label_ptr_);
-  }
+  Label getFreshLabel();
 
-  inline InstanceLabel getFreshInstance() {
-    CHECK_LT(*highest_instance_ptr_,
-             std::numeric_limits<unsigned short>::max());
-    return ++(*highest_instance_ptr_);
-  }
+  InstanceLabel getFreshInstance();
+
+  // Moves the labels that have been dead for long enough to the recycled
+  // labels, except for the ones that are about to be published, which are
+  // checked again later. Called once per frame.
+  void recycleDeadLabels(const std::set<Label>& published_labels);
+
+  // Removes the votes for the labels from the voxels of the blocks they
+  // voted in, so that a recycled label does not inherit the votes of its
+  // previous segment. The label of every scrubbed voxel is decided again.
+  void removeLabelVotes(const std::set<Label>& labels);
+
+  // Drops the pairwise confidence counts from and to a label.
+  void removePairwiseConfidence(const Label& label);
 
   // Label layer.
   LabelTsdfConfig label_tsdf_config_;
+  LabelTsdfMap* map_;
   Layer<LabelVoxel>* label_layer_;
 
-  // Temporary block storage, used to hold blocks that need to be created
-  // while integrating a new pointcloud.
-  std::mutex temp_label_block_mutex_;
-  Layer<LabelVoxel>::BlockHashMap temp_label_block_map_;
-
   // We need to prevent simultaneous access to the voxels in the map. We
   // could
   // put a single mutex on the map or on the blocks, but as voxel updating
@@ -227,9 +848,49 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
   // (num_threads / (2^n)). For 8 threads and 12 bits this gives 0.2%.
   ApproxHashArray<12, std::mutex, GlobalIndex, LongIndexHash> mutexes_;
 
+  // Long-lived worker threads used for ray integration, so that integrating
+  // a segment does not spawn and join integrator_threads new threads.
+  ThreadPool thread_pool_;
+
+  // Temporary block storage, used to hold blocks that need to be created
+  // while integrating a new pointcloud. Every worker of the thread pool
+  // stages its blocks separately, duplicates are merged afterwards.
+  std::vector<Layer<LabelVoxel>::BlockHashMap> temp_label_block_maps_;
+
+  // Packed label blocks the current pass writes to, unpacked once for all
+  // workers.
+  Layer<LabelVoxel>::BlockHashMap unpacked_label_blocks_;
+  std::mutex unpacked_label_blocks_mutex_;
+
+  // Label count changes of the current pass, accumulated per worker.
+  std::vector<LabelCountDeltas> label_count_deltas_;
+
+  // Label votes of the current pass, recorded per worker.
+  std::vector<LabelBlockVotes> label_block_votes_;
+
+  BatchRayCaster batch_ray_caster_;
+
+  // Buffers of the spatially partitioned integration, kept to reuse their
+  // memory across frames.
+  std::vector<RayPartition> ray_partitions_;
+
+  // Voxels every segment of the current frame voted with, kept until its
+  // labels are decided if the label propagation cache is enabled.
+  std::unordered_map<Segment*, SegmentVoxelLabels> segment_voxel_labels_;
+
+  // Label propagation bookkeeping, reused across frames.
+  std::vector<LabelVoteArena> label_vote_arenas_;
+  LabelSet assigned_labels_;
+  LabelAssignment label_assignment_;
+  RenderedLabels rendered_labels_;
+
+  // Blocks in the view frustum or point bounding box of the current frame.
+  ActiveBlockSet active_blocks_;
+
+  PreprocessedFrame preprocessed_frame_;
+
   Label* highest_label_ptr_;
   LMap* label_count_map_ptr_;
-  std::mutex updated_labels_mutex_;
   std::set<Label> updated_labels_;
 
   // Pairwise confidence merging.
@@ -246,6 +907,15 @@ class LabelTsdfIntegrator : public MergedTsdfIntegrator {
 
   // Object database.
   LMap labels_to_publish_;
+
+  // Label recycling. Labels whose voxel count dropped to zero or that were
+  // issued without winning a voxel, with the frame they died or were issued
+  // in, and the labels ready to be issued again.
+  std::deque<std::pair<Label, size_t>> dead_labels_;
+  std::set<Label> recycled_labels_;
+  size_t num_frames_;
+  // Label blocks every label holds votes in, only kept with label recycling.
+  std::unordered_map<Label, IndexSet> label_block_index_;
 };
 
 }  // namespace voxblox
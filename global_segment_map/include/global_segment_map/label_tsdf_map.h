@@ -2,6 +2,7 @@
 #define GLOBAL_SEGMENT_MAP_LABEL_TSDF_MAP_H_
 
 #include <memory>
+#include <string>
 #include <utility>
 
 #include <glog/logging.h>
@@ -11,6 +12,8 @@
 
 #include "global_segment_map/label_voxel.h"
 #include "global_segment_map/semantic_instance_label_fusion.h"
+#include "global_segment_map/utils/compact_label_voxel.h"
+#include "global_segment_map/utils/sparse_label_block.h"
 
 namespace voxblox {
 
@@ -20,11 +23,40 @@ class LabelTsdfMap {
 
   typedef std::pair<Layer<TsdfVoxel>, Layer<LabelVoxel>> LayerPair;
 
+  // How the label blocks that are not integrated into are stored.
+  enum InactiveLabelBlockEncoding {
+    // They stay in the label layer.
+    kDense = 0,
+    // They are packed into compact label voxels, which take half of the
+    // space but quantize the confidences and keep fewer label votes.
+    kCompact,
+    // Only their labelled voxels are kept, without any loss. These are
+    // mostly the ones close to the surface.
+    kSparse
+  };
+
   struct Config {
     FloatingPoint voxel_size = 0.2;
     size_t voxels_per_side = 16u;
+    // Save the label layer in the compact encoding, which takes half of the
+    // space but quantizes the confidences and keeps fewer label votes.
+    bool compact_label_layer_on_save = false;
+    InactiveLabelBlockEncoding inactive_label_block_encoding = kDense;
+    // Store the tsdf and the label block of every block index together, so
+    // that both are found with a single lookup. Every tsdf block then has a
+    // label block, whose voxels outside of the label band are updated as
+    // well, and label blocks can not be packed.
+    bool use_combined_blocks = false;
+  };
+
+  // The tsdf and the label block at the same block index.
+  struct CombinedBlock {
+    Block<TsdfVoxel>::Ptr tsdf_block;
+    Block<LabelVoxel>::Ptr label_block;
   };
 
+  typedef AnyIndexHashMapType<CombinedBlock>::type CombinedBlockMap;
+
   explicit LabelTsdfMap(const Config& config)
       : tsdf_layer_(
             new Layer<TsdfVoxel>(config.voxel_size, config.voxels_per_side)),
@@ -32,7 +64,11 @@ class LabelTsdfMap {
             new Layer<LabelVoxel>(config.voxel_size, config.voxels_per_side)),
         config_(config),
         highest_label_(0u),
-        highest_instance_(0u) {}
+        highest_instance_(0u) {
+    CHECK(!config_.use_combined_blocks ||
+          config_.inactive_label_block_encoding == kDense)
+        << "Combined blocks can not be packed.";
+  }
 
   virtual ~LabelTsdfMap() {}
 
@@ -44,6 +80,82 @@ class LabelTsdfMap {
     return *label_layer_;
   }
 
+  // With combined blocks, the tsdf and the label layer are views of the
+  // combined blocks: they share their blocks with them. Blocks need to be
+  // allocated through allocateCombinedBlockByIndex(), or be added to the
+  // combined blocks with it after they were inserted into either layer.
+
+  inline bool usesCombinedBlocks() const { return config_.use_combined_blocks; }
+
+  // Gets the tsdf and the label block at block_idx with a single lookup, or
+  // nullptr if they are not allocated. Thread safe as long as no blocks are
+  // allocated.
+  inline const CombinedBlock* getCombinedBlockPtrByIndex(
+      const BlockIndex& block_idx) const {
+    auto it = combined_blocks_.find(block_idx);
+    return it != combined_blocks_.end() ? &it->second : nullptr;
+  }
+
+  // Allocates the blocks at block_idx that neither layer holds yet and
+  // combines them. NOT THREAD SAFE.
+  const CombinedBlock& allocateCombinedBlockByIndex(
+      const BlockIndex& block_idx);
+
+  inline size_t getNumberOfCombinedBlocks() const {
+    return combined_blocks_.size();
+  }
+
+  // Label blocks that are not integrated into can be packed out of the label
+  // layer into the inactive label block encoding. Readers that go through
+  // getLabelBlockPtrByIndex() densify packed blocks on access, writers need
+  // to unpack them into the label layer first.
+
+  // Packs the label block at block_idx, unless the encoding is kDense.
+  // NOT THREAD SAFE.
+  void packLabelBlock(const BlockIndex& block_idx);
+
+  // Moves the packed label block at block_idx back into the label layer.
+  // Returns the label block of the layer, or nullptr if there is none.
+  // NOT THREAD SAFE.
+  Block<LabelVoxel>::Ptr unpackLabelBlock(const BlockIndex& block_idx);
+
+  // Inserts a label block into the label layer, replacing the packed label
+  // block at block_idx. NOT THREAD SAFE.
+  void insertLabelBlock(const BlockIndex& block_idx,
+                        const Block<LabelVoxel>::Ptr& label_block);
+
+  // Decodes the packed label block at block_idx into a new block, or returns
+  // nullptr if it is not packed.
+  Block<LabelVoxel>::Ptr decodePackedLabelBlock(
+      const BlockIndex& block_idx) const;
+
+  // Gets the label block at block_idx from the label layer, or a decoded copy
+  // of it if it is packed. Thread safe as long as no blocks are packed or
+  // unpacked.
+  Block<LabelVoxel>::ConstPtr getLabelBlockPtrByIndex(
+      const BlockIndex& block_idx) const;
+
+  inline bool hasPackedLabelBlocks() const {
+    return !compact_label_blocks_.empty() || !sparse_label_blocks_.empty();
+  }
+
+  inline bool isLabelBlockPacked(const BlockIndex& block_idx) const {
+    return compact_label_blocks_.count(block_idx) > 0u ||
+           sparse_label_blocks_.count(block_idx) > 0u;
+  }
+
+  inline size_t getNumberOfPackedLabelBlocks() const {
+    return compact_label_blocks_.size() + sparse_label_blocks_.size();
+  }
+
+  size_t getPackedLabelBlocksMemorySize() const;
+
+  // Gets the indices of the label blocks of the label layer and of the packed
+  // label blocks.
+  void getAllLabelBlockIndices(BlockIndexList* block_indices) const;
+
+  inline const Config& getConfig() const { return config_; }
+
   inline LMap* getLabelCountPtr() { return &label_count_map_; }
 
   inline Label* getHighestLabelPtr() { return &highest_label_; }
@@ -94,6 +206,17 @@ class LabelTsdfMap {
       const InstanceLabels& instance_labels,
       std::unordered_map<InstanceLabel, LayerPair>* instance_layers_map);
 
+  // Saves the tsdf layer and the label layer to a single file. Packed label
+  // blocks are saved along, they are decoded one by one unless they are
+  // saved in their own encoding.
+  bool saveToFile(const std::string& file_path) const;
+
+  // Loads the layers saved by saveToFile, with either label layer encoding,
+  // and recounts the voxels of every label. The semantic instance label
+  // fusion is not saved.
+  // NOT THREAD SAFE.
+  bool loadFromFile(const std::string& file_path);
+
  protected:
   Config config_;
 
@@ -101,6 +224,14 @@ class LabelTsdfMap {
   Layer<TsdfVoxel>::Ptr tsdf_layer_;
   Layer<LabelVoxel>::Ptr label_layer_;
 
+  // Label blocks packed out of the label layer.
+  AnyIndexHashMapType<Block<CompactLabelVoxel>::Ptr>::type
+      compact_label_blocks_;
+  SparseLabelBlockMap sparse_label_blocks_;
+
+  // Blocks of both layers by their index, only used with combined blocks.
+  CombinedBlockMap combined_blocks_;
+
   // Bookkeping.
   Label highest_label_;
   LMap label_count_map_;
@@ -8,14 +8,41 @@
 
 #include "global_segment_map/common.h"
 
+// Set by the GSM_LABEL_VOXEL_NUM_SLOTS CMake variable, which is exported to
+// the dependent packages so that they agree on the voxel layout.
+#ifndef GSM_LABEL_VOXEL_NUM_SLOTS
+#define GSM_LABEL_VOXEL_NUM_SLOTS 3
+#endif
+
 namespace voxblox {
 
-struct LabelVoxel {
+// Number of labels every voxel keeps the votes of. Once all slots are taken,
+// a new label replaces the least confident one and inherits its confidence.
+constexpr size_t kNumLabelVoxelSlots = GSM_LABEL_VOXEL_NUM_SLOTS;
+static_assert(kNumLabelVoxelSlots >= 2u,
+              "LabelVoxel needs at least two label vote slots.");
+
+// Lock-free label updates swap a voxel with a single 16 byte
+// compare-and-swap, which needs it aligned to two machine words. Otherwise the
+// voxel keeps its natural alignment, so that no slot count pays for padding.
+#ifdef GSM_LOCK_FREE_LABEL_UPDATES
+constexpr size_t kLabelVoxelAlignment = 16u;
+#else
+constexpr size_t kLabelVoxelAlignment = alignof(LabelCount);
+#endif
+
+struct alignas(kLabelVoxelAlignment) LabelVoxel {
   Label label = 0u;
   LabelConfidence label_confidence = 0u;
-  LabelCount label_count[3];
+  LabelCount label_count[kNumLabelVoxelSlots];
 };
 
+#ifdef GSM_LOCK_FREE_LABEL_UPDATES
+static_assert(sizeof(LabelVoxel) == 16u,
+              "Lock-free label updates need LabelVoxel to fit in two machine "
+              "words, which allows for at most three label vote slots.");
+#endif
+
 namespace voxel_types {
 const std::string kLabel = "label";
 }  // namespace voxel_types
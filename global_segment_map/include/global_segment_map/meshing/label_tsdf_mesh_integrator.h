@@ -81,6 +81,11 @@ class MeshLabelIntegrator : public MeshIntegrator<TsdfVoxel> {
 
   void updateMeshColor(const Block<LabelVoxel>& label_block, Mesh* mesh);
 
+  // Gets the label block at block_index through the map if there is one,
+  // which densifies packed label blocks, and from the label layer otherwise.
+  Block<LabelVoxel>::ConstPtr getLabelBlockPtrByIndex(
+      const BlockIndex& block_index) const;
+
   LabelTsdfConfig label_tsdf_config_;
 
   // Having both a const and a mutable pointer to the layer allows this
@@ -89,6 +94,7 @@ class MeshLabelIntegrator : public MeshIntegrator<TsdfVoxel> {
   // the updated flag).
   Layer<LabelVoxel>* label_layer_mutable_ptr_;
   const Layer<LabelVoxel>* label_layer_const_ptr_;
+  const LabelTsdfMap* map_ptr_;
 
   const SemanticInstanceLabelFusion* semantic_instance_label_fusion_ptr_;
 
@@ -7,6 +7,9 @@ namespace voxblox {
 
 class Segment {
  public:
+  // Empty segment, the points are added by the caller.
+  explicit Segment(const Transformation& T_G_C);
+
   Segment(const pcl::PointCloud<voxblox::PointType>& point_cloud,
           const Transformation& T_G_C);
 
@@ -2,6 +2,7 @@
 #define GLOBAL_SEGMENT_MAP_SEMANTIC_LABEL_FUSION_H_
 
 #include <map>
+#include <set>
 
 #include "global_segment_map/common.h"
 
@@ -31,6 +32,12 @@ class SemanticInstanceLabelFusion {
 
   SemanticLabel getSemanticLabel(const Label& label) const;
 
+  // Drops all counts of a label, so that it can be reused.
+  void removeLabel(const Label& label);
+
+  // Gets the instances that any label voted for.
+  void getUsedInstanceLabels(std::set<InstanceLabel>* instance_labels) const;
+
  protected:
   std::map<Label, std::map<InstanceLabel, int>> label_instance_count_;
   std::map<Label, int> label_frames_count_;
@@ -13,6 +13,11 @@ void LayerTest<LabelVoxel>::CompareVoxel(const LabelVoxel& voxel_A,
                                          const LabelVoxel& voxel_B) const {
   CHECK_EQ(voxel_A.label, voxel_B.label);
   CHECK_EQ(voxel_A.label_confidence, voxel_B.label_confidence);
+  for (size_t i = 0u; i < kNumLabelVoxelSlots; ++i) {
+    CHECK_EQ(voxel_A.label_count[i].label, voxel_B.label_count[i].label);
+    CHECK_EQ(voxel_A.label_count[i].label_confidence,
+             voxel_B.label_count[i].label_confidence);
+  }
 }
 
 }  // namespace test
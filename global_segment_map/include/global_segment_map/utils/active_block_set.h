@@ -0,0 +1,104 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_ACTIVE_BLOCK_SET_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_ACTIVE_BLOCK_SET_H_
+
+#include <cstdint>
+#include <vector>
+
+#include <voxblox/core/block.h>
+#include <voxblox/core/common.h>
+#include <voxblox/core/layer.h>
+#include <voxblox/core/voxel.h>
+
+#include "global_segment_map/label_voxel.h"
+#include "global_segment_map/utils/image_utils.h"
+
+namespace voxblox {
+
+// Allocated blocks that lie in the view frustum of the camera of a frame, or
+// in the bounding box of its points. The blocks are looked up index by index
+// within the bounding box of the culling volume, so that updating the set
+// does not depend on the size of the map. They are indexed densely over
+// their bounding box, so that looking one up is an array access instead of a
+// hash map lookup.
+class ActiveBlockSet {
+ public:
+  // Block of the tsdf layer and the block of the label layer at the same
+  // index, which is nullptr if no label block is allocated there.
+  struct ActiveBlock {
+    BlockIndex block_idx;
+    Block<TsdfVoxel>::Ptr tsdf_block;
+    Block<LabelVoxel>::Ptr label_block;
+  };
+
+  // Collects the allocated tsdf blocks whose bounding sphere intersects the
+  // frustum of the camera at T_G_C up to max_depth.
+  void update(const Transformation& T_G_C, const CameraIntrinsics& intrinsics,
+              const FloatingPoint max_depth, Layer<TsdfVoxel>* tsdf_layer,
+              Layer<LabelVoxel>* label_layer);
+
+  // Collects the allocated tsdf blocks that intersect the axis-aligned box
+  // from min_G to max_G.
+  void update(const Point& min_G, const Point& max_G,
+              Layer<TsdfVoxel>* tsdf_layer, Layer<LabelVoxel>* label_layer);
+
+  // Drops all blocks and invalidates the set. Keeps the memory.
+  void clear();
+
+  inline bool isValid() const { return is_valid_; }
+
+  inline size_t size() const { return blocks_.size(); }
+
+  inline const AlignedVector<ActiveBlock>& getBlocks() const {
+    return blocks_;
+  }
+
+  // Sets the label block of the active block at block_pos in getBlocks(), for
+  // label blocks that only become available after the set was updated.
+  inline void setLabelBlock(const size_t block_pos,
+                            const Block<LabelVoxel>::Ptr& label_block) {
+    DCHECK_LT(block_pos, blocks_.size());
+    blocks_[block_pos].label_block = label_block;
+  }
+
+  // Gets the active block at block_idx, or nullptr if it is not active.
+  inline const ActiveBlock* getBlock(const BlockIndex& block_idx) const {
+    const BlockIndex local_idx = block_idx - min_block_idx_;
+    if ((local_idx.array() < 0).any() ||
+        (local_idx.array() >= grid_size_.array()).any()) {
+      return nullptr;
+    }
+    const int32_t block_pos = dense_index_[getDenseIndex(local_idx)];
+    return block_pos < 0 ? nullptr : &blocks_[block_pos];
+  }
+
+ private:
+  // Collects the allocated tsdf blocks that intersect the axis-aligned box
+  // from min_G to max_G and for which is_active returns true.
+  template <typename IsActiveFunction>
+  void collectBlocks(const Point& min_G, const Point& max_G,
+                     const IsActiveFunction& is_active,
+                     Layer<TsdfVoxel>* tsdf_layer,
+                     Layer<LabelVoxel>* label_layer);
+
+  // Indexes the collected blocks over their bounding box.
+  void buildDenseIndex();
+
+  inline size_t getDenseIndex(const BlockIndex& local_idx) const {
+    return (static_cast<size_t>(local_idx.z()) * grid_size_.y() +
+            local_idx.y()) *
+               grid_size_.x() +
+           local_idx.x();
+  }
+
+  bool is_valid_ = false;
+  AlignedVector<ActiveBlock> blocks_;
+
+  // Position of every block of the bounding box in blocks_, or -1.
+  BlockIndex min_block_idx_ = BlockIndex::Zero();
+  BlockIndex grid_size_ = BlockIndex::Zero();
+  std::vector<int32_t> dense_index_;
+};
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_ACTIVE_BLOCK_SET_H_
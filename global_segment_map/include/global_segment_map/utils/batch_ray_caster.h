@@ -0,0 +1,59 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_BATCH_RAY_CASTER_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_BATCH_RAY_CASTER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include <voxblox/core/common.h>
+
+namespace voxblox {
+
+// Casts many rays from a common origin at once. The rays are set up like
+// voxblox::RayCaster does and visit the same voxels in the same order, but
+// kNumLanes rays are advanced together with SIMD instructions. AVX2 is used
+// if the library is compiled with it, SSE2 otherwise and plain C++ on other
+// architectures.
+class BatchRayCaster {
+ public:
+  // Number of rays advanced together.
+  static constexpr size_t kNumLanes = 8u;
+
+  BatchRayCaster(const bool voxel_carving_enabled,
+                 const FloatingPoint max_ray_length_m,
+                 const FloatingPoint voxel_size_inv,
+                 const FloatingPoint truncation_distance);
+
+  // Casts a ray from origin to every point and stores the voxels the i-th
+  // ray traverses in (*ray_voxel_indices)[i].
+  void castRays(const Point& origin, const AlignedVector<Point>& points_G,
+                const bool clearing_ray,
+                std::vector<GlobalIndexVector>* ray_voxel_indices) const;
+
+ protected:
+  // Traversal state of kNumLanes rays, with one entry per lane and axis.
+  struct alignas(32) LaneState {
+    float t_to_next_boundary[3][kNumLanes];
+    float t_step_size[3][kNumLanes];
+    int32_t voxel_index[3][kNumLanes];
+    int32_t step_sign[3][kNumLanes];
+    // Rays of inactive lanes have a length of -1.
+    int32_t ray_length_in_steps[kNumLanes];
+  };
+
+  // Sets up the ray from origin to point_G in lane lane_idx.
+  void setupRay(const Point& origin, const Point& point_G,
+                const bool clearing_ray, const size_t lane_idx,
+                LaneState* lane_state) const;
+
+  // Advances the rays of all lanes by one voxel.
+  static void stepLanes(LaneState* lane_state);
+
+  const bool voxel_carving_enabled_;
+  const FloatingPoint max_ray_length_m_;
+  const FloatingPoint voxel_size_inv_;
+  const FloatingPoint truncation_distance_;
+};
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_BATCH_RAY_CASTER_H_
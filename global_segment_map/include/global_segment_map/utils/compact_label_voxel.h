@@ -0,0 +1,109 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_COMPACT_LABEL_VOXEL_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_COMPACT_LABEL_VOXEL_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include <voxblox/core/layer.h>
+#include <voxblox/core/voxel.h>
+
+#include "global_segment_map/common.h"
+#include "global_segment_map/label_voxel.h"
+
+namespace voxblox {
+
+typedef uint8_t CompactLabelConfidence;
+
+constexpr size_t kCompactLabelVoxelSize = 8u;
+
+// Number of label vote slots that fit into a compact voxel, next to one byte
+// of confidence per slot.
+constexpr size_t kNumCompactLabelVoxelSlots =
+    std::min(kNumLabelVoxelSlots,
+             kCompactLabelVoxelSize /
+                 (sizeof(Label) + sizeof(CompactLabelConfidence)));
+static_assert(kNumCompactLabelVoxelSlots >= 1u,
+              "A compact label voxel needs at least one label vote slot.");
+
+// Compact encoding of a LabelVoxel. The label of the voxel is not stored but
+// derived from the slot with the highest confidence, with ties going to the
+// first slot. Confidences are quantized to 8 bits, once one of them would
+// overflow all confidences of the voxel are halved, which keeps their ratios.
+struct alignas(kCompactLabelVoxelSize) CompactLabelVoxel {
+  Label labels[kNumCompactLabelVoxelSlots] = {};
+  CompactLabelConfidence confidences[kNumCompactLabelVoxelSlots] = {};
+};
+
+static_assert(sizeof(CompactLabelVoxel) == kCompactLabelVoxelSize,
+              "CompactLabelVoxel exceeds its size budget.");
+
+namespace voxel_types {
+const std::string kCompactLabel = "compact_label";
+}  // namespace voxel_types
+
+template <>
+inline std::string getVoxelType<CompactLabelVoxel>() {
+  return voxel_types::kCompactLabel;
+}
+
+// Returns the slot holding the label of the voxel, the equivalent of
+// LabelTsdfIntegrator::updateVoxelLabelAndConfidence.
+inline size_t getCompactLabelVoxelWinner(const CompactLabelVoxel& voxel) {
+  size_t winner_idx = 0u;
+  for (size_t slot_idx = 1u; slot_idx < kNumCompactLabelVoxelSlots;
+       ++slot_idx) {
+    if (voxel.confidences[slot_idx] > voxel.confidences[winner_idx]) {
+      winner_idx = slot_idx;
+    }
+  }
+  return winner_idx;
+}
+
+inline Label getCompactVoxelLabel(const CompactLabelVoxel& voxel) {
+  const size_t winner_idx = getCompactLabelVoxelWinner(voxel);
+  return voxel.confidences[winner_idx] > 0u ? voxel.labels[winner_idx] : 0u;
+}
+
+inline LabelConfidence getCompactVoxelLabelConfidence(
+    const CompactLabelVoxel& voxel) {
+  return voxel.confidences[getCompactLabelVoxelWinner(voxel)];
+}
+
+// Adds a vote for label to the voxel, the equivalent of
+// LabelTsdfIntegrator::addVoxelLabelConfidence followed by
+// updateVoxelLabelAndConfidence. The voted label wins ties with the previous
+// label, which is achieved by moving it to the first of the tied slots.
+void addCompactVoxelLabelConfidence(const Label label,
+                                    const LabelConfidence confidence,
+                                    CompactLabelVoxel* voxel);
+
+// Conversions to and from the full layout. Compressing keeps the slots with
+// the highest confidences and scales the confidences down to 8 bits if
+// needed, the label of the voxel stays its label in the compact encoding.
+void compressLabelVoxel(const LabelVoxel& voxel,
+                        CompactLabelVoxel* compact_voxel);
+
+void decompressLabelVoxel(const CompactLabelVoxel& compact_voxel,
+                          LabelVoxel* voxel);
+
+// Converts all voxels of the blocks, which need to have the same number of
+// voxels.
+void compressLabelBlock(const Block<LabelVoxel>& block,
+                        Block<CompactLabelVoxel>* compact_block);
+
+void decompressLabelBlock(const Block<CompactLabelVoxel>& compact_block,
+                          Block<LabelVoxel>* block);
+
+// Converts all allocated blocks of the layers, the output layer needs to have
+// the same voxel size and number of voxels per side as the input layer.
+void compressLabelLayer(const Layer<LabelVoxel>& layer,
+                        Layer<CompactLabelVoxel>* compact_layer);
+
+void decompressLabelLayer(const Layer<CompactLabelVoxel>& compact_layer,
+                          Layer<LabelVoxel>* layer);
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_COMPACT_LABEL_VOXEL_H_
@@ -0,0 +1,82 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_IMAGE_UTILS_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_IMAGE_UTILS_H_
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <Eigen/Core>
+#include <voxblox/core/common.h>
+
+#include "global_segment_map/segment.h"
+
+namespace voxblox {
+
+// Images are stored row-major and accessed as image(v, u).
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+    DepthImage;
+// Per-pixel segment id, as published by the segmentation.
+typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic,
+                      Eigen::RowMajor>
+    SegmentIdImage;
+// Per-pixel index of the segment in the segments extracted from the image.
+typedef Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic,
+                      Eigen::RowMajor>
+    SegmentIndexImage;
+
+constexpr uint32_t kNoSegmentId = 0u;
+constexpr int32_t kNoSegmentIndex = -1;
+
+// Pinhole model of a rectified depth camera.
+struct CameraIntrinsics {
+  FloatingPoint fx = 0.0f;
+  FloatingPoint fy = 0.0f;
+  FloatingPoint cx = 0.0f;
+  FloatingPoint cy = 0.0f;
+  int width = 0;
+  int height = 0;
+
+  // Gets the pixel point_C projects into. Returns false if the point is
+  // behind the camera or outside of the image.
+  inline bool projectToPixel(const Point& point_C, int* u, int* v) const {
+    if (point_C.z() <= 0.0f) {
+      return false;
+    }
+    *u = static_cast<int>(
+        std::round(fx * point_C.x() / point_C.z() + cx));
+    *v = static_cast<int>(
+        std::round(fy * point_C.y() / point_C.z() + cy));
+    return *u >= 0 && *u < width && *v >= 0 && *v < height;
+  }
+
+  inline Point backProjectPixel(const int u, const int v,
+                                const FloatingPoint depth) const {
+    return Point((u - cx) * depth / fx, (v - cy) * depth / fy, depth);
+  }
+
+  // Whether a sphere intersects the view frustum up to max_depth.
+  // Conservative, spheres close to the frustum corners are accepted too.
+  bool isSphereInFrustum(const Point& center_C, const FloatingPoint radius,
+                         const FloatingPoint max_depth) const;
+};
+
+inline bool isValidDepth(const FloatingPoint depth) {
+  return std::isfinite(depth) && depth > 0.0f;
+}
+
+// Back-projects the pixels of every segment in segment_id_image into a
+// Segment observed from T_G_C. Pixels without a segment id or without a
+// valid depth are skipped. The caller takes ownership of the segments.
+// segment_index_image holds the index into segments of the segment every
+// pixel belongs to, and segment_ids the id of every segment.
+void extractImageSegments(const Transformation& T_G_C,
+                          const DepthImage& depth_image,
+                          const SegmentIdImage& segment_id_image,
+                          const CameraIntrinsics& intrinsics,
+                          SegmentIndexImage* segment_index_image,
+                          std::vector<uint32_t>* segment_ids,
+                          std::vector<Segment*>* segments);
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_IMAGE_UTILS_H_
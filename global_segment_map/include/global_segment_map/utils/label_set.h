@@ -0,0 +1,46 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_LABEL_SET_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_LABEL_SET_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "global_segment_map/common.h"
+
+namespace voxblox {
+
+// Set of labels stored as a bitset indexed by label, so that membership is a
+// single bit test. Grows to the highest inserted label and keeps its memory
+// when cleared.
+class LabelSet {
+ public:
+  inline void insert(const Label label) {
+    const size_t word_idx = label / kBitsPerWord;
+    if (word_idx >= words_.size()) {
+      words_.resize(word_idx + 1u, 0u);
+    }
+    words_[word_idx] |= getBit(label);
+  }
+
+  inline size_t count(const Label label) const {
+    const size_t word_idx = label / kBitsPerWord;
+    return (word_idx < words_.size() && (words_[word_idx] & getBit(label)))
+               ? 1u
+               : 0u;
+  }
+
+  inline void clear() { std::fill(words_.begin(), words_.end(), 0u); }
+
+ private:
+  static constexpr size_t kBitsPerWord = 64u;
+
+  static inline uint64_t getBit(const Label label) {
+    return uint64_t(1u) << (label % kBitsPerWord);
+  }
+
+  std::vector<uint64_t> words_;
+};
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_LABEL_SET_H_
@@ -3,7 +3,7 @@
 
 #include <voxblox/utils/layer_utils.h>
 
-#include "global_segment_map/lable_voxel.h"
+#include "global_segment_map/label_voxel.h"
 
 namespace voxblox {
 namespace utils {
@@ -15,9 +15,7 @@ inline bool isSameVoxel(const LabelVoxel& voxel_A, const LabelVoxel& voxel_B) {
   is_the_same &= voxel_A.label == voxel_B.label;
   is_the_same &= voxel_A.label_confidence == voxel_B.label_confidence;
 
-  constexpr size_t kNumberOfLabels = 40u;
-
-  for (size_t i = 0u; i < kNumberOfLabels; ++i) {
+  for (size_t i = 0u; i < kNumLabelVoxelSlots; ++i) {
     is_the_same &= voxel_A.label_count[i].label == voxel_B.label_count[i].label;
     is_the_same &= voxel_A.label_count[i].label_confidence ==
                    voxel_B.label_count[i].label_confidence;
@@ -0,0 +1,109 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_SPARSE_LABEL_BLOCK_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_SPARSE_LABEL_BLOCK_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <voxblox/core/block.h>
+#include <voxblox/core/common.h>
+#include <voxblox/core/layer.h>
+
+#include "global_segment_map/label_voxel.h"
+
+namespace voxblox {
+
+// Label block that only stores its labelled voxels. An occupancy bitmask
+// over the linear voxel indices marks them, and they are packed in linear
+// index order, so that a lookup is a bit test and a population count.
+// Voxels without any label read as a default LabelVoxel. The map packs its
+// inactive label blocks into sparse blocks with the kSparse encoding, which
+// mostly leaves the voxels close to the surface.
+class SparseLabelBlock {
+ public:
+  typedef std::shared_ptr<SparseLabelBlock> Ptr;
+  typedef std::shared_ptr<const SparseLabelBlock> ConstPtr;
+
+  explicit SparseLabelBlock(const size_t num_voxels);
+
+  // Copies the labelled voxels of a dense block.
+  explicit SparseLabelBlock(const Block<LabelVoxel>& block);
+
+  inline size_t num_voxels() const { return num_voxels_; }
+
+  inline size_t num_labelled_voxels() const { return voxels_.size(); }
+
+  inline bool isLabelled(const size_t linear_idx) const {
+    DCHECK_LT(linear_idx, num_voxels_);
+    return occupancy_[linear_idx / kBitsPerWord] & getBit(linear_idx);
+  }
+
+  inline const LabelVoxel& getVoxelByLinearIndex(
+      const size_t linear_idx) const {
+    return isLabelled(linear_idx) ? voxels_[getPackedIndex(linear_idx)]
+                                  : kEmptyVoxel;
+  }
+
+  // Gets the voxel for writing, it is inserted if it is not labelled yet.
+  // Inserting moves the labelled voxels after it, so it is linear in their
+  // number and invalidates references to them. Converting a dense block is
+  // linear in the number of voxels for all of them together.
+  LabelVoxel& getOrInsertVoxelByLinearIndex(const size_t linear_idx);
+
+  // Writes all voxels to a dense block with the same number of voxels.
+  void getDenseBlock(Block<LabelVoxel>* block) const;
+
+  size_t getMemorySize() const;
+
+  static inline bool isEmptyVoxel(const LabelVoxel& voxel) {
+    if (voxel.label != 0u) {
+      return false;
+    }
+    for (const LabelCount& label_count : voxel.label_count) {
+      if (label_count.label != 0u) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  static constexpr size_t kBitsPerWord = 64u;
+
+  static const LabelVoxel kEmptyVoxel;
+
+  static inline uint64_t getBit(const size_t linear_idx) {
+    return uint64_t(1u) << (linear_idx % kBitsPerWord);
+  }
+
+  // Number of labelled voxels before linear_idx.
+  inline size_t getPackedIndex(const size_t linear_idx) const {
+    const size_t word_idx = linear_idx / kBitsPerWord;
+    return word_ranks_[word_idx] +
+           __builtin_popcountll(occupancy_[word_idx] &
+                                (getBit(linear_idx) - 1u));
+  }
+
+  size_t num_voxels_;
+  std::vector<uint64_t> occupancy_;
+  // Number of labelled voxels in all words before each word.
+  std::vector<uint32_t> word_ranks_;
+  AlignedVector<LabelVoxel> voxels_;
+};
+
+typedef AnyIndexHashMapType<SparseLabelBlock::Ptr>::type SparseLabelBlockMap;
+
+// Converts all allocated blocks of the label layer.
+void sparsifyLabelLayer(const Layer<LabelVoxel>& label_layer,
+                        SparseLabelBlockMap* sparse_blocks);
+
+// Allocates the blocks of the sparse blocks in the label layer and writes
+// their voxels.
+void densifyLabelLayer(const SparseLabelBlockMap& sparse_blocks,
+                       Layer<LabelVoxel>* label_layer);
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_SPARSE_LABEL_BLOCK_H_
@@ -0,0 +1,78 @@
+#ifndef GLOBAL_SEGMENT_MAP_UTILS_THREAD_POOL_H_
+#define GLOBAL_SEGMENT_MAP_UTILS_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace voxblox {
+
+// Fixed-size pool of long-lived worker threads. Work is submitted as a batch
+// of task indices, which are split over per-worker queues. The thread that
+// submits the batch works on it as well. A worker that runs out of tasks
+// steals from the back of the other queues, so an unbalanced batch does not
+// leave threads idling. Tasks only receive indices and access their data
+// through the function passed by the caller, so submitting a batch does not
+// copy any of it.
+class ThreadPool {
+ public:
+  // Called with the index of the task within the batch and the index of the
+  // worker thread executing it, which is in [0, getNumThreads()).
+  typedef std::function<void(const size_t task_idx, const size_t worker_idx)>
+      Task;
+
+  // The calling thread is one of the num_threads, so a pool of a single
+  // thread does not spawn any worker and runs all tasks on the caller.
+  explicit ThreadPool(const size_t num_threads);
+
+  ~ThreadPool();
+
+  // Runs task for every index in [0, num_tasks) and blocks until all of them
+  // are done. The calling thread runs tasks as worker 0. Thread safe, batches
+  // submitted concurrently are run one after the other. Batches submitted
+  // from within a task of this pool are run inline on the worker of that
+  // task.
+  void parallelFor(const size_t num_tasks, const Task& task);
+
+  inline size_t getNumThreads() const { return num_threads_; }
+
+ protected:
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<size_t> task_indices;
+  };
+
+  void workerLoop(const size_t worker_idx);
+
+  // Runs the tasks of the current batch until all queues are empty.
+  void runTasks(const size_t worker_idx, const Task& task);
+
+  // Pops the next task from the queue of this worker, or steals one from the
+  // other queues if it is empty. Returns false once all queues are empty.
+  bool getNextTaskIndex(const size_t worker_idx, size_t* task_idx);
+
+  const size_t num_threads_;
+
+  std::vector<std::unique_ptr<WorkQueue>> work_queues_;
+  std::vector<std::thread> workers_;
+
+  // Serializes concurrent calls to parallelFor.
+  std::mutex batch_mutex_;
+
+  // Guards the batch state below.
+  std::mutex state_mutex_;
+  std::condition_variable batch_started_;
+  std::condition_variable batch_done_;
+  const Task* task_;
+  size_t batch_id_;
+  size_t num_busy_workers_;
+  bool stop_;
+};
+
+}  // namespace voxblox
+
+#endif  // GLOBAL_SEGMENT_MAP_UTILS_THREAD_POOL_H_
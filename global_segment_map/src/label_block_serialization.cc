@@ -1,3 +1,4 @@
+#include <cstring>
 #include <memory>
 
 #include <glog/logging.h>
@@ -6,44 +7,95 @@
 
 namespace voxblox {
 
+namespace {
+
+// Every label and its confidence are packed into one integer.
+inline uint32_t packLabelConfidence(const Label label,
+                                    const LabelConfidence confidence) {
+  return static_cast<uint32_t>(label) |
+         (static_cast<uint32_t>(confidence) << 16u);
+}
+
+inline void unpackLabelConfidence(const uint32_t data, Label* label,
+                                  LabelConfidence* confidence) {
+  *label = static_cast<Label>(data & 0xFFFFu);
+  *confidence = static_cast<LabelConfidence>(data >> 16u);
+}
+
+}  // namespace
+
 template <>
 void Block<LabelVoxel>::deserializeFromIntegers(
     const std::vector<uint32_t>& data) {
-  constexpr size_t kNumDataPacketsPerVoxel = 2u;
+  // The label and confidence of the voxel, followed by its label votes.
+  constexpr size_t kNumDataPacketsPerVoxel = 1u + kNumLabelVoxelSlots;
+  // Blocks serialized without the votes hold the label and confidence in
+  // their second packet.
+  constexpr size_t kNumLegacyDataPacketsPerVoxel = 2u;
   const size_t num_data_packets = data.size();
-  CHECK_EQ(num_voxels_ * kNumDataPacketsPerVoxel, num_data_packets);
-  for (size_t voxel_idx = 0u, data_idx = 0u;
-       voxel_idx < num_voxels_ && data_idx < num_data_packets;
-       ++voxel_idx, data_idx += kNumDataPacketsPerVoxel) {
-    const uint32_t bytes_1 = data[data_idx];
-    const uint32_t bytes_2 = data[data_idx + 1u];
+  if (num_data_packets == num_voxels_ * kNumLegacyDataPacketsPerVoxel) {
+    for (size_t voxel_idx = 0u; voxel_idx < num_voxels_; ++voxel_idx) {
+      LabelVoxel& voxel = voxels_[voxel_idx];
+      voxel = LabelVoxel();
+      unpackLabelConfidence(
+          data[voxel_idx * kNumLegacyDataPacketsPerVoxel + 1u], &voxel.label,
+          &voxel.label_confidence);
+    }
+    return;
+  }
 
+  CHECK_EQ(num_voxels_ * kNumDataPacketsPerVoxel, num_data_packets)
+      << "The label voxels were serialized with a different number of label "
+         "vote slots.";
+  for (size_t voxel_idx = 0u, data_idx = 0u; voxel_idx < num_voxels_;
+       ++voxel_idx) {
     LabelVoxel& voxel = voxels_[voxel_idx];
-
-    memcpy(&(voxel.label_confidence), &bytes_1, sizeof(bytes_1));
-    memcpy(&(voxel.label), &bytes_2, sizeof(bytes_2));
+    unpackLabelConfidence(data[data_idx++], &voxel.label,
+                          &voxel.label_confidence);
+    for (LabelCount& label_count : voxel.label_count) {
+      unpackLabelConfidence(data[data_idx++], &label_count.label,
+                            &label_count.label_confidence);
+    }
   }
 }
 
-// TODO(grinvalm): serialize and deserialize also votes array.
 template <>
 void Block<LabelVoxel>::serializeToIntegers(std::vector<uint32_t>* data) const {
   CHECK_NOTNULL(data);
-  constexpr size_t kNumDataPacketsPerVoxel = 2u;
+  constexpr size_t kNumDataPacketsPerVoxel = 1u + kNumLabelVoxelSlots;
   data->clear();
   data->reserve(num_voxels_ * kNumDataPacketsPerVoxel);
   for (size_t voxel_idx = 0u; voxel_idx < num_voxels_; ++voxel_idx) {
     const LabelVoxel& voxel = voxels_[voxel_idx];
-
-    const uint32_t* bytes_1_ptr =
-        reinterpret_cast<const uint32_t*>(&voxel.label_confidence);
-    data->push_back(*bytes_1_ptr);
-
-    const uint32_t* bytes_2_ptr =
-        reinterpret_cast<const uint32_t*>(&voxel.label);
-    data->push_back(*bytes_2_ptr);
+    data->push_back(packLabelConfidence(voxel.label, voxel.label_confidence));
+    for (const LabelCount& label_count : voxel.label_count) {
+      data->push_back(
+          packLabelConfidence(label_count.label, label_count.label_confidence));
+    }
   }
   CHECK_EQ(num_voxels_ * kNumDataPacketsPerVoxel, data->size());
 }
 
+// Compact voxels are stored as they are laid out in memory.
+constexpr size_t kNumCompactDataPacketsPerVoxel =
+    sizeof(CompactLabelVoxel) / sizeof(uint32_t);
+
+template <>
+void Block<CompactLabelVoxel>::deserializeFromIntegers(
+    const std::vector<uint32_t>& data) {
+  CHECK_EQ(num_voxels_ * kNumCompactDataPacketsPerVoxel, data.size())
+      << "The compact label voxels were serialized with a different layout.";
+  std::memcpy(static_cast<void*>(voxels_.get()), data.data(),
+              num_voxels_ * sizeof(CompactLabelVoxel));
+}
+
+template <>
+void Block<CompactLabelVoxel>::serializeToIntegers(
+    std::vector<uint32_t>* data) const {
+  CHECK_NOTNULL(data);
+  data->resize(num_voxels_ * kNumCompactDataPacketsPerVoxel);
+  std::memcpy(data->data(), voxels_.get(),
+              num_voxels_ * sizeof(CompactLabelVoxel));
+}
+
 }  // namespace voxblox
@@ -1,60 +1,140 @@
 #include "global_segment_map/label_tsdf_integrator.h"
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#if defined(GSM_LOCK_FREE_LABEL_UPDATES) && \
+    defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+#define GSM_HAVE_LABEL_VOXEL_COMPARE_AND_SWAP
+#endif
+
 namespace voxblox {
 
+namespace {
+
+// Label confidences saturate instead of wrapping around, which would make
+// the most confident label of a voxel the least confident one.
+inline LabelConfidence addLabelConfidences(const LabelConfidence lhs,
+                                           const LabelConfidence rhs) {
+  return static_cast<LabelConfidence>(
+      std::min<uint32_t>(static_cast<uint32_t>(lhs) + rhs,
+                         std::numeric_limits<LabelConfidence>::max()));
+}
+
+#ifdef GSM_HAVE_LABEL_VOXEL_COMPARE_AND_SWAP
+// Label voxel as one integer for the __sync compare-and-swap, which compiles
+// to a single instruction. The __atomic builtins call into libatomic for 16
+// bytes instead, which may fall back to a lock.
+typedef unsigned __int128 __attribute__((may_alias)) LabelVoxelBits;
+static_assert(sizeof(LabelVoxelBits) == sizeof(LabelVoxel),
+              "A label voxel needs to be swapped as a whole.");
+#endif
+
+}  // namespace
+
 LabelTsdfIntegrator::LabelTsdfIntegrator(
     const Config& tsdf_config, const LabelTsdfConfig& label_tsdf_config,
     LabelTsdfMap* map)
     : MergedTsdfIntegrator(tsdf_config, CHECK_NOTNULL(map->getTsdfLayerPtr())),
       label_tsdf_config_(label_tsdf_config),
+      map_(map),
       label_layer_(CHECK_NOTNULL(map->getLabelLayerPtr())),
       label_count_map_ptr_(map->getLabelCountPtr()),
       highest_label_ptr_(CHECK_NOTNULL(map->getHighestLabelPtr())),
       highest_instance_ptr_(CHECK_NOTNULL(map->getHighestInstancePtr())),
       semantic_instance_label_fusion_ptr_(
-          map->getSemanticInstanceLabelFusionPtr()) {}
+          map->getSemanticInstanceLabelFusionPtr()),
+      thread_pool_(config_.integrator_threads),
+      temp_label_block_maps_(thread_pool_.getNumThreads()),
+      label_count_deltas_(thread_pool_.getNumThreads()),
+      label_block_votes_(thread_pool_.getNumThreads()),
+      label_vote_arenas_(thread_pool_.getNumThreads()),
+      batch_ray_caster_(config_.voxel_carving_enabled,
+                        config_.max_ray_length_m, voxel_size_inv_,
+                        config_.default_truncation_distance),
+      num_frames_(0u) {
+  CHECK_GT(label_tsdf_config_.partition_region_size_blocks, 0);
+  CHECK_GE(label_tsdf_config_.label_recycling_min_frames, 0);
+#ifndef GSM_HAVE_LABEL_VOXEL_COMPARE_AND_SWAP
+  if (label_tsdf_config_.enable_lock_free_label_updates) {
+    LOG(WARNING) << "Lock-free label updates are not available in this build, "
+                    "the label voxels are locked instead.";
+    label_tsdf_config_.enable_lock_free_label_updates = false;
+  }
+#endif
+
+  // A loaded map already holds votes.
+  if (label_tsdf_config_.enable_label_recycling) {
+    BlockIndexList label_blocks;
+    map_->getAllLabelBlockIndices(&label_blocks);
+    for (const BlockIndex& block_idx : label_blocks) {
+      indexLabelBlock(block_idx, *map_->getLabelBlockPtrByIndex(block_idx));
+    }
+  }
+}
 
 void LabelTsdfIntegrator::checkForSegmentLabelMergeCandidate(
     const Label& label, const int label_points_count,
-    const int segment_points_count,
-    std::unordered_set<Label>* merge_candidate_labels) {
-  CHECK_NOTNULL(merge_candidate_labels);
+    const int segment_points_count, LabelVoteArena* vote_arena) {
+  CHECK_NOTNULL(vote_arena);
   // All segment labels that overlap with more than a certain
   // percentage of the segment points are potential merge candidates.
   float label_segment_overlap_ratio = static_cast<float>(label_points_count) /
                                       static_cast<float>(segment_points_count);
   if (label_segment_overlap_ratio >
       label_tsdf_config_.merging_min_overlap_ratio) {
-    merge_candidate_labels->insert(label);
+    uint8_t& is_merge_candidate = vote_arena->is_merge_candidate[label];
+    if (!is_merge_candidate) {
+      is_merge_candidate = 1u;
+      vote_arena->merge_candidate_labels.push_back(label);
+    }
   }
 }
 
 void LabelTsdfIntegrator::increaseLabelCountForSegment(
-    Segment* segment, const Label& label, const int segment_points_count,
-    std::map<Label, std::map<Segment*, size_t>>* candidates,
-    std::unordered_set<Label>* merge_candidate_labels) {
-  CHECK_NOTNULL(segment);
-  CHECK_NOTNULL(candidates);
-  CHECK_NOTNULL(merge_candidate_labels);
-  auto label_it = candidates->find(label);
-  if (label_it != candidates->end()) {
-    auto segment_it = label_it->second.find(segment);
-    if (segment_it != label_it->second.end()) {
-      ++segment_it->second;
-
-      if (label_tsdf_config_.enable_pairwise_confidence_merging) {
-        checkForSegmentLabelMergeCandidate(label, segment_it->second,
-                                           segment_points_count,
-                                           merge_candidate_labels);
-      }
-    } else {
-      label_it->second.emplace(segment, 1u);
-    }
-  } else {
-    std::map<Segment*, size_t> segment_points_count;
-    segment_points_count.emplace(segment, 1u);
-    candidates->emplace(label, segment_points_count);
+    const Label& label, const int segment_points_count,
+    const size_t num_points, LabelVoteArena* vote_arena) {
+  CHECK_NOTNULL(vote_arena);
+  CHECK_GT(num_points, 0u);
+  if (label >= vote_arena->label_counts.size()) {
+    vote_arena->label_counts.resize(label + 1u, 0u);
+    vote_arena->is_merge_candidate.resize(label + 1u, 0u);
+  }
+  size_t& label_points_count = vote_arena->label_counts[label];
+  if (label_points_count == 0u) {
+    vote_arena->voted_labels.push_back(label);
+  }
+  label_points_count += num_points;
+
+  // As when counting point by point, the first point of a label only
+  // creates its count and is not checked for merging.
+  if (label_tsdf_config_.enable_pairwise_confidence_merging &&
+      label_points_count > 1u) {
+    checkForSegmentLabelMergeCandidate(label, label_points_count,
+                                       segment_points_count, vote_arena);
+  }
+}
+
+void LabelTsdfIntegrator::collectSegmentLabelVotes(LabelVoteArena* vote_arena,
+                                                   SegmentLabelVotes* votes) {
+  CHECK_NOTNULL(vote_arena);
+  CHECK_NOTNULL(votes);
+  std::sort(vote_arena->voted_labels.begin(), vote_arena->voted_labels.end());
+  votes->label_counts.clear();
+  votes->label_counts.reserve(vote_arena->voted_labels.size());
+  for (const Label label : vote_arena->voted_labels) {
+    votes->label_counts.emplace_back(label, vote_arena->label_counts[label]);
+    vote_arena->label_counts[label] = 0u;
+  }
+  vote_arena->voted_labels.clear();
+
+  votes->merge_candidate_labels = vote_arena->merge_candidate_labels;
+  for (const Label label : vote_arena->merge_candidate_labels) {
+    vote_arena->is_merge_candidate[label] = 0u;
   }
+  vote_arena->merge_candidate_labels.clear();
 }
 
 void LabelTsdfIntegrator::increasePairwiseConfidenceCount(
@@ -92,11 +172,128 @@ void LabelTsdfIntegrator::increasePairwiseConfidenceCount(
   }
 }
 
+void LabelTsdfIntegrator::getSegmentVoxelsByBlock(
+    const Segment& segment, BlockVoxelsMap* block_voxels) const {
+  CHECK_NOTNULL(block_voxels);
+  if (getPreprocessedSegmentVoxelsByBlock(segment, block_voxels)) {
+    return;
+  }
+  block_voxels->clear();
+  const size_t num_points = segment.points_C_.size();
+  if (num_points == 0u) {
+    return;
+  }
+
+  // The points are stored contiguously, so they are transformed all at once.
+  const Eigen::Map<const Eigen::Matrix<FloatingPoint, 3, Eigen::Dynamic>>
+      points_C(segment.points_C_.front().data(), 3, num_points);
+  const Eigen::Matrix<FloatingPoint, 3, Eigen::Dynamic> points_G =
+      (segment.T_G_C_.getRotationMatrix() * points_C).colwise() +
+      segment.T_G_C_.getPosition();
+
+  // Consecutive points mostly fall into the same block, so the map is only
+  // searched when the block changes.
+  BlockIndex last_block_idx;
+  VoxelIndexList* last_block_voxels = nullptr;
+  for (size_t point_idx = 0u; point_idx < num_points; ++point_idx) {
+    const GlobalIndex global_voxel_idx = getGridIndexFromPoint<GlobalIndex>(
+        points_G.col(point_idx), voxel_size_inv_);
+    const BlockIndex block_idx = getBlockIndexFromGlobalVoxelIndex(
+        global_voxel_idx, voxels_per_side_inv_);
+    if (last_block_voxels == nullptr || block_idx != last_block_idx) {
+      last_block_voxels = &(*block_voxels)[block_idx];
+      last_block_idx = block_idx;
+    }
+    last_block_voxels->push_back(
+        getLocalFromGlobalVoxelIndex(global_voxel_idx, voxels_per_side_));
+  }
+}
+
+bool LabelTsdfIntegrator::getPreprocessedSegmentVoxelsByBlock(
+    const Segment& segment, BlockVoxelsMap* block_voxels) const {
+  CHECK_NOTNULL(block_voxels);
+  const PreprocessedFrame& frame = preprocessed_frame_;
+  if (!frame.is_valid) {
+    return false;
+  }
+  auto range_it = frame.segment_ranges.find(&segment);
+  if (range_it == frame.segment_ranges.end() ||
+      !segment.T_G_C_.getTransformationMatrix().isApprox(
+          frame.T_G_C.getTransformationMatrix())) {
+    return false;
+  }
+
+  block_voxels->clear();
+  const size_t end_point_idx = range_it->second.first + range_it->second.second;
+  BlockIndex last_block_idx;
+  VoxelIndexList* last_block_voxels = nullptr;
+  for (size_t point_idx = range_it->second.first; point_idx < end_point_idx;
+       ++point_idx) {
+    const BlockIndex block_idx = frame.block_indices.col(point_idx);
+    if (last_block_voxels == nullptr || block_idx != last_block_idx) {
+      last_block_voxels = &(*block_voxels)[block_idx];
+      last_block_idx = block_idx;
+    }
+    last_block_voxels->push_back(
+        (frame.global_voxel_indices.col(point_idx) -
+         block_idx.cast<LongIndexElement>() * voxels_per_side_)
+            .cast<IndexElement>());
+  }
+  return true;
+}
+
+void LabelTsdfIntegrator::bundlePreprocessedRays(
+    const bool freespace_points,
+    LongIndexHashMapType<AlignedVector<size_t>>::type* voxel_map,
+    LongIndexHashMapType<AlignedVector<size_t>>::type* clear_map) const {
+  CHECK_NOTNULL(voxel_map);
+  CHECK_NOTNULL(clear_map);
+  const PreprocessedFrame& frame = preprocessed_frame_;
+  CHECK(frame.is_valid);
+  for (size_t point_idx = 0u; point_idx < frame.points_C.size();
+       ++point_idx) {
+    bool is_clearing;
+    if (!isPointValid(frame.points_C[point_idx], freespace_points,
+                      &is_clearing)) {
+      continue;
+    }
+    const GlobalIndex global_voxel_idx =
+        frame.global_voxel_indices.col(point_idx);
+    if (is_clearing) {
+      (*clear_map)[global_voxel_idx].push_back(point_idx);
+    } else {
+      (*voxel_map)[global_voxel_idx].push_back(point_idx);
+    }
+  }
+}
+
+void LabelTsdfIntegrator::countUniqueVoxels(
+    const VoxelIndexList& voxel_indices,
+    std::vector<VoxelMultiplicity>* unique_voxels) const {
+  CHECK_NOTNULL(unique_voxels);
+  unique_voxels->clear();
+
+  // Sort the voxels so that equal ones are adjacent and count their runs.
+  VoxelIndexList sorted_voxel_indices(voxel_indices);
+  std::sort(sorted_voxel_indices.begin(), sorted_voxel_indices.end(),
+            [](const VoxelIndex& lhs, const VoxelIndex& rhs) {
+              return std::lexicographical_compare(lhs.data(), lhs.data() + 3,
+                                                  rhs.data(), rhs.data() + 3);
+            });
+  for (const VoxelIndex& voxel_idx : sorted_voxel_indices) {
+    if (!unique_voxels->empty() &&
+        unique_voxels->back().voxel_idx == voxel_idx) {
+      ++unique_voxels->back().num_points;
+    } else {
+      unique_voxels->push_back(VoxelMultiplicity{voxel_idx, 1u});
+    }
+  }
+}
+
 Label LabelTsdfIntegrator::getNextUnassignedLabel(
-    const LabelVoxel& voxel, const std::set<Label>& assigned_labels) {
+    const LabelVoxel& voxel, const LabelSet& assigned_labels) {
   Label voxel_label = 0u;
-  auto label_it = assigned_labels.find(voxel.label);
-  if (label_it != assigned_labels.end()) {
+  if (assigned_labels.count(voxel.label) > 0u) {
     // The voxel label has been assigned already, so find
     // the next unassigned label with highest confidence for this voxel.
     LabelConfidence max_confidence = 0u;
@@ -107,8 +304,7 @@ Label LabelTsdfIntegrator::getNextUnassignedLabel(
     // but not assigned in the current frame.
     Label preferred_label = 0u;
     for (const LabelCount& label_count : voxel.label_count) {
-      label_it = assigned_labels.find(label_count.label);
-      if (label_it == assigned_labels.end() &&
+      if (assigned_labels.count(label_count.label) == 0u &&
           (label_count.label_confidence >= max_confidence ||
            (label_count.label == preferred_label && preferred_label != 0u &&
             label_count.label_confidence == max_confidence))) {
@@ -148,7 +344,8 @@ void LabelTsdfIntegrator::addVoxelLabelConfidence(
   for (LabelCount& label_count : label_voxel->label_count) {
     if (label_count.label == label) {
       // Label already observed in this voxel.
-      label_count.label_confidence = label_count.label_confidence + confidence;
+      label_count.label_confidence =
+          addLabelConfidences(label_count.label_confidence, confidence);
       updated = true;
       break;
     }
@@ -166,128 +363,667 @@ void LabelTsdfIntegrator::addVoxelLabelConfidence(
     }
   }
   if (updated == false) {
-    // TODO(margaritaG): handle this nicely or remove.
-    // LOG(FATAL) << "Out-of-memory for storing labels and confidences for this
-    // "
-    //               " voxel. Please increse size of array.";
+    // All slots are taken, follow the space-saving policy: the least
+    // confident label is replaced and its confidence inherited by the new one.
+    // The confidence of a label is then overestimated by at most the smallest
+    // confidence in the voxel, so that a dominant label is never evicted.
+    // Confidences saturate, a saturated label can then only be tied.
+    LabelCount* min_label_count = std::min_element(
+        std::begin(label_voxel->label_count),
+        std::end(label_voxel->label_count),
+        [](const LabelCount& lhs, const LabelCount& rhs) {
+          return lhs.label_confidence < rhs.label_confidence;
+        });
+    min_label_count->label = label;
+    min_label_count->label_confidence =
+        addLabelConfidences(min_label_count->label_confidence, confidence);
   }
 }
 
 void LabelTsdfIntegrator::computeSegmentLabelCandidates(
     Segment* segment, std::map<Label, std::map<Segment*, size_t>>* candidates,
     std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
-    const std::set<Label>& assigned_labels) {
+    const LabelSet& assigned_labels) {
   CHECK_NOTNULL(segment);
-  CHECK_NOTNULL(candidates);
-  CHECK_NOTNULL(segment_merge_candidates);
-  // Flag to check whether there exists at least one label candidate.
-  bool candidate_label_exists = false;
-  const int segment_points_count = segment->points_C_.size();
-  std::unordered_set<Label> merge_candidate_labels;
-
-  for (const Point& point_C : segment->points_C_) {
-    const Point point_G = segment->T_G_C_ * point_C;
-
-    // Get the corresponding voxel by 3D position in world frame.
-    Layer<LabelVoxel>::BlockType::ConstPtr label_block_ptr =
-        label_layer_->getBlockPtrByCoordinates(point_G);
-    // Get the corresponding voxel by 3D position in world frame.
-    Layer<TsdfVoxel>::BlockType::ConstPtr tsdf_block_ptr =
-        layer_->getBlockPtrByCoordinates(point_G);
-
-    if (label_block_ptr != nullptr) {
+  SegmentVoxelLabels* voxel_labels = nullptr;
+  if (label_tsdf_config_.enable_label_propagation_cache) {
+    voxel_labels = &segment_voxel_labels_[segment];
+  }
+  SegmentLabelVotes votes;
+  voteSegmentLabels(*segment, assigned_labels, 0u, &votes, voxel_labels);
+  addSegmentLabelCandidates(segment, votes, candidates,
+                            segment_merge_candidates);
+}
+
+void LabelTsdfIntegrator::computeFrameLabelCandidates(
+    const std::vector<Segment*>& segments,
+    std::map<Label, std::map<Segment*, size_t>>* candidates,
+    std::map<Segment*, std::vector<Label>>* segment_merge_candidates) {
+  // Voting only reads the map, so the segments are voted on concurrently.
+  // The votes are added in segment order afterwards, which also hands out
+  // the fresh labels in the same order as the sequential computation.
+  std::vector<SegmentLabelVotes> segment_votes(segments.size());
+  // The cache entries are created up front, as inserting is not thread safe.
+  std::vector<SegmentVoxelLabels*> segment_voxel_labels(segments.size(),
+                                                        nullptr);
+  if (label_tsdf_config_.enable_label_propagation_cache) {
+    for (size_t segment_idx = 0u; segment_idx < segments.size();
+         ++segment_idx) {
+      segment_voxel_labels[segment_idx] =
+          &segment_voxel_labels_[segments[segment_idx]];
+    }
+  }
+  const LabelSet kNoAssignedLabels;
+  thread_pool_.parallelFor(
+      segments.size(), [&](const size_t segment_idx, const size_t worker_idx) {
+        CHECK_NOTNULL(segments[segment_idx]);
+        voteSegmentLabels(*segments[segment_idx], kNoAssignedLabels,
+                          worker_idx, &segment_votes[segment_idx],
+                          segment_voxel_labels[segment_idx]);
+      });
+
+  for (size_t segment_idx = 0u; segment_idx < segments.size();
+       ++segment_idx) {
+    addSegmentLabelCandidates(segments[segment_idx],
+                              segment_votes[segment_idx], candidates,
+                              segment_merge_candidates);
+  }
+}
+
+void LabelTsdfIntegrator::voteSegmentLabels(
+    const Segment& segment, const LabelSet& assigned_labels,
+    const size_t worker_idx, SegmentLabelVotes* votes,
+    SegmentVoxelLabels* voxel_labels) {
+  CHECK_NOTNULL(votes);
+  if (rendered_labels_.is_valid) {
+    voteRenderedSegmentLabels(segment, assigned_labels, worker_idx, votes,
+                              voxel_labels);
+    return;
+  }
+  CHECK_LT(worker_idx, label_vote_arenas_.size());
+  LabelVoteArena& vote_arena = label_vote_arenas_[worker_idx];
+  const int segment_points_count = segment.points_C_.size();
+  if (voxel_labels != nullptr) {
+    voxel_labels->clear();
+  }
+
+  BlockVoxelsMap segment_block_voxels;
+  getSegmentVoxelsByBlock(segment, &segment_block_voxels);
+  std::vector<VoxelMultiplicity> unique_voxels;
+
+  for (const BlockVoxelsMap::value_type& block_voxels :
+       segment_block_voxels) {
+    // Get the corresponding blocks of the voxels.
+    Layer<LabelVoxel>::BlockType::ConstPtr label_block_ptr;
+    Layer<TsdfVoxel>::BlockType::ConstPtr tsdf_block_ptr;
+    getTsdfAndLabelBlocks(block_voxels.first, &tsdf_block_ptr,
+                          &label_block_ptr);
+    if (label_block_ptr == nullptr || tsdf_block_ptr == nullptr) {
+      continue;
+    }
+
+    const auto vote_for_voxel = [&](const VoxelIndex& voxel_idx,
+                                    const size_t num_points) {
       const LabelVoxel& label_voxel =
-          label_block_ptr->getVoxelByCoordinates(point_G);
+          label_block_ptr->getVoxelByVoxelIndex(voxel_idx);
       const TsdfVoxel& tsdf_voxel =
-          tsdf_block_ptr->getVoxelByCoordinates(point_G);
-      Label label = 0u;
-      label = getNextUnassignedLabel(label_voxel, assigned_labels);
-      if (label != 0u &&
-          std::abs(tsdf_voxel.distance) <
-              label_tsdf_config_.label_propagation_td_factor * voxel_size_) {
+          tsdf_block_ptr->getVoxelByVoxelIndex(voxel_idx);
+      if (std::abs(tsdf_voxel.distance) >=
+          label_tsdf_config_.label_propagation_td_factor * voxel_size_) {
+        return;
+      }
+      if (voxel_labels != nullptr) {
+        voxel_labels->push_back(CachedVoxelLabels{label_voxel, num_points});
+      }
+      const Label label = getNextUnassignedLabel(label_voxel, assigned_labels);
+      if (label != 0u) {
         // Do not consider allocated but unobserved voxels
         // which have label == 0.
-        candidate_label_exists = true;
-        increaseLabelCountForSegment(segment, label, segment_points_count,
-                                     candidates, &merge_candidate_labels);
+        increaseLabelCountForSegment(label, segment_points_count, num_points,
+                                     &vote_arena);
+      }
+    };
+
+    if (label_tsdf_config_.enable_voxel_deduplicated_propagation) {
+      countUniqueVoxels(block_voxels.second, &unique_voxels);
+      for (const VoxelMultiplicity& unique_voxel : unique_voxels) {
+        vote_for_voxel(unique_voxel.voxel_idx, unique_voxel.num_points);
+      }
+    } else {
+      for (const VoxelIndex& voxel_idx : block_voxels.second) {
+        vote_for_voxel(voxel_idx, 1u);
       }
     }
   }
+  collectSegmentLabelVotes(&vote_arena, votes);
+}
+
+void LabelTsdfIntegrator::voteRenderedSegmentLabels(
+    const Segment& segment, const LabelSet& assigned_labels,
+    const size_t worker_idx, SegmentLabelVotes* votes,
+    SegmentVoxelLabels* voxel_labels) {
+  CHECK_NOTNULL(votes);
+  CHECK(rendered_labels_.is_valid);
+  CHECK_LT(worker_idx, label_vote_arenas_.size());
+  LabelVoteArena& vote_arena = label_vote_arenas_[worker_idx];
+  const int segment_points_count = segment.points_C_.size();
+  if (voxel_labels != nullptr) {
+    voxel_labels->clear();
+  }
+
+  const CameraIntrinsics& intrinsics = rendered_labels_.intrinsics;
+  const Transformation T_C_S = rendered_labels_.T_C_G * segment.T_G_C_;
+  const FloatingPoint max_surface_distance =
+      label_tsdf_config_.label_propagation_td_factor * voxel_size_;
+  for (const Point& point_S : segment.points_C_) {
+    const Point point_C = T_C_S * point_S;
+    int u, v;
+    if (!intrinsics.projectToPixel(point_C, &u, &v)) {
+      continue;
+    }
+    const FloatingPoint depth = rendered_labels_.depth_image(v, u);
+    if (!isValidDepth(depth) ||
+        std::abs(point_C.z() - depth) >= max_surface_distance) {
+      continue;
+    }
+
+    const LabelVoxel& label_voxel =
+        rendered_labels_.label_voxels[v * intrinsics.width + u];
+    if (voxel_labels != nullptr) {
+      voxel_labels->push_back(CachedVoxelLabels{label_voxel, 1u});
+    }
+    const Label label = getNextUnassignedLabel(label_voxel, assigned_labels);
+    if (label != 0u) {
+      increaseLabelCountForSegment(label, segment_points_count, 1u,
+                                   &vote_arena);
+    }
+  }
+  collectSegmentLabelVotes(&vote_arena, votes);
+}
+
+void LabelTsdfIntegrator::voteCachedSegmentLabels(
+    const SegmentVoxelLabels& voxel_labels, const int segment_points_count,
+    const LabelSet& assigned_labels, const size_t worker_idx,
+    SegmentLabelVotes* votes) {
+  CHECK_NOTNULL(votes);
+  CHECK_LT(worker_idx, label_vote_arenas_.size());
+  LabelVoteArena& vote_arena = label_vote_arenas_[worker_idx];
+  for (const CachedVoxelLabels& cached_voxel : voxel_labels) {
+    const Label label =
+        getNextUnassignedLabel(cached_voxel.label_voxel, assigned_labels);
+    if (label != 0u) {
+      increaseLabelCountForSegment(label, segment_points_count,
+                                   cached_voxel.num_points, &vote_arena);
+    }
+  }
+  collectSegmentLabelVotes(&vote_arena, votes);
+}
+
+void LabelTsdfIntegrator::addSegmentLabelCandidates(
+    Segment* segment, const SegmentLabelVotes& votes,
+    std::map<Label, std::map<Segment*, size_t>>* candidates,
+    std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
+    Labels* candidate_labels) {
+  CHECK_NOTNULL(segment);
+  CHECK_NOTNULL(candidates);
+  CHECK_NOTNULL(segment_merge_candidates);
+  if (candidate_labels != nullptr) {
+    candidate_labels->clear();
+  }
+  for (const std::pair<Label, size_t>& label_count : votes.label_counts) {
+    (*candidates)[label_count.first][segment] += label_count.second;
+    if (candidate_labels != nullptr) {
+      candidate_labels->push_back(label_count.first);
+    }
+  }
 
   if (label_tsdf_config_.enable_pairwise_confidence_merging) {
-    std::vector<Label> merge_candidates;
-    std::copy(merge_candidate_labels.begin(), merge_candidate_labels.end(),
-              std::back_inserter(merge_candidates));
-    (*segment_merge_candidates)[segment] = merge_candidates;
+    (*segment_merge_candidates)[segment] = votes.merge_candidate_labels;
   }
 
   // Previously unobserved segment gets an unseen label.
-  if (!candidate_label_exists) {
+  if (votes.label_counts.empty()) {
     Label fresh_label = getFreshLabel();
     std::map<Segment*, size_t> map;
     map.insert(std::pair<Segment*, size_t>(segment, segment->points_C_.size()));
     candidates->insert(
         std::pair<Label, std::map<Segment*, size_t>>(fresh_label, map));
+    if (candidate_labels != nullptr) {
+      candidate_labels->push_back(fresh_label);
+    }
+  }
+}
+
+void LabelTsdfIntegrator::initLabelAssignment(
+    const std::map<Label, std::map<Segment*, size_t>>& candidates,
+    LabelAssignment* label_assignment) {
+  CHECK_NOTNULL(label_assignment);
+  label_assignment->queue.clear();
+  label_assignment->segment_labels.clear();
+  for (const auto& label_segments : candidates) {
+    for (const std::pair<Segment* const, size_t>& segment_count :
+         label_segments.second) {
+      label_assignment->segment_labels[segment_count.first].push_back(
+          label_segments.first);
+      if (segment_count.second > label_tsdf_config_.min_label_voxel_count) {
+        label_assignment->queue.push_back(LabelAssignmentCandidate{
+            segment_count.second, label_segments.first, segment_count.first});
+      }
+    }
+  }
+  std::make_heap(label_assignment->queue.begin(),
+                 label_assignment->queue.end());
+}
+
+void LabelTsdfIntegrator::queueLabelCandidates(
+    Segment* segment, const Labels& labels,
+    const std::map<Label, std::map<Segment*, size_t>>& candidates,
+    LabelAssignment* label_assignment) {
+  CHECK_NOTNULL(segment);
+  CHECK_NOTNULL(label_assignment);
+  // The labels of a vote are unique and never the assigned label the
+  // segment is already indexed under.
+  Labels& segment_labels = label_assignment->segment_labels[segment];
+  for (const Label label : labels) {
+    segment_labels.push_back(label);
+    const size_t count = candidates.at(label).at(segment);
+    if (count > label_tsdf_config_.min_label_voxel_count) {
+      label_assignment->queue.push_back(
+          LabelAssignmentCandidate{count, label, segment});
+      std::push_heap(label_assignment->queue.begin(),
+                     label_assignment->queue.end());
+    }
   }
 }
 
 bool LabelTsdfIntegrator::getNextSegmentLabelPair(
     const std::set<Segment*>& labelled_segments,
-    std::set<Label>* assigned_labels,
+    LabelSet* assigned_labels,
     std::map<voxblox::Label, std::map<voxblox::Segment*, size_t>>* candidates,
     std::map<Segment*, std::vector<Label>>* segment_merge_candidates,
+    LabelAssignment* label_assignment,
     std::pair<Segment*, Label>* segment_label_pair) {
   CHECK_NOTNULL(assigned_labels);
   CHECK_NOTNULL(candidates);
   CHECK_NOTNULL(segment_merge_candidates);
+  CHECK_NOTNULL(label_assignment);
   CHECK_NOTNULL(segment_label_pair);
 
-  Label max_label;
-  size_t max_count = 0u;
-  Segment* max_segment;
-  std::map<voxblox::Segment*, size_t> segments_to_recompute;
-
-  for (auto label_it = candidates->begin(); label_it != candidates->end();
-       ++label_it) {
-    for (auto segment_it = label_it->second.begin();
-         segment_it != label_it->second.end(); segment_it++) {
-      bool count_greater_than_max = segment_it->second > max_count;
-      bool count_greater_than_min =
-          segment_it->second > label_tsdf_config_.min_label_voxel_count;
-      bool is_unlabelled =
-          labelled_segments.find(segment_it->first) == labelled_segments.end();
-      if (count_greater_than_max && count_greater_than_min && is_unlabelled) {
-        max_count = segment_it->second;
-        max_segment = segment_it->first;
-        max_label = label_it->first;
-        segments_to_recompute = label_it->second;
-      }
-    }
-  }
-  if (max_count == 0u) {
+  // Pop pairs until one is still up to date and its segment is unlabelled.
+  std::map<Label, std::map<Segment*, size_t>>::iterator max_label_it;
+  Segment* max_segment = nullptr;
+  while (!label_assignment->queue.empty()) {
+    std::pop_heap(label_assignment->queue.begin(),
+                  label_assignment->queue.end());
+    const LabelAssignmentCandidate top = label_assignment->queue.back();
+    label_assignment->queue.pop_back();
+    if (labelled_segments.find(top.segment) != labelled_segments.end()) {
+      continue;
+    }
+    max_label_it = candidates->find(top.label);
+    if (max_label_it == candidates->end()) {
+      continue;
+    }
+    auto segment_it = max_label_it->second.find(top.segment);
+    if (segment_it != max_label_it->second.end() &&
+        segment_it->second == top.count) {
+      max_segment = top.segment;
+      break;
+    }
+  }
+  if (max_segment == nullptr) {
     return false;
   }
+  const Label max_label = max_label_it->first;
 
   segment_label_pair->first = max_segment;
   segment_label_pair->second = max_label;
-  assigned_labels->emplace(max_label);
-
-  // For all segments that need to have their label
-  // count recomputed, first clean their relative entries and recompute.
-  for (auto segment : segments_to_recompute) {
-    if (segment.first != max_segment) {
-      for (auto label_it = candidates->begin(); label_it != candidates->end();
-           ++label_it) {
-        if (label_it->first != max_label) {
-          label_it->second.erase(segment.first);
-        }
+  assigned_labels->insert(max_label);
+
+  // All other segments that voted for the assigned label need their label
+  // counts recomputed without it. First clean their entries, except for
+  // the assigned label, and then vote again.
+  std::vector<Segment*> segments_to_recompute;
+  for (const std::pair<Segment* const, size_t>& segment_count :
+       max_label_it->second) {
+    if (segment_count.first != max_segment) {
+      segments_to_recompute.push_back(segment_count.first);
+    }
+  }
+  for (Segment* segment : segments_to_recompute) {
+    Labels& segment_labels = label_assignment->segment_labels[segment];
+    for (const Label label : segment_labels) {
+      auto label_it = candidates->find(label);
+      if (label != max_label && label_it != candidates->end()) {
+        label_it->second.erase(segment);
       }
-      computeSegmentLabelCandidates(segment.first, candidates,
-                                    segment_merge_candidates, *assigned_labels);
     }
+    segment_labels.clear();
+    segment_labels.push_back(max_label);
+  }
+
+  // Segments that voted with the map before are served from the cache.
+  std::vector<const SegmentVoxelLabels*> segment_voxel_labels;
+  segment_voxel_labels.reserve(segments_to_recompute.size());
+  for (Segment* segment : segments_to_recompute) {
+    auto voxel_labels_it = segment_voxel_labels_.find(segment);
+    segment_voxel_labels.push_back(
+        voxel_labels_it != segment_voxel_labels_.end()
+            ? &voxel_labels_it->second
+            : nullptr);
+  }
+
+  std::vector<SegmentLabelVotes> segment_votes(segments_to_recompute.size());
+  thread_pool_.parallelFor(
+      segments_to_recompute.size(),
+      [&](const size_t segment_idx, const size_t worker_idx) {
+        const Segment& segment = *segments_to_recompute[segment_idx];
+        if (segment_voxel_labels[segment_idx] != nullptr) {
+          voteCachedSegmentLabels(*segment_voxel_labels[segment_idx],
+                                  segment.points_C_.size(), *assigned_labels,
+                                  worker_idx, &segment_votes[segment_idx]);
+        } else {
+          voteSegmentLabels(segment, *assigned_labels, worker_idx,
+                            &segment_votes[segment_idx]);
+        }
+      });
+
+  Labels candidate_labels;
+  for (size_t segment_idx = 0u; segment_idx < segments_to_recompute.size();
+       ++segment_idx) {
+    Segment* segment = segments_to_recompute[segment_idx];
+    addSegmentLabelCandidates(segment, segment_votes[segment_idx], candidates,
+                              segment_merge_candidates, &candidate_labels);
+    queueLabelCandidates(segment, candidate_labels, *candidates,
+                         label_assignment);
   }
   return true;
 }
+
+void LabelTsdfIntegrator::renderLabelImage(
+    const Transformation& T_G_C, const CameraIntrinsics& intrinsics) {
+  if (label_tsdf_config_.enable_temporal_label_cache &&
+      canReuseRenderedLabels(T_G_C, intrinsics)) {
+    // The segments are projected into the camera the rendering was made
+    // from, so it stays consistent with them.
+    rendered_labels_.is_valid = true;
+    return;
+  }
+
+  timing::Timer render_timer("render_label_image");
+  rendered_labels_.T_C_G = T_G_C.inverse();
+  rendered_labels_.intrinsics = intrinsics;
+  rendered_labels_.depth_image.setConstant(
+      intrinsics.height, intrinsics.width,
+      std::numeric_limits<FloatingPoint>::infinity());
+  rendered_labels_.label_voxels.assign(intrinsics.width * intrinsics.height,
+                                       LabelVoxel());
+  rendered_labels_.is_valid = true;
+  rendered_labels_.is_reusable = true;
+  rendered_labels_.num_voxel_label_changes = 0u;
+
+  const Transformation& T_C_G = rendered_labels_.T_C_G;
+  const FloatingPoint max_surface_distance =
+      label_tsdf_config_.label_propagation_td_factor * voxel_size_;
+  const FloatingPoint block_radius = 0.5f * std::sqrt(3.0f) * block_size_;
+  BlockIndexList label_blocks;
+  if (active_blocks_.isValid()) {
+    // The active blocks are already culled to the frustum.
+    for (const ActiveBlockSet::ActiveBlock& active_block :
+         active_blocks_.getBlocks()) {
+      label_blocks.push_back(active_block.block_idx);
+    }
+  } else {
+    map_->getAllLabelBlockIndices(&label_blocks);
+  }
+  for (const BlockIndex& block_idx : label_blocks) {
+    const Point block_center_C =
+        T_C_G * getCenterPointFromGridIndex(block_idx, block_size_);
+    if (!active_blocks_.isValid() &&
+        !intrinsics.isSphereInFrustum(block_center_C, block_radius,
+                                      config_.max_ray_length_m)) {
+      continue;
+    }
+    Layer<LabelVoxel>::BlockType::ConstPtr label_block;
+    Layer<TsdfVoxel>::BlockType::ConstPtr tsdf_block;
+    getTsdfAndLabelBlocks(block_idx, &tsdf_block, &label_block);
+    if (tsdf_block == nullptr || label_block == nullptr) {
+      continue;
+    }
+
+    for (size_t linear_idx = 0u; linear_idx < label_block->num_voxels();
+         ++linear_idx) {
+      const LabelVoxel& label_voxel =
+          label_block->getVoxelByLinearIndex(linear_idx);
+      const TsdfVoxel& tsdf_voxel =
+          tsdf_block->getVoxelByLinearIndex(linear_idx);
+      if (label_voxel.label == 0u || tsdf_voxel.weight <= 0.0f ||
+          std::abs(tsdf_voxel.distance) >= max_surface_distance) {
+        continue;
+      }
+      const Point voxel_center_C =
+          T_C_G * label_block->computeCoordinatesFromLinearIndex(linear_idx);
+      const FloatingPoint depth = voxel_center_C.z();
+      if (depth <= 0.0f) {
+        continue;
+      }
+
+      // Splat the voxel onto the pixels its projection covers.
+      const FloatingPoint u_center =
+          intrinsics.fx * voxel_center_C.x() / depth + intrinsics.cx;
+      const FloatingPoint v_center =
+          intrinsics.fy * voxel_center_C.y() / depth + intrinsics.cy;
+      const FloatingPoint u_half_size =
+          0.5f * voxel_size_ * intrinsics.fx / depth;
+      const FloatingPoint v_half_size =
+          0.5f * voxel_size_ * intrinsics.fy / depth;
+      const int u_min = std::max(
+          0, static_cast<int>(std::round(u_center - u_half_size)));
+      const int u_max =
+          std::min(intrinsics.width - 1,
+                   static_cast<int>(std::round(u_center + u_half_size)));
+      const int v_min = std::max(
+          0, static_cast<int>(std::round(v_center - v_half_size)));
+      const int v_max =
+          std::min(intrinsics.height - 1,
+                   static_cast<int>(std::round(v_center + v_half_size)));
+      for (int v = v_min; v <= v_max; ++v) {
+        for (int u = u_min; u <= u_max; ++u) {
+          FloatingPoint& pixel_depth = rendered_labels_.depth_image(v, u);
+          if (depth < pixel_depth) {
+            pixel_depth = depth;
+            rendered_labels_.label_voxels[v * intrinsics.width + u] =
+                label_voxel;
+          }
+        }
+      }
+    }
+  }
+}
+
+void LabelTsdfIntegrator::preprocessFrame(
+    const std::vector<Segment*>& segments) {
+  timing::Timer preprocess_timer("preprocess_frame");
+  clearPreprocessedFrame();
+  if (segments.empty()) {
+    return;
+  }
+  PreprocessedFrame& frame = preprocessed_frame_;
+  frame.T_G_C = segments.front()->T_G_C_;
+
+  size_t num_points = 0u;
+  for (const Segment* segment : segments) {
+    CHECK_NOTNULL(segment);
+    CHECK(segment->T_G_C_.getTransformationMatrix().isApprox(
+        frame.T_G_C.getTransformationMatrix()))
+        << "All segments of a frame need to be observed from the same pose.";
+    frame.segment_ranges[segment] =
+        std::make_pair(num_points, segment->points_C_.size());
+    num_points += segment->points_C_.size();
+  }
+  frame.segments.assign(segments.begin(), segments.end());
+  frame.points_C.reserve(num_points);
+  frame.colors.reserve(num_points);
+  for (const Segment* segment : segments) {
+    frame.points_C.insert(frame.points_C.end(), segment->points_C_.begin(),
+                          segment->points_C_.end());
+    frame.colors.insert(frame.colors.end(), segment->colors_.begin(),
+                        segment->colors_.end());
+  }
+
+  if (num_points > 0u) {
+    // The points are stored contiguously, so they are transformed and
+    // voxelized all at once. The voxel indices include the same
+    // kCoordinateEpsilon as getGridIndexFromPoint(), so points on voxel and
+    // block boundaries end up in the same voxels as in bundleRays() and
+    // getSegmentVoxelsByBlock().
+    const Eigen::Map<const Eigen::Matrix<FloatingPoint, 3, Eigen::Dynamic>>
+        points_C(frame.points_C.front().data(), 3, num_points);
+    frame.points_G = (frame.T_G_C.getRotationMatrix() * points_C).colwise() +
+                     frame.T_G_C.getPosition();
+    frame.global_voxel_indices =
+        (frame.points_G.array() * voxel_size_inv_ + kCoordinateEpsilon)
+            .floor()
+            .cast<LongIndexElement>()
+            .matrix();
+    frame.block_indices =
+        (frame.global_voxel_indices.cast<FloatingPoint>().array() *
+         voxels_per_side_inv_)
+            .floor()
+            .cast<IndexElement>()
+            .matrix();
+  }
+  frame.is_valid = true;
+}
+
+void LabelTsdfIntegrator::clearPreprocessedFrame() {
+  PreprocessedFrame& frame = preprocessed_frame_;
+  frame.is_valid = false;
+  frame.segments.clear();
+  frame.segment_ranges.clear();
+  frame.points_C.clear();
+  frame.colors.clear();
+}
+
+void LabelTsdfIntegrator::updateActiveBlocks(
+    const Transformation& T_G_C, const CameraIntrinsics& intrinsics) {
+  timing::Timer active_blocks_timer("update_active_blocks");
+  active_blocks_.update(T_G_C, intrinsics, config_.max_ray_length_m, layer_,
+                        label_layer_);
+  unpackActiveLabelBlocks();
+}
+
+void LabelTsdfIntegrator::updateActiveBlocks(
+    const Transformation& T_G_C, const std::vector<Segment*>& segments) {
+  timing::Timer active_blocks_timer("update_active_blocks");
+  // The box is computed in the camera frame and its corners are transformed,
+  // which bounds the points without transforming all of them.
+  Point min_C = Point::Zero();
+  Point max_C = Point::Zero();
+  for (const Segment* segment : segments) {
+    CHECK_NOTNULL(segment);
+    for (const Point& point_C : segment->points_C_) {
+      min_C = min_C.cwiseMin(point_C);
+      max_C = max_C.cwiseMax(point_C);
+    }
+  }
+  Point min_G = T_G_C.getPosition();
+  Point max_G = min_G;
+  for (int corner_idx = 0; corner_idx < 8; ++corner_idx) {
+    const Point corner_C((corner_idx & 1) ? max_C.x() : min_C.x(),
+                         (corner_idx & 2) ? max_C.y() : min_C.y(),
+                         (corner_idx & 4) ? max_C.z() : min_C.z());
+    const Point corner_G = T_G_C * corner_C;
+    min_G = min_G.cwiseMin(corner_G);
+    max_G = max_G.cwiseMax(corner_G);
+  }
+  const Point padding = Point::Constant(config_.default_truncation_distance);
+  active_blocks_.update(min_G - padding, max_G + padding, layer_,
+                        label_layer_);
+  unpackActiveLabelBlocks();
+}
+
+void LabelTsdfIntegrator::unpackActiveLabelBlocks() {
+  if (!map_->hasPackedLabelBlocks()) {
+    return;
+  }
+  const AlignedVector<ActiveBlockSet::ActiveBlock>& active_blocks =
+      active_blocks_.getBlocks();
+  for (size_t block_pos = 0u; block_pos < active_blocks.size(); ++block_pos) {
+    const ActiveBlockSet::ActiveBlock& active_block = active_blocks[block_pos];
+    if (active_block.label_block == nullptr) {
+      active_blocks_.setLabelBlock(
+          block_pos, map_->unpackLabelBlock(active_block.block_idx));
+    }
+  }
+}
+
+void LabelTsdfIntegrator::clearActiveBlocks() {
+  if (map_->getConfig().inactive_label_block_encoding !=
+      LabelTsdfMap::kDense) {
+    timing::Timer pack_timer("pack_label_blocks");
+    BlockIndexList label_blocks;
+    label_layer_->getAllAllocatedBlocks(&label_blocks);
+    for (const BlockIndex& block_idx : label_blocks) {
+      // Label blocks with label changes to mesh are packed once they are
+      // meshed.
+      if (active_blocks_.getBlock(block_idx) == nullptr &&
+          !label_layer_->getBlockByIndex(block_idx).updated()) {
+        map_->packLabelBlock(block_idx);
+      }
+    }
+  }
+  active_blocks_.clear();
+}
+
+void LabelTsdfIntegrator::getTsdfAndLabelBlocks(
+    const BlockIndex& block_idx, Block<TsdfVoxel>::ConstPtr* tsdf_block,
+    Block<LabelVoxel>::ConstPtr* label_block) const {
+  CHECK_NOTNULL(tsdf_block);
+  CHECK_NOTNULL(label_block);
+  const ActiveBlockSet::ActiveBlock* active_block =
+      active_blocks_.getBlock(block_idx);
+  if (active_block != nullptr) {
+    *tsdf_block = active_block->tsdf_block;
+    *label_block = active_block->label_block;
+  } else {
+    *tsdf_block = layer_->getBlockPtrByIndex(block_idx);
+    *label_block = nullptr;
+  }
+  // Label blocks can be allocated after the set was updated.
+  if (*label_block == nullptr) {
+    *label_block = map_->getLabelBlockPtrByIndex(block_idx);
+  }
+}
+
+bool LabelTsdfIntegrator::canReuseRenderedLabels(
+    const Transformation& T_G_C, const CameraIntrinsics& intrinsics) const {
+  if (!rendered_labels_.is_reusable ||
+      rendered_labels_.num_voxel_label_changes >
+          static_cast<size_t>(
+              label_tsdf_config_.temporal_cache_max_voxel_label_changes)) {
+    return false;
+  }
+  const CameraIntrinsics& rendered_intrinsics = rendered_labels_.intrinsics;
+  if (intrinsics.width != rendered_intrinsics.width ||
+      intrinsics.height != rendered_intrinsics.height ||
+      intrinsics.fx != rendered_intrinsics.fx ||
+      intrinsics.fy != rendered_intrinsics.fy ||
+      intrinsics.cx != rendered_intrinsics.cx ||
+      intrinsics.cy != rendered_intrinsics.cy) {
+    return false;
+  }
+
+  const Transformation T_Crendered_C = rendered_labels_.T_C_G * T_G_C;
+  const FloatingPoint rotation_angle =
+      Eigen::AngleAxis<FloatingPoint>(T_Crendered_C.getRotationMatrix())
+          .angle();
+  return T_Crendered_C.getPosition().norm() <
+             label_tsdf_config_.temporal_cache_max_translation &&
+         std::abs(rotation_angle) <
+             label_tsdf_config_.temporal_cache_max_rotation;
+}
+
 void LabelTsdfIntegrator::decideLabelPointClouds(
     std::vector<voxblox::Segment*>* segments_to_integrate,
     std::map<voxblox::Label, std::map<voxblox::Segment*, size_t>>* candidates,
@@ -295,13 +1031,15 @@ void LabelTsdfIntegrator::decideLabelPointClouds(
   CHECK_NOTNULL(segments_to_integrate);
   CHECK_NOTNULL(candidates);
   CHECK_NOTNULL(segment_merge_candidates);
-  std::set<Label> assigned_labels;
   std::set<Segment*> labelled_segments;
   std::pair<Segment*, Label> pair;
   std::set<InstanceLabel> assigned_instances;
 
-  while (getNextSegmentLabelPair(labelled_segments, &assigned_labels,
-                                 candidates, segment_merge_candidates, &pair)) {
+  assigned_labels_.clear();
+  initLabelAssignment(*candidates, &label_assignment_);
+  while (getNextSegmentLabelPair(labelled_segments, &assigned_labels_,
+                                 candidates, segment_merge_candidates,
+                                 &label_assignment_, &pair)) {
     Segment* segment = pair.first;
     CHECK_NOTNULL(segment);
     Label& label = pair.second;
@@ -310,6 +1048,8 @@ void LabelTsdfIntegrator::decideLabelPointClouds(
     labelled_segments.insert(segment);
     candidates->erase(label);
   }
+  segment_voxel_labels_.clear();
+  rendered_labels_.is_valid = false;
 
   for (auto merge_candidates : *segment_merge_candidates) {
     increasePairwiseConfidenceCount(merge_candidates.second);
@@ -394,6 +1134,9 @@ void LabelTsdfIntegrator::changeLabelCount(const Label& label,
     label_count_it->second = label_count_it->second + count;
     if (label_count_it->second <= 0) {
       label_count_map_ptr_->erase(label_count_it);
+      if (label_tsdf_config_.enable_label_recycling) {
+        dead_labels_.emplace_back(label, num_frames_);
+      }
     }
   } else {
     if (label != 0u) {
@@ -406,10 +1149,11 @@ void LabelTsdfIntegrator::changeLabelCount(const Label& label,
 }
 
 LabelVoxel* LabelTsdfIntegrator::allocateStorageAndGetLabelVoxelPtr(
-    const GlobalIndex& global_voxel_idx, Block<LabelVoxel>::Ptr* last_block,
-    BlockIndex* last_block_idx) {
+    const GlobalIndex& global_voxel_idx, const size_t worker_idx,
+    Block<LabelVoxel>::Ptr* last_block, BlockIndex* last_block_idx) {
   CHECK_NOTNULL(last_block);
   CHECK_NOTNULL(last_block_idx);
+  CHECK_LT(worker_idx, temp_label_block_maps_.size());
 
   const BlockIndex block_idx =
       getBlockIndexFromGlobalVoxelIndex(global_voxel_idx, voxels_per_side_inv_);
@@ -421,21 +1165,23 @@ LabelVoxel* LabelTsdfIntegrator::allocateStorageAndGetLabelVoxelPtr(
   if ((block_idx != *last_block_idx) || (*last_block == nullptr)) {
     *last_block = label_layer_->getBlockPtrByIndex(block_idx);
     *last_block_idx = block_idx;
+    if (*last_block == nullptr) {
+      *last_block = getUnpackedLabelBlockPtr(block_idx);
+    }
   }
 
   // If no block at this location currently exists, we allocate a temporary
-  // voxel that will be merged into the map later
+  // voxel that will be merged into the map later. Every worker has its own
+  // temporary blocks, so no locking is needed to let them grow.
   if (*last_block == nullptr) {
-    // To allow temp_label_block_map_ to grow we can only let
-    // one thread in at once
-    std::lock_guard<std::mutex> lock(temp_label_block_mutex_);
-
+    Layer<LabelVoxel>::BlockHashMap& temp_label_block_map =
+        temp_label_block_maps_[worker_idx];
     typename Layer<LabelVoxel>::BlockHashMap::iterator it =
-        temp_label_block_map_.find(block_idx);
-    if (it != temp_label_block_map_.end()) {
+        temp_label_block_map.find(block_idx);
+    if (it != temp_label_block_map.end()) {
       *last_block = it->second;
     } else {
-      auto insert_status = temp_label_block_map_.emplace(
+      auto insert_status = temp_label_block_map.emplace(
           block_idx, std::make_shared<Block<LabelVoxel>>(
                          voxels_per_side_, voxel_size_,
                          getOriginPointFromGridIndex(block_idx, block_size_)));
@@ -453,28 +1199,261 @@ LabelVoxel* LabelTsdfIntegrator::allocateStorageAndGetLabelVoxelPtr(
   return &((*last_block)->getVoxelByVoxelIndex(local_voxel_idx));
 }
 
+LabelVoxel* LabelTsdfIntegrator::getAllocatedLabelVoxelPtr(
+    const GlobalIndex& global_voxel_idx, const size_t worker_idx,
+    Block<LabelVoxel>::Ptr* last_block, BlockIndex* last_block_idx) {
+  CHECK_NOTNULL(last_block);
+  CHECK_NOTNULL(last_block_idx);
+  CHECK_LT(worker_idx, temp_label_block_maps_.size());
+
+  const BlockIndex block_idx =
+      getBlockIndexFromGlobalVoxelIndex(global_voxel_idx, voxels_per_side_inv_);
+  if ((block_idx != *last_block_idx) || (*last_block == nullptr)) {
+    *last_block = label_layer_->getBlockPtrByIndex(block_idx);
+    *last_block_idx = block_idx;
+    if (*last_block == nullptr) {
+      *last_block = getUnpackedLabelBlockPtr(block_idx);
+    }
+    if (*last_block == nullptr) {
+      const Layer<LabelVoxel>::BlockHashMap& temp_label_block_map =
+          temp_label_block_maps_[worker_idx];
+      typename Layer<LabelVoxel>::BlockHashMap::const_iterator it =
+          temp_label_block_map.find(block_idx);
+      if (it != temp_label_block_map.end()) {
+        *last_block = it->second;
+      }
+    }
+  }
+  if (*last_block == nullptr) {
+    return nullptr;
+  }
+
+  const VoxelIndex local_voxel_idx =
+      getLocalFromGlobalVoxelIndex(global_voxel_idx, voxels_per_side_);
+  return &((*last_block)->getVoxelByVoxelIndex(local_voxel_idx));
+}
+
+LabelVoxel* LabelTsdfIntegrator::getLabelVoxelPtrInBand(
+    const GlobalIndex& global_voxel_idx, const FloatingPoint sdf,
+    const size_t worker_idx, BlockCache* block_cache) {
+  CHECK_NOTNULL(block_cache);
+  if (isInLabelBand(sdf)) {
+    return allocateStorageAndGetLabelVoxelPtr(
+        global_voxel_idx, worker_idx, &block_cache->label_block,
+        &block_cache->label_block_idx);
+  }
+  return getAllocatedLabelVoxelPtr(global_voxel_idx, worker_idx,
+                                   &block_cache->label_block,
+                                   &block_cache->label_block_idx);
+}
+
+void LabelTsdfIntegrator::mergeLabelVoxelVotes(const LabelVoxel& source_voxel,
+                                               LabelVoxel* target_voxel) {
+  CHECK_NOTNULL(target_voxel);
+  constexpr size_t kNumLabelSlots =
+      sizeof(LabelVoxel::label_count) / sizeof(LabelCount);
+
+  LabelCount votes[2u * kNumLabelSlots];
+  size_t num_votes = 0u;
+  for (const LabelCount& label_count : target_voxel->label_count) {
+    if (label_count.label != 0u) {
+      votes[num_votes++] = label_count;
+    }
+  }
+  for (const LabelCount& label_count : source_voxel.label_count) {
+    if (label_count.label == 0u) {
+      continue;
+    }
+    LabelCount* votes_end = votes + num_votes;
+    LabelCount* vote_it =
+        std::find_if(votes, votes_end, [&label_count](const LabelCount& vote) {
+          return vote.label == label_count.label;
+        });
+    if (vote_it != votes_end) {
+      vote_it->label_confidence = addLabelConfidences(
+          vote_it->label_confidence, label_count.label_confidence);
+    } else {
+      votes[num_votes++] = label_count;
+    }
+  }
+
+  // If not all labels fit into the voxel, keep the most confident ones.
+  if (num_votes > kNumLabelSlots) {
+    std::stable_sort(votes, votes + num_votes,
+                     [](const LabelCount& lhs, const LabelCount& rhs) {
+                       return lhs.label_confidence > rhs.label_confidence;
+                     });
+  }
+  for (size_t slot_idx = 0u; slot_idx < kNumLabelSlots; ++slot_idx) {
+    target_voxel->label_count[slot_idx] =
+        slot_idx < num_votes ? votes[slot_idx] : LabelCount();
+  }
+}
+
+void LabelTsdfIntegrator::mergeDuplicateLabelBlocks(
+    const std::vector<Block<LabelVoxel>::Ptr>& label_blocks,
+    const size_t worker_idx) {
+  CHECK_GT(label_blocks.size(), 1u);
+  CHECK_LT(worker_idx, label_count_deltas_.size());
+  Block<LabelVoxel>& merged_block = *label_blocks.front();
+
+  // Every copy of a voxel accounted for its own label while it was being
+  // updated, replace these counts with the one of the merged voxel.
+  LabelCountDeltas& label_count_changes = label_count_deltas_[worker_idx];
+  for (size_t linear_idx = 0u; linear_idx < merged_block.num_voxels();
+       ++linear_idx) {
+    LabelVoxel& merged_voxel = merged_block.getVoxelByLinearIndex(linear_idx);
+    --label_count_changes[merged_voxel.label];
+    for (size_t block_idx = 1u; block_idx < label_blocks.size(); ++block_idx) {
+      const LabelVoxel& label_voxel =
+          label_blocks[block_idx]->getVoxelByLinearIndex(linear_idx);
+      --label_count_changes[label_voxel.label];
+      mergeLabelVoxelVotes(label_voxel, &merged_voxel);
+    }
+    updateVoxelLabelAndConfidence(&merged_voxel);
+    ++label_count_changes[merged_voxel.label];
+  }
+}
+
+Block<LabelVoxel>::Ptr LabelTsdfIntegrator::getUnpackedLabelBlockPtr(
+    const BlockIndex& block_idx) {
+  // The packed blocks are only read while the workers integrate.
+  if (!map_->isLabelBlockPacked(block_idx)) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(unpacked_label_blocks_mutex_);
+  Block<LabelVoxel>::Ptr& label_block = unpacked_label_blocks_[block_idx];
+  if (label_block == nullptr) {
+    label_block = map_->decodePackedLabelBlock(block_idx);
+  }
+  return label_block;
+}
+
 void LabelTsdfIntegrator::updateLabelLayerWithStoredBlocks() {
-  BlockIndex last_block_idx;
-  Block<LabelVoxel>::Ptr block = nullptr;
+  for (const std::pair<const BlockIndex, Block<LabelVoxel>::Ptr>&
+           unpacked_label_block_pair : unpacked_label_blocks_) {
+    map_->insertLabelBlock(unpacked_label_block_pair.first,
+                           unpacked_label_block_pair.second);
+  }
+  unpacked_label_blocks_.clear();
+
+  // Group the temporary blocks of all workers by their index, several workers
+  // may have allocated the same block.
+  AnyIndexHashMapType<std::vector<Block<LabelVoxel>::Ptr>>::type
+      stored_label_blocks;
+  for (Layer<LabelVoxel>::BlockHashMap& temp_label_block_map :
+       temp_label_block_maps_) {
+    for (const std::pair<const BlockIndex, Block<LabelVoxel>::Ptr>&
+             temp_label_block_pair : temp_label_block_map) {
+      stored_label_blocks[temp_label_block_pair.first].push_back(
+          temp_label_block_pair.second);
+    }
+    temp_label_block_map.clear();
+  }
+
+  std::vector<const std::vector<Block<LabelVoxel>::Ptr>*> duplicate_blocks;
+  for (const auto& stored_label_block_pair : stored_label_blocks) {
+    if (stored_label_block_pair.second.size() > 1u) {
+      duplicate_blocks.push_back(&stored_label_block_pair.second);
+    }
+  }
+
+  // The votes of duplicate blocks are combined into the first of them.
+  thread_pool_.parallelFor(
+      duplicate_blocks.size(),
+      [&](const size_t task_idx, const size_t worker_idx) {
+        mergeDuplicateLabelBlocks(*duplicate_blocks[task_idx], worker_idx);
+      });
+
+  for (const auto& stored_label_block_pair : stored_label_blocks) {
+    label_layer_->insertBlock(std::make_pair(
+        stored_label_block_pair.first, stored_label_block_pair.second.front()));
+  }
+}
+
+void LabelTsdfIntegrator::updateLayersWithStoredBlocks() {
+  BlockIndexList new_block_indices;
+  if (map_->usesCombinedBlocks()) {
+    for (const std::pair<const BlockIndex, Block<TsdfVoxel>::Ptr>&
+             temp_block_pair : temp_block_map_) {
+      new_block_indices.push_back(temp_block_pair.first);
+    }
+    for (const Layer<LabelVoxel>::BlockHashMap& temp_label_block_map :
+         temp_label_block_maps_) {
+      for (const std::pair<const BlockIndex, Block<LabelVoxel>::Ptr>&
+               temp_label_block_pair : temp_label_block_map) {
+        new_block_indices.push_back(temp_label_block_pair.first);
+      }
+    }
+  }
+
+  updateLayerWithStoredBlocks();
+  updateLabelLayerWithStoredBlocks();
 
-  for (const std::pair<const BlockIndex, Block<LabelVoxel>::Ptr>&
-           temp_label_block_pair : temp_label_block_map_) {
-    label_layer_->insertBlock(temp_label_block_pair);
+  // Every new block gets its counterpart in the other layer.
+  for (const BlockIndex& block_idx : new_block_indices) {
+    map_->allocateCombinedBlockByIndex(block_idx);
   }
-
-  temp_label_block_map_.clear();
 }
 
 // Updates label_voxel. Thread safe.
 void LabelTsdfIntegrator::updateLabelVoxel(const Point& point_G,
                                            const Label& label,
-                                           LabelVoxel* label_voxel,
-                                           const LabelConfidence& confidence) {
+                                           const LabelConfidence& confidence,
+                                           const size_t worker_idx,
+                                           LabelVoxel* label_voxel) {
   CHECK_NOTNULL(label_voxel);
+  if (label_tsdf_config_.enable_lock_free_label_updates) {
+    updateLabelVoxelLockFree(label, confidence, worker_idx, label_voxel);
+    return;
+  }
+
   // Lookup the mutex that is responsible for this voxel and lock it.
   std::lock_guard<std::mutex> lock(mutexes_.get(
       getGridIndexFromPoint<GlobalIndex>(point_G, voxel_size_inv_)));
 
+  updateLabelVoxelUnlocked(label, confidence, worker_idx, label_voxel);
+}
+
+void LabelTsdfIntegrator::updateLabelVoxelLockFree(
+    const Label& label, const LabelConfidence& confidence,
+    const size_t worker_idx, LabelVoxel* label_voxel) {
+  CHECK_NOTNULL(label_voxel);
+#ifdef GSM_HAVE_LABEL_VOXEL_COMPARE_AND_SWAP
+  LabelVoxelBits* voxel_bits = reinterpret_cast<LabelVoxelBits*>(label_voxel);
+  // Swapping zero for zero reads the voxel atomically.
+  LabelVoxelBits previous_bits =
+      __sync_val_compare_and_swap(voxel_bits, 0u, 0u);
+  LabelVoxel previous_voxel;
+  LabelVoxel updated_voxel;
+  // Apply the vote to a copy of the voxel and publish it if no other thread
+  // modified the voxel in the meantime, otherwise retry with the new state.
+  while (true) {
+    std::memcpy(static_cast<void*>(&previous_voxel), &previous_bits,
+                sizeof(LabelVoxel));
+    updated_voxel = previous_voxel;
+    addVoxelLabelConfidence(label, confidence, &updated_voxel);
+    updateVoxelLabelAndConfidence(&updated_voxel, label);
+    LabelVoxelBits updated_bits;
+    std::memcpy(&updated_bits, &updated_voxel, sizeof(LabelVoxel));
+    const LabelVoxelBits current_bits =
+        __sync_val_compare_and_swap(voxel_bits, previous_bits, updated_bits);
+    if (current_bits == previous_bits) {
+      break;
+    }
+    previous_bits = current_bits;
+  }
+
+  updateChangedVoxelLabel(previous_voxel.label, updated_voxel.label,
+                          worker_idx);
+#else
+  LOG(FATAL) << "Lock-free label updates are not available in this build.";
+#endif
+}
+
+void LabelTsdfIntegrator::updateLabelVoxelUnlocked(
+    const Label& label, const LabelConfidence& confidence,
+    const size_t worker_idx, LabelVoxel* label_voxel) {
   CHECK_NOTNULL(label_voxel);
 
   // label_voxel->semantic_label = semantic_label;
@@ -487,21 +1466,66 @@ void LabelTsdfIntegrator::updateLabelVoxel(const Point& point_G,
   // Now all is good.
   // increaseLabelClassCount(new_label, semantic_label);
 
+  updateChangedVoxelLabel(previous_label, new_label, worker_idx);
+}
+
+void LabelTsdfIntegrator::updateChangedVoxelLabel(const Label& previous_label,
+                                                  const Label& new_label,
+                                                  const size_t worker_idx) {
   if (new_label != previous_label) {
     // Both of the segments corresponding to the two labels are
     // updated, one gains a voxel, one loses a voxel.
-    std::lock_guard<std::mutex> lock(updated_labels_mutex_);
+    LabelCountDeltas& label_count_deltas = label_count_deltas_[worker_idx];
+    ++label_count_deltas[new_label];
+    --label_count_deltas[previous_label];
+  }
+}
 
-    updated_labels_.insert(new_label);
-    changeLabelCount(new_label, 1);
+void LabelTsdfIntegrator::reduceLabelCountDeltas() {
+  // Every voxel label change adds one to a label and removes one from
+  // another, including label 0 of unlabelled voxels.
+  size_t num_label_count_changes = 0u;
+  for (LabelCountDeltas& label_count_deltas : label_count_deltas_) {
+    for (const std::pair<const Label, int>& label_count_delta :
+         label_count_deltas) {
+      const Label label = label_count_delta.first;
+      num_label_count_changes += std::abs(label_count_delta.second);
+      if (label == 0u) {
+        continue;
+      }
+      updated_labels_.insert(label);
+      if (label_count_delta.second != 0) {
+        changeLabelCount(label, label_count_delta.second);
+      }
+      if (*highest_label_ptr_ < label) {
+        *highest_label_ptr_ = label;
+      }
+    }
+    label_count_deltas.clear();
+  }
+  rendered_labels_.num_voxel_label_changes += num_label_count_changes / 2u;
+}
 
-    if (previous_label != 0u) {
-      updated_labels_.insert(previous_label);
-      changeLabelCount(previous_label, -1);
+void LabelTsdfIntegrator::reduceLabelBlockVotes() {
+  for (LabelBlockVotes& label_block_votes : label_block_votes_) {
+    for (const std::pair<Label, BlockIndex>& label_block_vote :
+         label_block_votes) {
+      label_block_index_[label_block_vote.first].insert(
+          label_block_vote.second);
     }
+    label_block_votes.clear();
+  }
+}
 
-    if (*highest_label_ptr_ < new_label) {
-      *highest_label_ptr_ = new_label;
+void LabelTsdfIntegrator::indexLabelBlock(
+    const BlockIndex& block_idx, const Block<LabelVoxel>& label_block) {
+  for (size_t linear_idx = 0u; linear_idx < label_block.num_voxels();
+       ++linear_idx) {
+    for (const LabelCount& label_count :
+         label_block.getVoxelByLinearIndex(linear_idx).label_count) {
+      if (label_count.label != 0u) {
+        label_block_index_[label_count.label].insert(block_idx);
+      }
     }
   }
 }
@@ -511,7 +1535,17 @@ void LabelTsdfIntegrator::integratePointCloud(const Transformation& T_G_C,
                                               const Colors& colors,
                                               const Label& label,
                                               const bool freespace_points) {
+  const Labels labels(points_C.size(), label);
+  integratePointCloud(T_G_C, points_C, colors, labels, freespace_points);
+}
+
+void LabelTsdfIntegrator::integratePointCloud(const Transformation& T_G_C,
+                                              const Pointcloud& points_C,
+                                              const Colors& colors,
+                                              const Labels& labels,
+                                              const bool freespace_points) {
   CHECK_EQ(points_C.size(), colors.size());
+  CHECK_EQ(points_C.size(), labels.size());
   CHECK_GE(points_C.size(), 0u);
 
   // Pre-compute a list of unique voxels to end on.
@@ -527,47 +1561,351 @@ void LabelTsdfIntegrator::integratePointCloud(const Transformation& T_G_C,
   bundleRays(T_G_C, points_C, freespace_points, index_getter.get(), &voxel_map,
              &clear_map);
 
-  integrateRays(T_G_C, points_C, colors, label, config_.enable_anti_grazing,
-                false, voxel_map, clear_map);
-
-  integrateRays(T_G_C, points_C, colors, label, config_.enable_anti_grazing,
-                true, voxel_map, clear_map);
+  constexpr bool kFuseRayPasses = false;
+  integrateRays(T_G_C, points_C, colors, labels, config_.enable_anti_grazing,
+                kFuseRayPasses, voxel_map, clear_map);
 }
 
-void LabelTsdfIntegrator::integrateVoxel(
-    const Transformation& T_G_C, const Pointcloud& points_C,
-    const Colors& colors, const Label& label, const bool enable_anti_grazing,
-    const bool clearing_ray,
-    const VoxelMapElement& global_voxel_idx_to_point_indices,
-    const VoxelMap& voxel_map) {
-  if (global_voxel_idx_to_point_indices.second.empty()) {
+void LabelTsdfIntegrator::integrateSegments(
+    const std::vector<Segment*>& segments, const bool freespace_points) {
+  if (segments.empty()) {
+    return;
+  }
+  const Transformation& T_G_C = segments.front()->T_G_C_;
+  // The whole frame is integrated at once, so the surface and clearing rays
+  // also share a single pass.
+  constexpr bool kFuseRayPasses = true;
+
+  size_t num_points = 0u;
+  for (const Segment* segment : segments) {
+    CHECK_NOTNULL(segment);
+    num_points += segment->points_C_.size();
+  }
+
+  const PreprocessedFrame& frame = preprocessed_frame_;
+  if (frame.is_valid && frame.points_C.size() == num_points &&
+      frame.segments.size() == segments.size() &&
+      std::equal(segments.begin(), segments.end(), frame.segments.begin()) &&
+      T_G_C.getTransformationMatrix().isApprox(
+          frame.T_G_C.getTransformationMatrix())) {
+    Labels labels;
+    labels.reserve(num_points);
+    for (const Segment* segment : segments) {
+      labels.insert(labels.end(), segment->points_C_.size(), segment->label_);
+    }
+
+    LongIndexHashMapType<AlignedVector<size_t>>::type voxel_map;
+    LongIndexHashMapType<AlignedVector<size_t>>::type clear_map;
+    bundlePreprocessedRays(freespace_points, &voxel_map, &clear_map);
+    integrateRays(T_G_C, frame.points_C, frame.colors, labels,
+                  config_.enable_anti_grazing, kFuseRayPasses, voxel_map,
+                  clear_map);
     return;
   }
 
+  Pointcloud points_C;
+  Colors colors;
+  Labels labels;
+  points_C.reserve(num_points);
+  colors.reserve(num_points);
+  labels.reserve(num_points);
+  for (const Segment* segment : segments) {
+    CHECK(segment->T_G_C_.getTransformationMatrix().isApprox(
+        T_G_C.getTransformationMatrix()))
+        << "All segments of a frame need to be observed from the same pose.";
+    points_C.insert(points_C.end(), segment->points_C_.begin(),
+                    segment->points_C_.end());
+    colors.insert(colors.end(), segment->colors_.begin(),
+                  segment->colors_.end());
+    labels.insert(labels.end(), segment->points_C_.size(), segment->label_);
+  }
+
+  LongIndexHashMapType<AlignedVector<size_t>>::type voxel_map;
+  LongIndexHashMapType<AlignedVector<size_t>>::type clear_map;
+  std::unique_ptr<ThreadSafeIndex> index_getter(
+      ThreadSafeIndexFactory::get(config_.integration_order_mode, points_C));
+  bundleRays(T_G_C, points_C, freespace_points, index_getter.get(), &voxel_map,
+             &clear_map);
+  integrateRays(T_G_C, points_C, colors, labels, config_.enable_anti_grazing,
+                kFuseRayPasses, voxel_map, clear_map);
+}
+
+void LabelTsdfIntegrator::integrateDepthImage(
+    const Transformation& T_G_C, const DepthImage& depth_image,
+    const SegmentIndexImage& segment_index_image,
+    const CameraIntrinsics& intrinsics, const Labels& segment_labels) {
+  CHECK_EQ(depth_image.rows(), segment_index_image.rows());
+  CHECK_EQ(depth_image.cols(), segment_index_image.cols());
+  CHECK_EQ(depth_image.rows(), intrinsics.height);
+  CHECK_EQ(depth_image.cols(), intrinsics.width);
+
+  timing::Timer allocate_timer("integrate_depth_image/allocate_blocks");
+  BlockIndexList block_indices;
+  getProjectiveBlocks(T_G_C, depth_image, intrinsics, &block_indices);
+  allocate_timer.Stop();
+
+  // Every block is updated by a single worker, so neither the tsdf nor the
+  // label voxels need to be locked against other workers.
+  timing::Timer update_timer("integrate_depth_image/update_blocks");
+  thread_pool_.parallelFor(
+      block_indices.size(),
+      [&](const size_t block_list_idx, const size_t worker_idx) {
+        integrateBlockProjectively(T_G_C, depth_image, segment_index_image,
+                                   intrinsics, segment_labels,
+                                   block_indices[block_list_idx],
+                                   worker_idx);
+      });
+  update_timer.Stop();
+
+  timing::Timer insertion_timer("inserting_missed_blocks");
+  updateLayersWithStoredBlocks();
+  reduceLabelCountDeltas();
+  reduceLabelBlockVotes();
+  insertion_timer.Stop();
+}
+
+void LabelTsdfIntegrator::getProjectiveBlocks(
+    const Transformation& T_G_C, const DepthImage& depth_image,
+    const CameraIntrinsics& intrinsics, BlockIndexList* block_indices) {
+  CHECK_NOTNULL(block_indices);
+  const FloatingPoint truncation_distance = config_.default_truncation_distance;
+  // Sampling the truncation band at half the block size finds the blocks the
+  // band passes through, except for ones it only touches at a corner.
+  const FloatingPoint band_step = 0.5f * block_size_;
+
+  IndexSet block_set;
+  BlockIndex last_block_idx;
+  bool has_last_block_idx = false;
+  for (int v = 0; v < depth_image.rows(); ++v) {
+    for (int u = 0; u < depth_image.cols(); ++u) {
+      const FloatingPoint depth = depth_image(v, u);
+      if (!isValidDepth(depth) || depth < config_.min_ray_length_m ||
+          depth > config_.max_ray_length_m) {
+        continue;
+      }
+      // Neighbouring pixels mostly fall into the same block, so only block
+      // changes are looked up in the set.
+      const Point unit_depth_point_C = intrinsics.backProjectPixel(u, v, 1.0f);
+      for (FloatingPoint band_depth = depth - truncation_distance;
+           band_depth < depth + truncation_distance + band_step;
+           band_depth += band_step) {
+        const Point point_G =
+            T_G_C * (unit_depth_point_C *
+                     std::min(band_depth, depth + truncation_distance));
+        const BlockIndex block_idx =
+            getGridIndexFromPoint<BlockIndex>(point_G, block_size_inv_);
+        if (has_last_block_idx && block_idx == last_block_idx) {
+          continue;
+        }
+        block_set.insert(block_idx);
+        last_block_idx = block_idx;
+        has_last_block_idx = true;
+      }
+    }
+  }
+
+  // Voxel carving also updates the already allocated blocks in front of the
+  // surface.
+  if (config_.voxel_carving_enabled) {
+    const Transformation T_C_G = T_G_C.inverse();
+    const FloatingPoint block_radius =
+        0.5f * std::sqrt(3.0f) * block_size_;
+    if (active_blocks_.isValid()) {
+      for (const ActiveBlockSet::ActiveBlock& active_block :
+           active_blocks_.getBlocks()) {
+        block_set.insert(active_block.block_idx);
+      }
+    }
+    BlockIndexList allocated_blocks;
+    if (!active_blocks_.isValid()) {
+      layer_->getAllAllocatedBlocks(&allocated_blocks);
+    }
+    for (const BlockIndex& block_idx : allocated_blocks) {
+      const Point block_center_G =
+          getCenterPointFromGridIndex(block_idx, block_size_);
+      if (intrinsics.isSphereInFrustum(T_C_G * block_center_G, block_radius,
+                                       config_.max_ray_length_m)) {
+        block_set.insert(block_idx);
+      }
+    }
+  }
+
+  block_indices->clear();
+  block_indices->reserve(block_set.size());
+  for (const BlockIndex& block_idx : block_set) {
+    // Active blocks are allocated already.
+    if (map_->usesCombinedBlocks()) {
+      map_->allocateCombinedBlockByIndex(block_idx);
+    } else if (active_blocks_.getBlock(block_idx) == nullptr) {
+      layer_->allocateBlockPtrByIndex(block_idx);
+    }
+    block_indices->push_back(block_idx);
+  }
+}
+
+void LabelTsdfIntegrator::integrateBlockProjectively(
+    const Transformation& T_G_C, const DepthImage& depth_image,
+    const SegmentIndexImage& segment_index_image,
+    const CameraIntrinsics& intrinsics, const Labels& segment_labels,
+    const BlockIndex& block_idx, const size_t worker_idx) {
+  BlockCache label_block_cache;
+  Block<TsdfVoxel>::Ptr tsdf_block;
+  const LabelTsdfMap::CombinedBlock* combined_block =
+      map_->usesCombinedBlocks() ? map_->getCombinedBlockPtrByIndex(block_idx)
+                                 : nullptr;
+  if (combined_block != nullptr) {
+    tsdf_block = combined_block->tsdf_block;
+    label_block_cache.label_block = combined_block->label_block;
+    label_block_cache.label_block_idx = block_idx;
+  } else {
+    tsdf_block = layer_->getBlockPtrByIndex(block_idx);
+  }
+  CHECK(tsdf_block) << "Tsdf block " << block_idx.transpose()
+                    << " has not been allocated.";
+
+  // The images carry no color.
+  const Color kVoxelColor = Color::Gray();
+  const Transformation T_C_G = T_G_C.inverse();
   const Point& origin = T_G_C.getPosition();
-  Color merged_color;
+  const FloatingPoint truncation_distance = config_.default_truncation_distance;
+
+  bool block_updated = false;
+  for (size_t linear_idx = 0u; linear_idx < tsdf_block->num_voxels();
+       ++linear_idx) {
+    const Point voxel_center_G =
+        tsdf_block->computeCoordinatesFromLinearIndex(linear_idx);
+    int u, v;
+    if (!intrinsics.projectToPixel(T_C_G * voxel_center_G, &u, &v)) {
+      continue;
+    }
+    const FloatingPoint depth = depth_image(v, u);
+    if (!isValidDepth(depth) || depth < config_.min_ray_length_m ||
+        depth > config_.max_ray_length_m) {
+      continue;
+    }
+
+    const Point point_C = intrinsics.backProjectPixel(u, v, depth);
+    const Point point_G = T_G_C * point_C;
+    const FloatingPoint sdf =
+        computeDistance(origin, point_G, voxel_center_G);
+    // Same extent as the rays cast by the pointcloud integration.
+    if (sdf < -truncation_distance ||
+        (!config_.voxel_carving_enabled && sdf > truncation_distance)) {
+      continue;
+    }
+
+    const GlobalIndex global_voxel_idx =
+        getGlobalVoxelIndexFromBlockAndVoxelIndex(
+            block_idx, tsdf_block->computeVoxelIndexFromLinearIndex(linear_idx),
+            voxels_per_side_);
+    TsdfVoxel& tsdf_voxel = tsdf_block->getVoxelByLinearIndex(linear_idx);
+    updateTsdfVoxelUnlocked(origin, point_G, global_voxel_idx, kVoxelColor,
+                            getVoxelWeight(point_C), &tsdf_voxel);
+    block_updated = true;
+
+    const int32_t segment_idx = segment_index_image(v, u);
+    if (segment_idx == kNoSegmentIndex) {
+      continue;
+    }
+    LabelVoxel* label_voxel = getLabelVoxelPtrInBand(
+        global_voxel_idx, sdf, worker_idx, &label_block_cache);
+    if (label_voxel == nullptr) {
+      continue;
+    }
+    CHECK_LT(static_cast<size_t>(segment_idx), segment_labels.size());
+    LabelConfidence confidence = 1u;
+    if (label_tsdf_config_.enable_confidence_weight_dropoff) {
+      confidence = computeConfidenceWeight(point_C.norm());
+    }
+    updateLabelVoxelUnlocked(segment_labels[segment_idx], confidence,
+                             worker_idx, label_voxel);
+    recordLabelVote(segment_labels[segment_idx], worker_idx,
+                    &label_block_cache);
+  }
+
+  if (block_updated) {
+    tsdf_block->updated() = true;
+  }
+  if (label_block_cache.label_block != nullptr) {
+    label_block_cache.label_block->updated() = true;
+  }
+}
+
+Label LabelTsdfIntegrator::getMergedLabel(
+    const Labels& labels, const AlignedVector<size_t>& point_indices,
+    const bool clearing_ray) const {
+  CHECK(!point_indices.empty());
+  const Label first_label = labels[point_indices.front()];
+  // Clearing rays only use the first point.
+  if (clearing_ray) {
+    return first_label;
+  }
+
+  bool is_single_label = true;
+  for (const size_t pt_idx : point_indices) {
+    if (labels[pt_idx] != first_label) {
+      is_single_label = false;
+      break;
+    }
+  }
+  if (is_single_label) {
+    return first_label;
+  }
+
+  // Points of different segments ended in the same voxel, the merged ray
+  // takes the label observed by most of them.
+  std::vector<std::pair<Label, size_t>> label_point_counts;
+  for (const size_t pt_idx : point_indices) {
+    const Label label = labels[pt_idx];
+    auto label_it = std::find_if(
+        label_point_counts.begin(), label_point_counts.end(),
+        [label](const std::pair<Label, size_t>& label_point_count) {
+          return label_point_count.first == label;
+        });
+    if (label_it != label_point_counts.end()) {
+      ++label_it->second;
+    } else {
+      label_point_counts.emplace_back(label, 1u);
+    }
+  }
+
+  Label merged_label = first_label;
+  size_t max_point_count = 0u;
+  for (const std::pair<Label, size_t>& label_point_count : label_point_counts) {
+    if (label_point_count.second > max_point_count) {
+      max_point_count = label_point_count.second;
+      merged_label = label_point_count.first;
+    }
+  }
+  return merged_label;
+}
+
+LabelTsdfIntegrator::MergedRay LabelTsdfIntegrator::mergeRay(
+    const Transformation& T_G_C, const Pointcloud& points_C,
+    const Colors& colors, const Labels& labels, const bool clearing_ray,
+    const VoxelMapElement& global_voxel_idx_to_point_indices) {
   Point merged_point_C = Point::Zero();
-  FloatingPoint merged_weight = 0.0f;
-  Label merged_label = label;
-  LabelConfidence merged_label_confidence;
+  MergedRay merged_ray;
+  merged_ray.weight = 0.0f;
+  merged_ray.label = getMergedLabel(
+      labels, global_voxel_idx_to_point_indices.second, clearing_ray);
 
   for (const size_t pt_idx : global_voxel_idx_to_point_indices.second) {
     const Point& point_C = points_C[pt_idx];
     const Color& color = colors[pt_idx];
 
     const float point_weight = getVoxelWeight(point_C);
-    merged_point_C = (merged_point_C * merged_weight + point_C * point_weight) /
-                     (merged_weight + point_weight);
-    merged_color =
-        Color::blendTwoColors(merged_color, merged_weight, color, point_weight);
-    merged_weight += point_weight;
-    // Assuming all the points of a segment pointcloud
-    // are assigned the same label.
+    merged_point_C =
+        (merged_point_C * merged_ray.weight + point_C * point_weight) /
+        (merged_ray.weight + point_weight);
+    merged_ray.color = Color::blendTwoColors(
+        merged_ray.color, merged_ray.weight, color, point_weight);
+    merged_ray.weight += point_weight;
     if (label_tsdf_config_.enable_confidence_weight_dropoff) {
       const FloatingPoint ray_distance = point_C.norm();
-      merged_label_confidence = computeConfidenceWeight(ray_distance);
+      merged_ray.confidence = computeConfidenceWeight(ray_distance);
     } else {
-      merged_label_confidence = 1u;
+      merged_ray.confidence = 1u;
     }
 
     // only take first point when clearing
@@ -576,52 +1914,145 @@ void LabelTsdfIntegrator::integrateVoxel(
     }
   }
 
-  const Point merged_point_G = T_G_C * merged_point_C;
+  merged_ray.point_G = T_G_C * merged_point_C;
+  return merged_ray;
+}
 
-  RayCaster ray_caster(origin, merged_point_G, clearing_ray,
-                       config_.voxel_carving_enabled, config_.max_ray_length_m,
-                       voxel_size_inv_, config_.default_truncation_distance);
+void LabelTsdfIntegrator::updateRayVoxel(
+    const Point& origin, const MergedRay& merged_ray,
+    const GlobalIndex& global_voxel_idx, const bool lock_voxel,
+    const size_t worker_idx, BlockCache* block_cache) {
+  CHECK_NOTNULL(block_cache);
+  getActiveBlocks(global_voxel_idx, block_cache);
+  getCombinedBlocks(global_voxel_idx, block_cache);
+  TsdfVoxel* tsdf_voxel = allocateStorageAndGetVoxelPtr(
+      global_voxel_idx, &block_cache->tsdf_block,
+      &block_cache->tsdf_block_idx);
+
+  if (lock_voxel) {
+    updateTsdfVoxel(origin, merged_ray.point_G, global_voxel_idx,
+                    merged_ray.color, merged_ray.weight, tsdf_voxel);
+  } else {
+    updateTsdfVoxelUnlocked(origin, merged_ray.point_G, global_voxel_idx,
+                            merged_ray.color, merged_ray.weight, tsdf_voxel);
+  }
 
-  GlobalIndex global_voxel_idx;
-  while (ray_caster.nextRayIndex(&global_voxel_idx)) {
-    if (enable_anti_grazing) {
-      // Check if this one is already the block hash map for this
-      // insertion. Skip this to avoid grazing.
-      if ((clearing_ray ||
-           global_voxel_idx != global_voxel_idx_to_point_indices.first) &&
-          voxel_map.find(global_voxel_idx) != voxel_map.end()) {
-        continue;
-      }
+  // The distance along the ray is only needed to check the label band.
+  FloatingPoint sdf = 0.0f;
+  if (hasLabelBand()) {
+    sdf = computeDistance(
+        origin, merged_ray.point_G,
+        getCenterPointFromGridIndex(global_voxel_idx, voxel_size_));
+  }
+  LabelVoxel* label_voxel =
+      getLabelVoxelPtrInBand(global_voxel_idx, sdf, worker_idx, block_cache);
+  if (label_voxel != nullptr) {
+    if (lock_voxel) {
+      updateLabelVoxel(merged_ray.point_G, merged_ray.label,
+                       merged_ray.confidence, worker_idx, label_voxel);
+    } else {
+      updateLabelVoxelUnlocked(merged_ray.label, merged_ray.confidence,
+                               worker_idx, label_voxel);
     }
-    BlockIndex block_idx;
+    recordLabelVote(merged_ray.label, worker_idx, block_cache);
+  }
+}
+
+void LabelTsdfIntegrator::updateTsdfVoxelUnlocked(
+    const Point& origin, const Point& point_G,
+    const GlobalIndex& global_voxel_idx, const Color& color,
+    const float weight, TsdfVoxel* tsdf_voxel) const {
+  CHECK_NOTNULL(tsdf_voxel);
+  const Point voxel_center =
+      getCenterPointFromGridIndex(global_voxel_idx, voxel_size_);
+  const float sdf = computeDistance(origin, point_G, voxel_center);
+
+  float updated_weight = weight;
+  const FloatingPoint dropoff_epsilon = voxel_size_;
+  if (config_.use_weight_dropoff && sdf < -dropoff_epsilon) {
+    updated_weight = weight * (config_.default_truncation_distance + sdf) /
+                     (config_.default_truncation_distance - dropoff_epsilon);
+    updated_weight = std::max(updated_weight, 0.0f);
+  }
+  if (config_.use_sparsity_compensation_factor &&
+      std::abs(sdf) < config_.default_truncation_distance) {
+    updated_weight *= config_.sparsity_compensation_factor;
+  }
+
+  const float new_weight = tsdf_voxel->weight + updated_weight;
+  // Weights close to zero would turn the distance into nan.
+  if (new_weight < kFloatEpsilon) {
+    return;
+  }
+  const float new_sdf =
+      (sdf * updated_weight + tsdf_voxel->distance * tsdf_voxel->weight) /
+      new_weight;
+
+  // Color blending is expensive, only do it close to the surface.
+  if (std::abs(sdf) < config_.default_truncation_distance) {
+    tsdf_voxel->color = Color::blendTwoColors(
+        tsdf_voxel->color, tsdf_voxel->weight, color, updated_weight);
+  }
+  tsdf_voxel->distance =
+      (new_sdf > 0.0f)
+          ? std::min(config_.default_truncation_distance, new_sdf)
+          : std::max(-config_.default_truncation_distance, new_sdf);
+  tsdf_voxel->weight = std::min(config_.max_weight, new_weight);
+}
+
+bool LabelTsdfIntegrator::isGrazingVoxel(const GlobalIndex& global_voxel_idx,
+                                         const GlobalIndex& end_voxel_idx,
+                                         const bool clearing_ray,
+                                         const VoxelMap& voxel_map) const {
+  // Check if this one is already the block hash map for this
+  // insertion. Skip this to avoid grazing.
+  return (clearing_ray || global_voxel_idx != end_voxel_idx) &&
+         voxel_map.find(global_voxel_idx) != voxel_map.end();
+}
+
+void LabelTsdfIntegrator::integrateVoxel(
+    const Transformation& T_G_C, const Pointcloud& points_C,
+    const Colors& colors, const Labels& labels,
+    const bool enable_anti_grazing, const bool clearing_ray,
+    const VoxelMapElement& global_voxel_idx_to_point_indices,
+    const VoxelMap& voxel_map, const size_t worker_idx) {
+  if (global_voxel_idx_to_point_indices.second.empty()) {
+    return;
+  }
+
+  const Point& origin = T_G_C.getPosition();
+  const MergedRay merged_ray =
+      mergeRay(T_G_C, points_C, colors, labels, clearing_ray,
+               global_voxel_idx_to_point_indices);
 
-    Block<TsdfVoxel>::Ptr tsdf_block = nullptr;
-    TsdfVoxel* tsdf_voxel = allocateStorageAndGetVoxelPtr(
-        global_voxel_idx, &tsdf_block, &block_idx);
+  RayCaster ray_caster(origin, merged_ray.point_G, clearing_ray,
+                       config_.voxel_carving_enabled, config_.max_ray_length_m,
+                       voxel_size_inv_, config_.default_truncation_distance);
 
-    updateTsdfVoxel(origin, merged_point_G, global_voxel_idx, merged_color,
-                    merged_weight, tsdf_voxel);
+  // Consecutive voxels of the ray mostly lie in the same block, keep the
+  // blocks of the last step to skip their lookups.
+  BlockCache block_cache;
+  constexpr bool kLockVoxel = true;
 
-    // TODO(margaritaG): parametrize.
-    // If voxel carving is enabled, then only allocate the label voxels
-    // within three times the truncation distance from the surface.
-    if (!config_.voxel_carving_enabled ||
-        std::abs(tsdf_voxel->distance) <
-            3 * config_.default_truncation_distance) {
-      Block<LabelVoxel>::Ptr label_block = nullptr;
-      LabelVoxel* label_voxel = allocateStorageAndGetLabelVoxelPtr(
-          global_voxel_idx, &label_block, &block_idx);
-      updateLabelVoxel(merged_point_G, merged_label, label_voxel,
-                       merged_label_confidence);
+  GlobalIndex global_voxel_idx;
+  while (ray_caster.nextRayIndex(&global_voxel_idx)) {
+    if (enable_anti_grazing &&
+        isGrazingVoxel(global_voxel_idx,
+                       global_voxel_idx_to_point_indices.first, clearing_ray,
+                       voxel_map)) {
+      continue;
     }
+    updateRayVoxel(origin, merged_ray, global_voxel_idx, kLockVoxel,
+                   worker_idx, &block_cache);
   }
 }
 
 void LabelTsdfIntegrator::integrateVoxels(
     const Transformation& T_G_C, const Pointcloud& points_C,
-    const Colors& colors, const Label& label, const bool enable_anti_grazing,
-    const bool clearing_ray, const VoxelMap& voxel_map,
-    const VoxelMap& clear_map, const size_t thread_idx) {
+    const Colors& colors, const Labels& labels,
+    const bool enable_anti_grazing, const bool clearing_ray,
+    const VoxelMap& voxel_map, const VoxelMap& clear_map,
+    const size_t thread_idx, const size_t worker_idx) {
   VoxelMap::const_iterator it;
   size_t map_size;
   if (clearing_ray) {
@@ -631,43 +2062,290 @@ void LabelTsdfIntegrator::integrateVoxels(
     it = voxel_map.begin();
     map_size = voxel_map.size();
   }
-  for (size_t i = 0u; i < map_size; ++i) {
-    if (((i + thread_idx + 1) % config_.integrator_threads) == 0u) {
-      integrateVoxel(T_G_C, points_C, colors, label, enable_anti_grazing,
-                     clearing_ray, *it, voxel_map);
+  if (!label_tsdf_config_.enable_batch_ray_casting) {
+    for (size_t i = 0u; i < map_size; ++i) {
+      if (((i + thread_idx + 1) % config_.integrator_threads) == 0u) {
+        integrateVoxel(T_G_C, points_C, colors, labels, enable_anti_grazing,
+                       clearing_ray, *it, voxel_map, worker_idx);
+      }
+      ++it;
+    }
+    return;
+  }
+
+  // Merge the rays of the stripe and cast them batch by batch.
+  RayBatch ray_batch;
+  for (size_t i = 0u; i < map_size; ++i, ++it) {
+    if (((i + thread_idx + 1) % config_.integrator_threads) != 0u ||
+        it->second.empty()) {
+      continue;
+    }
+    ray_batch.merged_rays.push_back(
+        mergeRay(T_G_C, points_C, colors, labels, clearing_ray, *it));
+    ray_batch.points_G.push_back(ray_batch.merged_rays.back().point_G);
+    ray_batch.end_voxel_indices.push_back(it->first);
+    if (ray_batch.merged_rays.size() == kNumRaysPerBatch) {
+      integrateRayBatch(T_G_C.getPosition(), enable_anti_grazing,
+                        clearing_ray, voxel_map, worker_idx, &ray_batch);
+    }
+  }
+  if (!ray_batch.merged_rays.empty()) {
+    integrateRayBatch(T_G_C.getPosition(), enable_anti_grazing, clearing_ray,
+                      voxel_map, worker_idx, &ray_batch);
+  }
+}
+
+void LabelTsdfIntegrator::integrateRayBatch(const Point& origin,
+                                            const bool enable_anti_grazing,
+                                            const bool clearing_ray,
+                                            const VoxelMap& voxel_map,
+                                            const size_t worker_idx,
+                                            RayBatch* ray_batch) {
+  CHECK_NOTNULL(ray_batch);
+  batch_ray_caster_.castRays(origin, ray_batch->points_G, clearing_ray,
+                             &ray_batch->voxel_indices);
+
+  constexpr bool kLockVoxel = true;
+  for (size_t ray_idx = 0u; ray_idx < ray_batch->merged_rays.size();
+       ++ray_idx) {
+    BlockCache block_cache;
+    for (const GlobalIndex& global_voxel_idx :
+         ray_batch->voxel_indices[ray_idx]) {
+      if (enable_anti_grazing &&
+          isGrazingVoxel(global_voxel_idx,
+                         ray_batch->end_voxel_indices[ray_idx], clearing_ray,
+                         voxel_map)) {
+        continue;
+      }
+      updateRayVoxel(origin, ray_batch->merged_rays[ray_idx],
+                     global_voxel_idx, kLockVoxel, worker_idx,
+                     &block_cache);
     }
-    ++it;
   }
+
+  ray_batch->merged_rays.clear();
+  ray_batch->points_G.clear();
+  ray_batch->end_voxel_indices.clear();
 }
 
-void LabelTsdfIntegrator::integrateRays(
+void LabelTsdfIntegrator::queueRayVoxels(
     const Transformation& T_G_C, const Pointcloud& points_C,
-    const Colors& colors, const Label& label, const bool enable_anti_grazing,
-    const bool clearing_ray, const VoxelMap& voxel_map,
-    const VoxelMap& clear_map) {
+    const Colors& colors, const Labels& labels,
+    const bool enable_anti_grazing, const bool clearing_ray,
+    const VoxelMap& voxel_map, const VoxelMap& ray_map,
+    const size_t thread_idx, RayPartition* ray_partition) {
+  CHECK_NOTNULL(ray_partition);
   const Point& origin = T_G_C.getPosition();
+  const size_t num_region_owners =
+      ray_partition->surface_voxel_updates.size();
+  const FloatingPoint region_size_inv =
+      voxels_per_side_inv_ / label_tsdf_config_.partition_region_size_blocks;
+  const AnyIndexHash region_hash;
+  std::vector<AlignedVector<VoxelUpdate>>& voxel_updates =
+      clearing_ray ? ray_partition->clearing_voxel_updates
+                   : ray_partition->surface_voxel_updates;
+
+  // Queues a voxel of the ray ray_idx for the owner of its region.
+  auto queue_voxel = [&](const GlobalIndex& global_voxel_idx,
+                         const GlobalIndex& end_voxel_idx,
+                         const size_t ray_idx) {
+    if (enable_anti_grazing &&
+        isGrazingVoxel(global_voxel_idx, end_voxel_idx, clearing_ray,
+                       voxel_map)) {
+      return;
+    }
+    const BlockIndex region_idx =
+        getBlockIndexFromGlobalVoxelIndex(global_voxel_idx, region_size_inv);
+    const size_t owner_idx = region_hash(region_idx) % num_region_owners;
+    voxel_updates[owner_idx].push_back(
+        VoxelUpdate{global_voxel_idx, ray_idx});
+  };
+
+  // With batch ray casting the merged rays are collected in ray_batch, only
+  // their end points are needed to cast them.
+  RayBatch ray_batch;
+  size_t batch_begin_ray_idx = ray_partition->rays.size();
+  auto queue_ray_batch = [&]() {
+    batch_ray_caster_.castRays(origin, ray_batch.points_G, clearing_ray,
+                               &ray_batch.voxel_indices);
+    for (size_t ray_idx = 0u; ray_idx < ray_batch.points_G.size();
+         ++ray_idx) {
+      for (const GlobalIndex& global_voxel_idx :
+           ray_batch.voxel_indices[ray_idx]) {
+        queue_voxel(global_voxel_idx, ray_batch.end_voxel_indices[ray_idx],
+                    batch_begin_ray_idx + ray_idx);
+      }
+    }
+    ray_batch.points_G.clear();
+    ray_batch.end_voxel_indices.clear();
+    batch_begin_ray_idx = ray_partition->rays.size();
+  };
+
+  VoxelMap::const_iterator it = ray_map.begin();
+  for (size_t i = 0u; i < ray_map.size(); ++i, ++it) {
+    if (((i + thread_idx + 1) % config_.integrator_threads) != 0u ||
+        it->second.empty()) {
+      continue;
+    }
+    const size_t ray_idx = ray_partition->rays.size();
+    ray_partition->rays.push_back(
+        mergeRay(T_G_C, points_C, colors, labels, clearing_ray, *it));
+
+    if (label_tsdf_config_.enable_batch_ray_casting) {
+      ray_batch.points_G.push_back(ray_partition->rays.back().point_G);
+      ray_batch.end_voxel_indices.push_back(it->first);
+      if (ray_batch.points_G.size() == kNumRaysPerBatch) {
+        queue_ray_batch();
+      }
+      continue;
+    }
 
-  // if only 1 thread just do function call, otherwise spawn threads
-  if (config_.integrator_threads == 1u) {
-    constexpr size_t thread_idx = 0u;
-    integrateVoxels(T_G_C, points_C, colors, label, enable_anti_grazing,
-                    clearing_ray, voxel_map, clear_map, thread_idx);
-  } else {
-    std::list<std::thread> integration_threads;
-    for (size_t i = 0u; i < config_.integrator_threads; ++i) {
-      integration_threads.emplace_back(
-          &LabelTsdfIntegrator::integrateVoxels, this, T_G_C, points_C, colors,
-          label, enable_anti_grazing, clearing_ray, voxel_map, clear_map, i);
+    RayCaster ray_caster(origin, ray_partition->rays.back().point_G,
+                         clearing_ray, config_.voxel_carving_enabled,
+                         config_.max_ray_length_m, voxel_size_inv_,
+                         config_.default_truncation_distance);
+
+    GlobalIndex global_voxel_idx;
+    while (ray_caster.nextRayIndex(&global_voxel_idx)) {
+      queue_voxel(global_voxel_idx, it->first, ray_idx);
     }
+  }
+  if (!ray_batch.points_G.empty()) {
+    queue_ray_batch();
+  }
+}
+
+void LabelTsdfIntegrator::integrateRaysPartitioned(
+    const Transformation& T_G_C, const Pointcloud& points_C,
+    const Colors& colors, const Labels& labels,
+    const bool enable_anti_grazing, const VoxelMap& voxel_map,
+    const VoxelMap& clear_map) {
+  // More region owners than threads, so that work stealing can balance
+  // regions that are hit by many rays.
+  const size_t num_region_owners =
+      config_.integrator_threads * kNumRegionOwnersPerThread;
+  ray_partitions_.resize(config_.integrator_threads);
+
+  // First every task merges a stripe of the rays and sorts their voxels by
+  // the worker owning the block region they fall into.
+  timing::Timer queue_timer("integrate_rays/partitioned/queue_voxels");
+  thread_pool_.parallelFor(
+      config_.integrator_threads,
+      [&](const size_t thread_idx, const size_t /*worker_idx*/) {
+        RayPartition& ray_partition = ray_partitions_[thread_idx];
+        ray_partition.rays.clear();
+        for (std::vector<AlignedVector<VoxelUpdate>>* voxel_updates :
+             {&ray_partition.surface_voxel_updates,
+              &ray_partition.clearing_voxel_updates}) {
+          voxel_updates->resize(num_region_owners);
+          for (AlignedVector<VoxelUpdate>& owner_voxel_updates :
+               *voxel_updates) {
+            owner_voxel_updates.clear();
+          }
+        }
+
+        constexpr bool kIsClearingRay = true;
+        queueRayVoxels(T_G_C, points_C, colors, labels, enable_anti_grazing,
+                       !kIsClearingRay, voxel_map, voxel_map, thread_idx,
+                       &ray_partition);
+        queueRayVoxels(T_G_C, points_C, colors, labels, enable_anti_grazing,
+                       kIsClearingRay, voxel_map, clear_map, thread_idx,
+                       &ray_partition);
+      });
+  queue_timer.Stop();
+
+  // Then every region owner applies all updates of its voxels. No other
+  // worker touches these voxels, so the tsdf and label voxels are updated
+  // without locking. As in voxblox's merged integration every voxel first
+  // gets all surface updates and then all clearing updates, each in stripe
+  // and ray order, which keeps the update order independent of the
+  // scheduling.
+  timing::Timer update_timer("integrate_rays/partitioned/update_voxels");
+  const Point& origin = T_G_C.getPosition();
+  thread_pool_.parallelFor(
+      num_region_owners,
+      [&](const size_t owner_idx, const size_t worker_idx) {
+        // The voxels of a region are queued ray by ray, so consecutive
+        // updates mostly lie in the same block.
+        BlockCache block_cache;
+        constexpr bool kLockVoxel = false;
+        auto apply_voxel_updates = [&](const bool clearing_ray) {
+          for (const RayPartition& ray_partition : ray_partitions_) {
+            const AlignedVector<VoxelUpdate>& voxel_updates =
+                clearing_ray ? ray_partition.clearing_voxel_updates[owner_idx]
+                             : ray_partition.surface_voxel_updates[owner_idx];
+            for (const VoxelUpdate& voxel_update : voxel_updates) {
+              updateRayVoxel(origin,
+                             ray_partition.rays[voxel_update.ray_idx],
+                             voxel_update.global_voxel_idx, kLockVoxel,
+                             worker_idx, &block_cache);
+            }
+          }
+        };
+        constexpr bool kIsClearingRay = true;
+        apply_voxel_updates(!kIsClearingRay);
+        apply_voxel_updates(kIsClearingRay);
+      });
+  update_timer.Stop();
+}
 
-    for (std::thread& thread : integration_threads) {
-      thread.join();
+void LabelTsdfIntegrator::integrateRays(
+    const Transformation& T_G_C, const Pointcloud& points_C,
+    const Colors& colors, const Labels& labels,
+    const bool enable_anti_grazing, const bool fuse_ray_passes,
+    const VoxelMap& voxel_map, const VoxelMap& clear_map) {
+  // The inputs are captured by reference, with a single thread the stripes
+  // are integrated in place.
+  constexpr bool kIsClearingRay = true;
+  if (label_tsdf_config_.enable_spatially_partitioned_integration &&
+      config_.integrator_threads > 1u) {
+    timing::Timer integrate_timer("integrate_rays/partitioned");
+    integrateRaysPartitioned(T_G_C, points_C, colors, labels,
+                             enable_anti_grazing, voxel_map, clear_map);
+    integrate_timer.Stop();
+  } else if (fuse_ray_passes) {
+    timing::Timer integrate_timer("integrate_rays/striped");
+    // Every task integrates one stripe of the surface rays followed by the
+    // same stripe of the clearing rays, so both kinds of rays share a single
+    // pass and a single merge of the newly allocated blocks. Clearing rays
+    // of one stripe can update a voxel before the surface rays of another.
+    thread_pool_.parallelFor(
+        config_.integrator_threads,
+        [&](const size_t thread_idx, const size_t worker_idx) {
+          integrateVoxels(T_G_C, points_C, colors, labels,
+                          enable_anti_grazing, !kIsClearingRay, voxel_map,
+                          clear_map, thread_idx, worker_idx);
+          integrateVoxels(T_G_C, points_C, colors, labels,
+                          enable_anti_grazing, kIsClearingRay, voxel_map,
+                          clear_map, thread_idx, worker_idx);
+        });
+    integrate_timer.Stop();
+  } else {
+    // As in voxblox's merged integration, all surface rays are integrated
+    // and their new blocks merged before the clearing rays.
+    for (const bool clearing_ray : {!kIsClearingRay, kIsClearingRay}) {
+      timing::Timer integrate_timer("integrate_rays/striped");
+      thread_pool_.parallelFor(
+          config_.integrator_threads,
+          [&](const size_t thread_idx, const size_t worker_idx) {
+            integrateVoxels(T_G_C, points_C, colors, labels,
+                            enable_anti_grazing, clearing_ray, voxel_map,
+                            clear_map, thread_idx, worker_idx);
+          });
+      integrate_timer.Stop();
+
+      if (!clearing_ray) {
+        timing::Timer insertion_timer("inserting_missed_blocks");
+        updateLayersWithStoredBlocks();
+        insertion_timer.Stop();
+      }
     }
   }
 
   timing::Timer insertion_timer("inserting_missed_blocks");
-  updateLayerWithStoredBlocks();
-  updateLabelLayerWithStoredBlocks();
+  updateLayersWithStoredBlocks();
+  reduceLabelCountDeltas();
+  reduceLabelBlockVotes();
 
   insertion_timer.Stop();
 }
@@ -703,13 +2381,24 @@ FloatingPoint LabelTsdfIntegrator::computeConfidenceWeight(
 // Not thread safe.
 void LabelTsdfIntegrator::swapLabels(const Label& old_label,
                                      const Label& new_label) {
+  rendered_labels_.is_reusable = false;
+  // The new label takes over the votes of the old one.
+  auto old_label_blocks_it = label_block_index_.find(old_label);
+  if (old_label_blocks_it != label_block_index_.end()) {
+    label_block_index_[new_label].insert(old_label_blocks_it->second.begin(),
+                                         old_label_blocks_it->second.end());
+    label_block_index_.erase(old_label);
+  }
   BlockIndexList all_label_blocks;
-  label_layer_->getAllAllocatedBlocks(&all_label_blocks);
+  map_->getAllLabelBlockIndices(&all_label_blocks);
 
   for (const BlockIndex& block_index : all_label_blocks) {
     Block<TsdfVoxel>::Ptr tsdf_block = layer_->getBlockPtrByIndex(block_index);
-    Block<LabelVoxel>::Ptr label_block =
-        label_layer_->getBlockPtrByIndex(block_index);
+    // Packed blocks are unpacked one at a time and packed again unless their
+    // labels changed.
+    const bool was_packed = map_->isLabelBlockPacked(block_index);
+    Block<LabelVoxel>::Ptr label_block = map_->unpackLabelBlock(block_index);
+    bool has_label_changed = false;
     size_t vps = label_block->voxels_per_side();
     for (size_t i = 0u; i < vps * vps * vps; i++) {
       LabelVoxel& voxel = label_block->getVoxelByLinearIndex(i);
@@ -735,6 +2424,7 @@ void LabelTsdfIntegrator::swapLabels(const Label& old_label,
       Label updated_label = voxel.label;
 
       if (updated_label != previous_label) {
+        has_label_changed = true;
         // The new updated_label gains a voxel.
         updated_labels_.insert(updated_label);
         changeLabelCount(updated_label, 1);
@@ -745,6 +2435,9 @@ void LabelTsdfIntegrator::swapLabels(const Label& old_label,
         }
       }
     }
+    if (was_packed && !has_label_changed) {
+      map_->packLabelBlock(block_index);
+    }
   }
 }
 
@@ -764,6 +2457,7 @@ void LabelTsdfIntegrator::getLabelsToPublish(
   resetCurrentFrameUpdatedLabelsAge();
   clearCurrentFrameInstanceLabels();
 
+  std::set<Label> published_labels;
   for (LMapIt label_age_pair_it = labels_to_publish_.begin();
        label_age_pair_it != labels_to_publish_.end();
        /* no increment */) {
@@ -771,11 +2465,191 @@ void LabelTsdfIntegrator::getLabelsToPublish(
     ++(label_age_pair_it)->second;
     if (label_age_pair_it->second > label_tsdf_config_.max_segment_age) {
       segment_labels_to_publish->push_back(label_age_pair_it->first);
+      published_labels.insert(label_age_pair_it->first);
       labels_to_publish_.erase(label_age_pair_it++);
     } else {
       ++label_age_pair_it;
     }
   }
+
+  if (label_tsdf_config_.enable_label_recycling) {
+    recycleDeadLabels(published_labels);
+  }
+}
+
+Label LabelTsdfIntegrator::getFreshLabel() {
+  Label fresh_label = 0u;
+  while (fresh_label == 0u && !recycled_labels_.empty()) {
+    const Label label = *recycled_labels_.begin();
+    recycled_labels_.erase(recycled_labels_.begin());
+    // Recycled labels that won voxels back are skipped, they are recycled
+    // again once they die.
+    if (label_count_map_ptr_->find(label) == label_count_map_ptr_->end()) {
+      fresh_label = label;
+    }
+  }
+  if (fresh_label == 0u) {
+    CHECK_LT(*highest_label_ptr_, std::numeric_limits<Label>::max())
+        << "All labels have been issued, consider enabling label recycling.";
+    fresh_label = ++(*highest_label_ptr_);
+  }
+  // A label whose segment never wins a voxel gets no voxel count that could
+  // drop to zero, so it is checked like a dead label.
+  if (label_tsdf_config_.enable_label_recycling) {
+    dead_labels_.emplace_back(fresh_label, num_frames_);
+  }
+  return fresh_label;
+}
+
+InstanceLabel LabelTsdfIntegrator::getFreshInstance() {
+  if (*highest_instance_ptr_ < std::numeric_limits<InstanceLabel>::max() ||
+      !label_tsdf_config_.enable_label_recycling) {
+    CHECK_LT(*highest_instance_ptr_,
+             std::numeric_limits<InstanceLabel>::max())
+        << "All instances have been issued, consider enabling label "
+           "recycling.";
+    return ++(*highest_instance_ptr_);
+  }
+
+  // Once all instances were issued, reuse the lowest one that no label votes
+  // for anymore, since the instances of the recycled labels were dropped.
+  std::set<InstanceLabel> used_instances;
+  semantic_instance_label_fusion_ptr_->getUsedInstanceLabels(&used_instances);
+  for (const auto& instance_pair : current_to_global_instance_map_) {
+    used_instances.insert(instance_pair.second);
+  }
+  InstanceLabel instance_label = 1u;
+  for (const InstanceLabel used_instance : used_instances) {
+    if (used_instance > instance_label) {
+      break;
+    }
+    if (used_instance == instance_label) {
+      ++instance_label;
+    }
+  }
+  CHECK_NE(instance_label, 0u) << "All instances are in use.";
+  return instance_label;
+}
+
+void LabelTsdfIntegrator::recycleDeadLabels(
+    const std::set<Label>& published_labels) {
+  timing::Timer recycle_timer("recycle_labels");
+  ++num_frames_;
+  const size_t min_frames =
+      static_cast<size_t>(label_tsdf_config_.label_recycling_min_frames);
+  std::set<Label> labels_to_recycle;
+  // Labels that are checked again are queued behind the ones that were
+  // queued before this frame.
+  for (size_t num_dead_labels = dead_labels_.size();
+       num_dead_labels > 0u &&
+       dead_labels_.front().second + min_frames <= num_frames_;
+       --num_dead_labels) {
+    const Label label = dead_labels_.front().first;
+    dead_labels_.pop_front();
+    // Labels that came back to life are queued again once they die.
+    if (label_count_map_ptr_->find(label) != label_count_map_ptr_->end()) {
+      continue;
+    }
+    // Labels that are still to be published are checked again later.
+    if (labels_to_publish_.find(label) != labels_to_publish_.end() ||
+        updated_labels_.find(label) != updated_labels_.end() ||
+        published_labels.find(label) != published_labels.end()) {
+      dead_labels_.emplace_back(label, num_frames_);
+      continue;
+    }
+    labels_to_recycle.insert(label);
+  }
+  if (!labels_to_recycle.empty()) {
+    removeLabelVotes(labels_to_recycle);
+    // The rendered labels may hold the recycled ones.
+    rendered_labels_.is_reusable = false;
+    // Later entries of the recycled labels would recycle them again after
+    // they are issued.
+    dead_labels_.erase(
+        std::remove_if(dead_labels_.begin(), dead_labels_.end(),
+                       [&labels_to_recycle](
+                           const std::pair<Label, size_t>& dead_label) {
+                         return labels_to_recycle.find(dead_label.first) !=
+                                labels_to_recycle.end();
+                       }),
+        dead_labels_.end());
+  }
+  for (const Label label : labels_to_recycle) {
+    removePairwiseConfidence(label);
+    semantic_instance_label_fusion_ptr_->removeLabel(label);
+    recycled_labels_.insert(label);
+  }
+  recycle_timer.Stop();
+}
+
+void LabelTsdfIntegrator::removeLabelVotes(const std::set<Label>& labels) {
+  IndexSet label_blocks;
+  for (const Label label : labels) {
+    auto label_blocks_it = label_block_index_.find(label);
+    if (label_blocks_it != label_block_index_.end()) {
+      label_blocks.insert(label_blocks_it->second.begin(),
+                          label_blocks_it->second.end());
+      label_block_index_.erase(label_blocks_it);
+    }
+  }
+
+  for (const BlockIndex& block_idx : label_blocks) {
+    const bool was_packed = map_->isLabelBlockPacked(block_idx);
+    Block<LabelVoxel>::Ptr label_block = map_->unpackLabelBlock(block_idx);
+    if (label_block == nullptr) {
+      continue;
+    }
+    bool has_label_changed = false;
+    for (size_t linear_idx = 0u; linear_idx < label_block->num_voxels();
+         ++linear_idx) {
+      LabelVoxel& voxel = label_block->getVoxelByLinearIndex(linear_idx);
+      bool has_removed_votes = false;
+      for (LabelCount& label_count : voxel.label_count) {
+        if (label_count.label != 0u &&
+            labels.find(label_count.label) != labels.end()) {
+          label_count.label = 0u;
+          label_count.label_confidence = 0u;
+          has_removed_votes = true;
+        }
+      }
+      if (!has_removed_votes) {
+        continue;
+      }
+
+      const Label previous_label = voxel.label;
+      updateVoxelLabelAndConfidence(&voxel);
+      if (voxel.label != previous_label) {
+        has_label_changed = true;
+        if (voxel.label != 0u) {
+          updated_labels_.insert(voxel.label);
+          changeLabelCount(voxel.label, 1);
+        }
+        // The recycled labels have no voxel count left.
+        if (labels.find(previous_label) == labels.end()) {
+          changeLabelCount(previous_label, -1);
+        }
+      }
+    }
+    if (has_label_changed) {
+      label_block->updated() = true;
+    } else if (was_packed) {
+      map_->packLabelBlock(block_idx);
+    }
+  }
+}
+
+void LabelTsdfIntegrator::removePairwiseConfidence(const Label& label) {
+  pairwise_confidence_.erase(label);
+  for (LLMapIt confidence_map_it = pairwise_confidence_.begin();
+       confidence_map_it != pairwise_confidence_.end();
+       /* no increment */) {
+    confidence_map_it->second.erase(label);
+    if (confidence_map_it->second.empty()) {
+      confidence_map_it = pairwise_confidence_.erase(confidence_map_it);
+    } else {
+      ++confidence_map_it;
+    }
+  }
 }
 
 void LabelTsdfIntegrator::addPairwiseConfidenceCount(
@@ -917,9 +2791,9 @@ void LabelTsdfIntegrator::mergeLabels(LLSet* merges_to_publish) {
 
 Transformation LabelTsdfIntegrator::getIcpRefined_T_G_C(
     const Transformation& T_G_C_init, const Pointcloud& point_cloud) {
-  // TODO(ff): We should actually check here how many blocks are in the
-  // camera frustum.
-  if (layer_->getNumberOfAllocatedBlocks() <= 0u) {
+  // Without any block in the camera frustum there is nothing to align to.
+  if (layer_->getNumberOfAllocatedBlocks() <= 0u ||
+      (active_blocks_.isValid() && active_blocks_.size() == 0u)) {
     return T_G_C_init;
   }
   Transformation T_Gicp_C;
@@ -928,8 +2802,22 @@ Transformation LabelTsdfIntegrator::getIcpRefined_T_G_C(
     T_Gicp_G_.setIdentity();
   }
 
-  const size_t num_icp_updates =
-      icp_->runICP(*layer_, point_cloud, T_Gicp_G_ * T_G_C_init, &T_Gicp_C);
+  // With active blocks ICP aligns to these only, in a layer sharing their
+  // blocks with the map.
+  Layer<TsdfVoxel>* icp_layer = layer_;
+  std::unique_ptr<Layer<TsdfVoxel>> active_tsdf_layer;
+  if (active_blocks_.isValid()) {
+    active_tsdf_layer.reset(
+        new Layer<TsdfVoxel>(voxel_size_, voxels_per_side_));
+    for (const ActiveBlockSet::ActiveBlock& active_block :
+         active_blocks_.getBlocks()) {
+      active_tsdf_layer->insertBlock(
+          std::make_pair(active_block.block_idx, active_block.tsdf_block));
+    }
+    icp_layer = active_tsdf_layer.get();
+  }
+  const size_t num_icp_updates = icp_->runICP(
+      *icp_layer, point_cloud, T_Gicp_G_ * T_G_C_init, &T_Gicp_C);
   if (num_icp_updates == 0u ||
       num_icp_updates > label_tsdf_config_.max_num_icp_updates) {
     LOG(INFO) << "num_icp_updates is too high or 0: " << num_icp_updates
@@ -1,7 +1,123 @@
 #include "global_segment_map/label_tsdf_map.h"
 
+#include <algorithm>
+
+#include <voxblox/io/layer_io.h>
+
+#include "global_segment_map/label_block_serialization.h"
+
 namespace voxblox {
 
+const LabelTsdfMap::CombinedBlock& LabelTsdfMap::allocateCombinedBlockByIndex(
+    const BlockIndex& block_idx) {
+  CHECK(config_.use_combined_blocks);
+  CombinedBlock& combined_block = combined_blocks_[block_idx];
+  combined_block.tsdf_block = tsdf_layer_->allocateBlockPtrByIndex(block_idx);
+  combined_block.label_block =
+      label_layer_->allocateBlockPtrByIndex(block_idx);
+  return combined_block;
+}
+
+void LabelTsdfMap::packLabelBlock(const BlockIndex& block_idx) {
+  if (config_.inactive_label_block_encoding == kDense) {
+    return;
+  }
+  Block<LabelVoxel>::Ptr label_block =
+      label_layer_->getBlockPtrByIndex(block_idx);
+  if (label_block == nullptr) {
+    return;
+  }
+
+  if (config_.inactive_label_block_encoding == kSparse) {
+    sparse_label_blocks_[block_idx] =
+        std::make_shared<SparseLabelBlock>(*label_block);
+  } else {
+    Block<CompactLabelVoxel>::Ptr compact_block =
+        std::make_shared<Block<CompactLabelVoxel>>(
+            label_block->voxels_per_side(), label_block->voxel_size(),
+            label_block->origin());
+    compressLabelBlock(*label_block, compact_block.get());
+    compact_label_blocks_[block_idx] = compact_block;
+  }
+  label_layer_->removeBlock(block_idx);
+}
+
+Block<LabelVoxel>::Ptr LabelTsdfMap::unpackLabelBlock(
+    const BlockIndex& block_idx) {
+  Block<LabelVoxel>::Ptr label_block = decodePackedLabelBlock(block_idx);
+  if (label_block == nullptr) {
+    return label_layer_->getBlockPtrByIndex(block_idx);
+  }
+  insertLabelBlock(block_idx, label_block);
+  return label_block;
+}
+
+void LabelTsdfMap::insertLabelBlock(const BlockIndex& block_idx,
+                                    const Block<LabelVoxel>::Ptr& label_block) {
+  CHECK(label_block);
+  compact_label_blocks_.erase(block_idx);
+  sparse_label_blocks_.erase(block_idx);
+  label_layer_->removeBlock(block_idx);
+  label_layer_->insertBlock(std::make_pair(block_idx, label_block));
+}
+
+Block<LabelVoxel>::Ptr LabelTsdfMap::decodePackedLabelBlock(
+    const BlockIndex& block_idx) const {
+  auto sparse_block_it = sparse_label_blocks_.find(block_idx);
+  if (sparse_block_it != sparse_label_blocks_.end()) {
+    Block<LabelVoxel>::Ptr label_block = std::make_shared<Block<LabelVoxel>>(
+        label_layer_->voxels_per_side(), label_layer_->voxel_size(),
+        getOriginPointFromGridIndex(block_idx, label_layer_->block_size()));
+    sparse_block_it->second->getDenseBlock(label_block.get());
+    label_block->set_has_data(true);
+    return label_block;
+  }
+
+  auto compact_block_it = compact_label_blocks_.find(block_idx);
+  if (compact_block_it == compact_label_blocks_.end()) {
+    return nullptr;
+  }
+  const Block<CompactLabelVoxel>& compact_block = *compact_block_it->second;
+  Block<LabelVoxel>::Ptr label_block = std::make_shared<Block<LabelVoxel>>(
+      compact_block.voxels_per_side(), compact_block.voxel_size(),
+      compact_block.origin());
+  decompressLabelBlock(compact_block, label_block.get());
+  return label_block;
+}
+
+Block<LabelVoxel>::ConstPtr LabelTsdfMap::getLabelBlockPtrByIndex(
+    const BlockIndex& block_idx) const {
+  Block<LabelVoxel>::ConstPtr label_block =
+      label_layer_->getBlockPtrByIndex(block_idx);
+  if (label_block == nullptr && hasPackedLabelBlocks()) {
+    label_block = decodePackedLabelBlock(block_idx);
+  }
+  return label_block;
+}
+
+size_t LabelTsdfMap::getPackedLabelBlocksMemorySize() const {
+  size_t memory_size = 0u;
+  for (const auto& compact_block_pair : compact_label_blocks_) {
+    memory_size += compact_block_pair.second->getMemorySize();
+  }
+  for (const auto& sparse_block_pair : sparse_label_blocks_) {
+    memory_size += sparse_block_pair.second->getMemorySize();
+  }
+  return memory_size;
+}
+
+void LabelTsdfMap::getAllLabelBlockIndices(
+    BlockIndexList* block_indices) const {
+  CHECK_NOTNULL(block_indices);
+  label_layer_->getAllAllocatedBlocks(block_indices);
+  for (const auto& compact_block_pair : compact_label_blocks_) {
+    block_indices->push_back(compact_block_pair.first);
+  }
+  for (const auto& sparse_block_pair : sparse_label_blocks_) {
+    block_indices->push_back(sparse_block_pair.first);
+  }
+}
+
 Labels LabelTsdfMap::getLabelList() {
   Labels labels;
   int count_unused_labels = 0;
@@ -88,8 +204,11 @@ void LabelTsdfMap::extractSegmentLayers(
   for (const BlockIndex& block_index : all_label_blocks) {
     Block<TsdfVoxel>::Ptr global_tsdf_block =
         tsdf_layer_->getBlockPtrByIndex(block_index);
-    Block<LabelVoxel>::Ptr global_label_block =
-        label_layer_->getBlockPtrByIndex(block_index);
+    Block<LabelVoxel>::ConstPtr global_label_block =
+        getLabelBlockPtrByIndex(block_index);
+    if (global_label_block == nullptr) {
+      continue;
+    }
 
     const size_t vps = global_label_block->voxels_per_side();
     for (size_t i = 0u; i < vps * vps * vps; ++i) {
@@ -155,8 +274,11 @@ void LabelTsdfMap::extractInstanceLayers(
   for (const BlockIndex& block_index : all_label_blocks) {
     Block<TsdfVoxel>::Ptr global_tsdf_block =
         tsdf_layer_->getBlockPtrByIndex(block_index);
-    Block<LabelVoxel>::Ptr global_label_block =
-        label_layer_->getBlockPtrByIndex(block_index);
+    Block<LabelVoxel>::ConstPtr global_label_block =
+        getLabelBlockPtrByIndex(block_index);
+    if (global_label_block == nullptr) {
+      continue;
+    }
 
     const size_t vps = global_label_block->voxels_per_side();
     for (size_t i = 0u; i < vps * vps * vps; ++i) {
@@ -202,4 +324,102 @@ void LabelTsdfMap::extractInstanceLayers(
   }
 }
 
+bool LabelTsdfMap::saveToFile(const std::string& file_path) const {
+  constexpr bool kClearFile = true;
+  if (!io::SaveLayer(*tsdf_layer_, file_path, kClearFile)) {
+    return false;
+  }
+  if (!config_.compact_label_layer_on_save) {
+    if (!hasPackedLabelBlocks()) {
+      return io::SaveLayer(*label_layer_, file_path, !kClearFile);
+    }
+    // The blocks of the label layer are shared, only the packed ones are
+    // decoded.
+    Layer<LabelVoxel> label_layer(config_.voxel_size,
+                                  config_.voxels_per_side);
+    BlockIndexList block_indices;
+    getAllLabelBlockIndices(&block_indices);
+    for (const BlockIndex& block_index : block_indices) {
+      Block<LabelVoxel>::Ptr label_block =
+          label_layer_->getBlockPtrByIndex(block_index);
+      if (label_block == nullptr) {
+        label_block = decodePackedLabelBlock(block_index);
+      }
+      label_layer.insertBlock(std::make_pair(block_index, label_block));
+    }
+    return io::SaveLayer(label_layer, file_path, !kClearFile);
+  }
+  Layer<CompactLabelVoxel> compact_label_layer(config_.voxel_size,
+                                               config_.voxels_per_side);
+  compressLabelLayer(*label_layer_, &compact_label_layer);
+  for (const auto& compact_block_pair : compact_label_blocks_) {
+    compact_label_layer.insertBlock(compact_block_pair);
+  }
+  for (const auto& sparse_block_pair : sparse_label_blocks_) {
+    const BlockIndex& block_index = sparse_block_pair.first;
+    Block<CompactLabelVoxel>::Ptr compact_block =
+        compact_label_layer.allocateBlockPtrByIndex(block_index);
+    compressLabelBlock(*decodePackedLabelBlock(block_index),
+                       compact_block.get());
+  }
+  return io::SaveLayer(compact_label_layer, file_path, !kClearFile);
+}
+
+bool LabelTsdfMap::loadFromFile(const std::string& file_path) {
+  constexpr bool kMultipleLayerSupport = true;
+  if (!io::LoadBlocksFromFile(
+          file_path, Layer<TsdfVoxel>::BlockMergingStrategy::kReplace,
+          kMultipleLayerSupport, tsdf_layer_.get())) {
+    return false;
+  }
+  if (!io::LoadBlocksFromFile(
+          file_path, Layer<LabelVoxel>::BlockMergingStrategy::kReplace,
+          kMultipleLayerSupport, label_layer_.get())) {
+    Layer<CompactLabelVoxel> compact_label_layer(config_.voxel_size,
+                                                 config_.voxels_per_side);
+    if (!io::LoadBlocksFromFile(
+            file_path,
+            Layer<CompactLabelVoxel>::BlockMergingStrategy::kReplace,
+            kMultipleLayerSupport, &compact_label_layer)) {
+      return false;
+    }
+    decompressLabelLayer(compact_label_layer, label_layer_.get());
+  }
+
+  // The loaded blocks replace the packed ones.
+  BlockIndexList block_indices;
+  label_layer_->getAllAllocatedBlocks(&block_indices);
+  for (const BlockIndex& block_index : block_indices) {
+    compact_label_blocks_.erase(block_index);
+    sparse_label_blocks_.erase(block_index);
+  }
+
+  // And the combined blocks.
+  if (config_.use_combined_blocks) {
+    BlockIndexList tsdf_block_indices;
+    tsdf_layer_->getAllAllocatedBlocks(&tsdf_block_indices);
+    block_indices.insert(block_indices.end(), tsdf_block_indices.begin(),
+                         tsdf_block_indices.end());
+    for (const BlockIndex& block_index : block_indices) {
+      allocateCombinedBlockByIndex(block_index);
+    }
+  }
+
+  label_count_map_.clear();
+  getAllLabelBlockIndices(&block_indices);
+  for (const BlockIndex& block_index : block_indices) {
+    const Block<LabelVoxel>::ConstPtr block =
+        getLabelBlockPtrByIndex(block_index);
+    for (size_t linear_idx = 0u; linear_idx < block->num_voxels();
+         ++linear_idx) {
+      const Label label = block->getVoxelByLinearIndex(linear_idx).label;
+      if (label != 0u) {
+        ++label_count_map_[label];
+        highest_label_ = std::max(highest_label_, label);
+      }
+    }
+  }
+  return true;
+}
+
 }  // namespace voxblox
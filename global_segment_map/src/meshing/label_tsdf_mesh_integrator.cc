@@ -11,6 +11,7 @@ MeshLabelIntegrator::MeshLabelIntegrator(
       label_tsdf_config_(label_tsdf_config),
       label_layer_mutable_ptr_(CHECK_NOTNULL(map->getLabelLayerPtr())),
       label_layer_const_ptr_(CHECK_NOTNULL(map->getLabelLayerPtr())),
+      map_ptr_(map),
       semantic_instance_label_fusion_ptr_(
           map->getSemanticInstanceLabelFusionPtr()),
       label_color_map_(),
@@ -31,6 +32,7 @@ MeshLabelIntegrator::MeshLabelIntegrator(
       label_tsdf_config_(label_tsdf_config),
       label_layer_mutable_ptr_(nullptr),
       label_layer_const_ptr_(CHECK_NOTNULL(&map.getLabelLayer())),
+      map_ptr_(&map),
       semantic_instance_label_fusion_ptr_(
           &map.getSemanticInstanceLabelFusion()),
       label_color_map_(),
@@ -52,6 +54,7 @@ MeshLabelIntegrator::MeshLabelIntegrator(
       label_tsdf_config_(label_tsdf_config),
       label_layer_mutable_ptr_(nullptr),
       label_layer_const_ptr_(&label_layer),
+      map_ptr_(nullptr),
       semantic_instance_label_fusion_ptr_(nullptr),
       label_color_map_(),
       instance_color_map_(),
@@ -125,7 +128,10 @@ void MeshLabelIntegrator::generateMeshBlocksFunction(
           label_layer_mutable_ptr_->getBlockPtrByIndex(block_idx);
 
       tsdf_block->updated() = false;
-      label_block->updated() = false;
+      // Label blocks can be missing, e.g. while they are packed.
+      if (label_block != nullptr) {
+        label_block->updated() = false;
+      }
     }
   }
 }
@@ -163,7 +169,7 @@ void MeshLabelIntegrator::updateMeshForBlock(const BlockIndex& block_index) {
   Block<TsdfVoxel>::ConstPtr tsdf_block =
       sdf_layer_const_->getBlockPtrByIndex(block_index);
   Block<LabelVoxel>::ConstPtr label_block =
-      label_layer_const_ptr_->getBlockPtrByIndex(block_index);
+      getLabelBlockPtrByIndex(block_index);
 
   if (!tsdf_block && !label_block) {
     LOG(ERROR) << "Trying to mesh a non-existent block at index: "
@@ -211,6 +217,11 @@ void MeshLabelIntegrator::updateMeshColor(const Block<LabelVoxel>& label_block,
   mesh->colors.clear();
   mesh->colors.resize(mesh->indices.size());
 
+  // Vertices on the faces of the block are looked up in the neighbor block,
+  // which is kept for the next vertex, as packed blocks are decoded.
+  BlockIndex neighbor_block_index;
+  Block<LabelVoxel>::ConstPtr neighbor_block;
+
   // Use nearest-neighbor search.
   for (size_t i = 0u; i < mesh->vertices.size(); ++i) {
     const Point& vertex = mesh->vertices[i];
@@ -254,8 +265,12 @@ void MeshLabelIntegrator::updateMeshColor(const Block<LabelVoxel>& label_block,
         }
       }
     } else {
-      const typename Block<LabelVoxel>::ConstPtr neighbor_block =
-          label_layer_const_ptr_->getBlockPtrByCoordinates(vertex);
+      const BlockIndex block_index = getGridIndexFromPoint<BlockIndex>(
+          vertex, label_layer_const_ptr_->block_size_inv());
+      if (neighbor_block == nullptr || block_index != neighbor_block_index) {
+        neighbor_block = getLabelBlockPtrByIndex(block_index);
+        neighbor_block_index = block_index;
+      }
       const LabelVoxel& voxel = neighbor_block->getVoxelByCoordinates(vertex);
       switch (label_tsdf_config_.color_scheme) {
         case kLabel: {
@@ -296,6 +311,14 @@ void MeshLabelIntegrator::updateMeshColor(const Block<LabelVoxel>& label_block,
   }
 }
 
+Block<LabelVoxel>::ConstPtr MeshLabelIntegrator::getLabelBlockPtrByIndex(
+    const BlockIndex& block_index) const {
+  if (map_ptr_ != nullptr) {
+    return map_ptr_->getLabelBlockPtrByIndex(block_index);
+  }
+  return label_layer_const_ptr_->getBlockPtrByIndex(block_index);
+}
+
 void MeshLabelIntegrator::updateMeshColor(const Block<TsdfVoxel>& tsdf_block,
                                           Mesh* mesh) {
   CHECK_NOTNULL(mesh);
@@ -1,6 +1,9 @@
 #include "global_segment_map/segment.h"
 namespace voxblox {
 
+Segment::Segment(const Transformation& T_G_C)
+    : T_G_C_(T_G_C), label_(0u), semantic_label_(0u), instance_label_(0u) {}
+
 Segment::Segment(const pcl::PointCloud<voxblox::PointType>& point_cloud,
                  const Transformation& T_G_C)
     : T_G_C_(T_G_C), semantic_label_(0u), instance_label_(0u) {
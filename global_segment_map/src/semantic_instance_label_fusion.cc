@@ -127,4 +127,22 @@ SemanticLabel SemanticInstanceLabelFusion::getSemanticLabel(
   return semantic_label;
 }
 
+void SemanticInstanceLabelFusion::removeLabel(const Label& label) {
+  label_instance_count_.erase(label);
+  label_frames_count_.erase(label);
+  label_class_count_.erase(label);
+}
+
+void SemanticInstanceLabelFusion::getUsedInstanceLabels(
+    std::set<InstanceLabel>* instance_labels) const {
+  CHECK_NOTNULL(instance_labels);
+  instance_labels->clear();
+  for (const auto& label_instance_count : label_instance_count_) {
+    for (const std::pair<const InstanceLabel, int>& instance_count :
+         label_instance_count.second) {
+      instance_labels->insert(instance_count.first);
+    }
+  }
+}
+
 }  // namespace voxblox
@@ -0,0 +1,143 @@
+#include "global_segment_map/utils/active_block_set.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+void ActiveBlockSet::update(const Transformation& T_G_C,
+                            const CameraIntrinsics& intrinsics,
+                            const FloatingPoint max_depth,
+                            Layer<TsdfVoxel>* tsdf_layer,
+                            Layer<LabelVoxel>* label_layer) {
+  CHECK_NOTNULL(tsdf_layer);
+  CHECK_NOTNULL(label_layer);
+  clear();
+
+  // The frustum is bounded by the camera center and the corners of the
+  // image at max_depth.
+  Point min_G = T_G_C.getPosition();
+  Point max_G = min_G;
+  for (const int u : {0, intrinsics.width}) {
+    for (const int v : {0, intrinsics.height}) {
+      const Point corner_G =
+          T_G_C * intrinsics.backProjectPixel(u, v, max_depth);
+      min_G = min_G.cwiseMin(corner_G);
+      max_G = max_G.cwiseMax(corner_G);
+    }
+  }
+
+  const FloatingPoint block_size = tsdf_layer->block_size();
+  const FloatingPoint block_radius = 0.5f * std::sqrt(3.0f) * block_size;
+  const Transformation T_C_G = T_G_C.inverse();
+  collectBlocks(
+      min_G, max_G,
+      [&](const BlockIndex& block_idx) {
+        const Point block_center_G =
+            getCenterPointFromGridIndex(block_idx, block_size);
+        return intrinsics.isSphereInFrustum(T_C_G * block_center_G,
+                                            block_radius, max_depth);
+      },
+      tsdf_layer, label_layer);
+}
+
+void ActiveBlockSet::update(const Point& min_G, const Point& max_G,
+                            Layer<TsdfVoxel>* tsdf_layer,
+                            Layer<LabelVoxel>* label_layer) {
+  CHECK_NOTNULL(tsdf_layer);
+  CHECK_NOTNULL(label_layer);
+  clear();
+  collectBlocks(
+      min_G, max_G, [](const BlockIndex& /*block_idx*/) { return true; },
+      tsdf_layer, label_layer);
+}
+
+template <typename IsActiveFunction>
+void ActiveBlockSet::collectBlocks(const Point& min_G, const Point& max_G,
+                                   const IsActiveFunction& is_active,
+                                   Layer<TsdfVoxel>* tsdf_layer,
+                                   Layer<LabelVoxel>* label_layer) {
+  const FloatingPoint block_size_inv = tsdf_layer->block_size_inv();
+  const BlockIndex min_block_idx =
+      getGridIndexFromPoint<BlockIndex>(min_G, block_size_inv);
+  const BlockIndex max_block_idx =
+      getGridIndexFromPoint<BlockIndex>(max_G, block_size_inv);
+  const BlockIndex box_size =
+      max_block_idx - min_block_idx + BlockIndex::Ones();
+  const size_t num_box_blocks = static_cast<size_t>(box_size.x()) *
+                                box_size.y() * box_size.z();
+
+  auto add_block = [&](const BlockIndex& block_idx,
+                       const Block<TsdfVoxel>::Ptr& tsdf_block) {
+    if (is_active(block_idx)) {
+      blocks_.push_back(ActiveBlock{
+          block_idx, tsdf_block, label_layer->getBlockPtrByIndex(block_idx)});
+    }
+  };
+
+  // The box is looked up block by block, unless the map holds fewer blocks
+  // than the box, as early on in a mapping session.
+  if (num_box_blocks <= tsdf_layer->getNumberOfAllocatedBlocks()) {
+    BlockIndex block_idx;
+    for (block_idx.z() = min_block_idx.z(); block_idx.z() <= max_block_idx.z();
+         ++block_idx.z()) {
+      for (block_idx.y() = min_block_idx.y();
+           block_idx.y() <= max_block_idx.y(); ++block_idx.y()) {
+        for (block_idx.x() = min_block_idx.x();
+             block_idx.x() <= max_block_idx.x(); ++block_idx.x()) {
+          const Block<TsdfVoxel>::Ptr tsdf_block =
+              tsdf_layer->getBlockPtrByIndex(block_idx);
+          if (tsdf_block != nullptr) {
+            add_block(block_idx, tsdf_block);
+          }
+        }
+      }
+    }
+  } else {
+    BlockIndexList allocated_blocks;
+    tsdf_layer->getAllAllocatedBlocks(&allocated_blocks);
+    for (const BlockIndex& block_idx : allocated_blocks) {
+      if ((block_idx.array() >= min_block_idx.array()).all() &&
+          (block_idx.array() <= max_block_idx.array()).all()) {
+        add_block(block_idx, tsdf_layer->getBlockPtrByIndex(block_idx));
+      }
+    }
+  }
+  buildDenseIndex();
+}
+
+void ActiveBlockSet::buildDenseIndex() {
+  is_valid_ = true;
+  if (blocks_.empty()) {
+    return;
+  }
+
+  BlockIndex max_block_idx = blocks_.front().block_idx;
+  min_block_idx_ = max_block_idx;
+  for (const ActiveBlock& block : blocks_) {
+    min_block_idx_ = min_block_idx_.cwiseMin(block.block_idx);
+    max_block_idx = max_block_idx.cwiseMax(block.block_idx);
+  }
+  // The culling volume is bounded, so is the bounding box.
+  grid_size_ = max_block_idx - min_block_idx_ + BlockIndex::Ones();
+  dense_index_.assign(static_cast<size_t>(grid_size_.x()) * grid_size_.y() *
+                          grid_size_.z(),
+                      -1);
+  for (size_t block_pos = 0u; block_pos < blocks_.size(); ++block_pos) {
+    dense_index_[getDenseIndex(blocks_[block_pos].block_idx -
+                               min_block_idx_)] =
+        static_cast<int32_t>(block_pos);
+  }
+}
+
+void ActiveBlockSet::clear() {
+  is_valid_ = false;
+  blocks_.clear();
+  dense_index_.clear();
+  min_block_idx_.setZero();
+  grid_size_.setZero();
+}
+
+}  // namespace voxblox
@@ -0,0 +1,248 @@
+#include "global_segment_map/utils/batch_ray_caster.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+namespace {
+
+inline int32_t getStepSign(const FloatingPoint x) {
+  return (x == 0.0f) ? 0 : (x < 0.0f) ? -1 : 1;
+}
+
+}  // namespace
+
+BatchRayCaster::BatchRayCaster(const bool voxel_carving_enabled,
+                               const FloatingPoint max_ray_length_m,
+                               const FloatingPoint voxel_size_inv,
+                               const FloatingPoint truncation_distance)
+    : voxel_carving_enabled_(voxel_carving_enabled),
+      max_ray_length_m_(max_ray_length_m),
+      voxel_size_inv_(voxel_size_inv),
+      truncation_distance_(truncation_distance) {}
+
+void BatchRayCaster::castRays(
+    const Point& origin, const AlignedVector<Point>& points_G,
+    const bool clearing_ray,
+    std::vector<GlobalIndexVector>* ray_voxel_indices) const {
+  CHECK_NOTNULL(ray_voxel_indices);
+  const size_t num_rays = points_G.size();
+  ray_voxel_indices->resize(num_rays);
+
+  LaneState lane_state;
+  std::vector<int32_t> voxel_index_history;
+  for (size_t batch_start = 0u; batch_start < num_rays;
+       batch_start += kNumLanes) {
+    const size_t num_batch_rays = std::min(kNumLanes, num_rays - batch_start);
+
+    // Unused lanes are stepped along with the others, but never output.
+    int32_t max_ray_length_in_steps = -1;
+    for (size_t lane_idx = 0u; lane_idx < kNumLanes; ++lane_idx) {
+      if (lane_idx < num_batch_rays) {
+        setupRay(origin, points_G[batch_start + lane_idx], clearing_ray,
+                 lane_idx, &lane_state);
+      } else {
+        setupRay(origin, origin, clearing_ray, lane_idx, &lane_state);
+        lane_state.ray_length_in_steps[lane_idx] = -1;
+      }
+      max_ray_length_in_steps = std::max(
+          max_ray_length_in_steps, lane_state.ray_length_in_steps[lane_idx]);
+    }
+
+    // Record the voxel indices of all lanes step by step, then copy them to
+    // the rays, so that stepping only needs full-width stores.
+    const size_t num_steps = static_cast<size_t>(max_ray_length_in_steps + 1);
+    voxel_index_history.resize(num_steps * 3u * kNumLanes);
+    for (size_t step = 0u; step < num_steps; ++step) {
+      std::copy(&lane_state.voxel_index[0][0],
+                &lane_state.voxel_index[0][0] + 3u * kNumLanes,
+                voxel_index_history.begin() + step * 3u * kNumLanes);
+      stepLanes(&lane_state);
+    }
+
+    for (size_t lane_idx = 0u; lane_idx < num_batch_rays; ++lane_idx) {
+      GlobalIndexVector& voxel_indices =
+          (*ray_voxel_indices)[batch_start + lane_idx];
+      voxel_indices.resize(lane_state.ray_length_in_steps[lane_idx] + 1);
+      const int32_t* step_voxel_index = voxel_index_history.data() + lane_idx;
+      for (GlobalIndex& voxel_index : voxel_indices) {
+        voxel_index = GlobalIndex(step_voxel_index[0],
+                                  step_voxel_index[kNumLanes],
+                                  step_voxel_index[2u * kNumLanes]);
+        step_voxel_index += 3u * kNumLanes;
+      }
+    }
+  }
+}
+
+void BatchRayCaster::setupRay(const Point& origin, const Point& point_G,
+                              const bool clearing_ray, const size_t lane_idx,
+                              LaneState* lane_state) const {
+  CHECK_NOTNULL(lane_state);
+  CHECK_LT(lane_idx, kNumLanes);
+  for (size_t axis = 0u; axis < 3u; ++axis) {
+    lane_state->t_to_next_boundary[axis][lane_idx] = 0.0f;
+    lane_state->t_step_size[axis][lane_idx] = 0.0f;
+    lane_state->voxel_index[axis][lane_idx] = 0;
+    lane_state->step_sign[axis][lane_idx] = 0;
+  }
+  lane_state->ray_length_in_steps[lane_idx] = -1;
+
+  // Same start and end points as voxblox::RayCaster casting from the origin.
+  const Ray unit_ray = (point_G - origin).normalized();
+  Point ray_start, ray_end;
+  if (clearing_ray) {
+    FloatingPoint ray_length = (point_G - origin).norm();
+    ray_length = std::min(std::max(ray_length - truncation_distance_,
+                                   static_cast<FloatingPoint>(0.0)),
+                          max_ray_length_m_);
+    ray_end = origin + unit_ray * ray_length;
+    ray_start = voxel_carving_enabled_ ? origin : ray_end;
+  } else {
+    ray_end = point_G + unit_ray * truncation_distance_;
+    ray_start = voxel_carving_enabled_
+                    ? origin
+                    : (point_G - unit_ray * truncation_distance_);
+  }
+
+  const Point start_scaled = ray_start * voxel_size_inv_;
+  const Point end_scaled = ray_end * voxel_size_inv_;
+  if (start_scaled.hasNaN() || end_scaled.hasNaN()) {
+    return;
+  }
+
+  const GlobalIndex start_index =
+      getGridIndexFromPoint<GlobalIndex>(start_scaled);
+  const GlobalIndex end_index = getGridIndexFromPoint<GlobalIndex>(end_scaled);
+  const GlobalIndex diff_index = end_index - start_index;
+  lane_state->ray_length_in_steps[lane_idx] = static_cast<int32_t>(
+      std::abs(diff_index.x()) + std::abs(diff_index.y()) +
+      std::abs(diff_index.z()));
+
+  const Ray ray_scaled = end_scaled - start_scaled;
+  for (size_t axis = 0u; axis < 3u; ++axis) {
+    const int32_t step_sign = getStepSign(ray_scaled[axis]);
+    const FloatingPoint corrected_step =
+        static_cast<FloatingPoint>(std::max(0, step_sign));
+    const FloatingPoint start_scaled_shifted =
+        start_scaled[axis] - static_cast<FloatingPoint>(start_index[axis]);
+    const FloatingPoint distance_to_boundary =
+        corrected_step - start_scaled_shifted;
+
+    lane_state->t_to_next_boundary[axis][lane_idx] =
+        distance_to_boundary / ray_scaled[axis];
+    // Distance to cross one grid cell along the ray in t.
+    lane_state->t_step_size[axis][lane_idx] = step_sign / ray_scaled[axis];
+    lane_state->voxel_index[axis][lane_idx] =
+        static_cast<int32_t>(start_index[axis]);
+    lane_state->step_sign[axis][lane_idx] = step_sign;
+  }
+}
+
+// Every lane steps along the axis with the closest boundary. Ties and NaNs
+// are resolved like Eigen's minCoeff does, so that the voxels are the same as
+// the ones of voxblox::RayCaster.
+#if defined(__AVX2__)
+void BatchRayCaster::stepLanes(LaneState* lane_state) {
+  static_assert(kNumLanes == 8u, "The AVX2 kernel steps 8 lanes.");
+  const __m256 t_x = _mm256_load_ps(lane_state->t_to_next_boundary[0]);
+  const __m256 t_y = _mm256_load_ps(lane_state->t_to_next_boundary[1]);
+  const __m256 t_z = _mm256_load_ps(lane_state->t_to_next_boundary[2]);
+
+  const __m256 y_is_min = _mm256_cmp_ps(t_y, t_x, _CMP_LT_OQ);
+  const __m256 t_min_xy = _mm256_blendv_ps(t_x, t_y, y_is_min);
+  const __m256 step_z = _mm256_cmp_ps(t_z, t_min_xy, _CMP_LT_OQ);
+  const __m256 step_y = _mm256_andnot_ps(step_z, y_is_min);
+  const __m256 step_x = _mm256_andnot_ps(_mm256_or_ps(step_y, step_z),
+                                         _mm256_castsi256_ps(
+                                             _mm256_set1_epi32(-1)));
+  const __m256 step_masks[3] = {step_x, step_y, step_z};
+
+  for (size_t axis = 0u; axis < 3u; ++axis) {
+    const __m256 t = _mm256_load_ps(lane_state->t_to_next_boundary[axis]);
+    const __m256 t_step =
+        _mm256_and_ps(step_masks[axis],
+                      _mm256_load_ps(lane_state->t_step_size[axis]));
+    _mm256_store_ps(lane_state->t_to_next_boundary[axis],
+                    _mm256_add_ps(t, t_step));
+
+    __m256i* index_ptr =
+        reinterpret_cast<__m256i*>(lane_state->voxel_index[axis]);
+    const __m256i index_step = _mm256_and_si256(
+        _mm256_castps_si256(step_masks[axis]),
+        _mm256_load_si256(
+            reinterpret_cast<const __m256i*>(lane_state->step_sign[axis])));
+    _mm256_store_si256(index_ptr,
+                       _mm256_add_epi32(_mm256_load_si256(index_ptr),
+                                        index_step));
+  }
+}
+#elif defined(__SSE2__)
+void BatchRayCaster::stepLanes(LaneState* lane_state) {
+  static_assert(kNumLanes % 4u == 0u, "The SSE2 kernel steps 4 lanes.");
+  for (size_t lane_idx = 0u; lane_idx < kNumLanes; lane_idx += 4u) {
+    const __m128 t_x =
+        _mm_load_ps(lane_state->t_to_next_boundary[0] + lane_idx);
+    const __m128 t_y =
+        _mm_load_ps(lane_state->t_to_next_boundary[1] + lane_idx);
+    const __m128 t_z =
+        _mm_load_ps(lane_state->t_to_next_boundary[2] + lane_idx);
+
+    const __m128 y_is_min = _mm_cmplt_ps(t_y, t_x);
+    const __m128 t_min_xy = _mm_or_ps(_mm_and_ps(y_is_min, t_y),
+                                      _mm_andnot_ps(y_is_min, t_x));
+    const __m128 step_z = _mm_cmplt_ps(t_z, t_min_xy);
+    const __m128 step_y = _mm_andnot_ps(step_z, y_is_min);
+    const __m128 step_x =
+        _mm_andnot_ps(_mm_or_ps(step_y, step_z),
+                      _mm_castsi128_ps(_mm_set1_epi32(-1)));
+    const __m128 step_masks[3] = {step_x, step_y, step_z};
+
+    for (size_t axis = 0u; axis < 3u; ++axis) {
+      float* t_ptr = lane_state->t_to_next_boundary[axis] + lane_idx;
+      const __m128 t_step = _mm_and_ps(
+          step_masks[axis],
+          _mm_load_ps(lane_state->t_step_size[axis] + lane_idx));
+      _mm_store_ps(t_ptr, _mm_add_ps(_mm_load_ps(t_ptr), t_step));
+
+      __m128i* index_ptr = reinterpret_cast<__m128i*>(
+          lane_state->voxel_index[axis] + lane_idx);
+      const __m128i index_step = _mm_and_si128(
+          _mm_castps_si128(step_masks[axis]),
+          _mm_load_si128(reinterpret_cast<const __m128i*>(
+              lane_state->step_sign[axis] + lane_idx)));
+      _mm_store_si128(index_ptr,
+                      _mm_add_epi32(_mm_load_si128(index_ptr), index_step));
+    }
+  }
+}
+#else
+void BatchRayCaster::stepLanes(LaneState* lane_state) {
+  for (size_t lane_idx = 0u; lane_idx < kNumLanes; ++lane_idx) {
+    size_t step_axis = 0u;
+    float t_min = lane_state->t_to_next_boundary[0][lane_idx];
+    if (lane_state->t_to_next_boundary[1][lane_idx] < t_min) {
+      step_axis = 1u;
+      t_min = lane_state->t_to_next_boundary[1][lane_idx];
+    }
+    if (lane_state->t_to_next_boundary[2][lane_idx] < t_min) {
+      step_axis = 2u;
+    }
+    lane_state->voxel_index[step_axis][lane_idx] +=
+        lane_state->step_sign[step_axis][lane_idx];
+    lane_state->t_to_next_boundary[step_axis][lane_idx] +=
+        lane_state->t_step_size[step_axis][lane_idx];
+  }
+}
+#endif
+
+}  // namespace voxblox
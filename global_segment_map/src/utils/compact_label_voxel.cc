@@ -0,0 +1,189 @@
+#include "global_segment_map/utils/compact_label_voxel.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+namespace {
+
+constexpr uint32_t kMaxCompactLabelConfidence =
+    std::numeric_limits<CompactLabelConfidence>::max();
+
+// Halving rounds up, so that no observed label loses all of its confidence.
+inline uint32_t halveConfidence(const uint32_t confidence) {
+  return (confidence + 1u) / 2u;
+}
+
+}  // namespace
+
+void addCompactVoxelLabelConfidence(const Label label,
+                                    const LabelConfidence confidence,
+                                    CompactLabelVoxel* voxel) {
+  CHECK_NOTNULL(voxel);
+  size_t voted_idx = kNumCompactLabelVoxelSlots;
+  for (size_t slot_idx = 0u; slot_idx < kNumCompactLabelVoxelSlots;
+       ++slot_idx) {
+    if (voxel->labels[slot_idx] == label &&
+        voxel->confidences[slot_idx] > 0u) {
+      voted_idx = slot_idx;
+      break;
+    }
+  }
+  if (voted_idx == kNumCompactLabelVoxelSlots) {
+    for (size_t slot_idx = 0u; slot_idx < kNumCompactLabelVoxelSlots;
+         ++slot_idx) {
+      if (voxel->confidences[slot_idx] == 0u) {
+        voted_idx = slot_idx;
+        voxel->labels[slot_idx] = label;
+        break;
+      }
+    }
+  }
+  if (voted_idx == kNumCompactLabelVoxelSlots) {
+    // All slots are taken, the least confident label is replaced as in the
+    // full layout.
+    voted_idx = std::min_element(std::begin(voxel->confidences),
+                                 std::end(voxel->confidences)) -
+                std::begin(voxel->confidences);
+    voxel->labels[voted_idx] = label;
+  }
+
+  uint32_t voted_confidence =
+      static_cast<uint32_t>(voxel->confidences[voted_idx]) + confidence;
+  while (voted_confidence > kMaxCompactLabelConfidence) {
+    voted_confidence = halveConfidence(voted_confidence);
+    for (CompactLabelConfidence& slot_confidence : voxel->confidences) {
+      slot_confidence = halveConfidence(slot_confidence);
+    }
+  }
+  voxel->confidences[voted_idx] = voted_confidence;
+
+  // The voted label is preferred on ties, move it in front of the slot that
+  // would win otherwise.
+  const size_t winner_idx = getCompactLabelVoxelWinner(*voxel);
+  if (winner_idx < voted_idx &&
+      voxel->confidences[winner_idx] == voxel->confidences[voted_idx]) {
+    std::swap(voxel->labels[winner_idx], voxel->labels[voted_idx]);
+  }
+}
+
+void compressLabelVoxel(const LabelVoxel& voxel,
+                        CompactLabelVoxel* compact_voxel) {
+  CHECK_NOTNULL(compact_voxel);
+  *compact_voxel = CompactLabelVoxel();
+
+  LabelCount label_counts[kNumLabelVoxelSlots];
+  std::copy(std::begin(voxel.label_count), std::end(voxel.label_count),
+            std::begin(label_counts));
+  if (voxel.label != 0u &&
+      std::none_of(std::begin(label_counts), std::end(label_counts),
+                   [](const LabelCount& label_count) {
+                     return label_count.label_confidence > 0u;
+                   })) {
+    // Voxels loaded without their votes only know their label.
+    label_counts[0].label = voxel.label;
+    label_counts[0].label_confidence = voxel.label_confidence;
+  }
+  // Order by confidence, with the label of the voxel first among equals.
+  std::stable_sort(
+      std::begin(label_counts), std::end(label_counts),
+      [&voxel](const LabelCount& lhs, const LabelCount& rhs) {
+        if (lhs.label_confidence != rhs.label_confidence) {
+          return lhs.label_confidence > rhs.label_confidence;
+        }
+        return lhs.label == voxel.label && rhs.label != voxel.label;
+      });
+
+  const uint32_t max_confidence = label_counts[0].label_confidence;
+  for (size_t slot_idx = 0u; slot_idx < kNumCompactLabelVoxelSlots;
+       ++slot_idx) {
+    const LabelCount& label_count = label_counts[slot_idx];
+    if (label_count.label == 0u || label_count.label_confidence == 0u) {
+      continue;
+    }
+    uint32_t confidence = label_count.label_confidence;
+    if (max_confidence > kMaxCompactLabelConfidence) {
+      // Scale with rounding up, the winner maps to the maximum confidence.
+      confidence = (confidence * kMaxCompactLabelConfidence +
+                    max_confidence - 1u) /
+                   max_confidence;
+    }
+    compact_voxel->labels[slot_idx] = label_count.label;
+    compact_voxel->confidences[slot_idx] = confidence;
+  }
+}
+
+void decompressLabelVoxel(const CompactLabelVoxel& compact_voxel,
+                          LabelVoxel* voxel) {
+  CHECK_NOTNULL(voxel);
+  *voxel = LabelVoxel();
+  for (size_t slot_idx = 0u; slot_idx < kNumCompactLabelVoxelSlots;
+       ++slot_idx) {
+    if (compact_voxel.confidences[slot_idx] > 0u) {
+      voxel->label_count[slot_idx].label = compact_voxel.labels[slot_idx];
+      voxel->label_count[slot_idx].label_confidence =
+          compact_voxel.confidences[slot_idx];
+    }
+  }
+  voxel->label = getCompactVoxelLabel(compact_voxel);
+  voxel->label_confidence = getCompactVoxelLabelConfidence(compact_voxel);
+}
+
+void compressLabelBlock(const Block<LabelVoxel>& block,
+                        Block<CompactLabelVoxel>* compact_block) {
+  CHECK_NOTNULL(compact_block);
+  CHECK_EQ(block.num_voxels(), compact_block->num_voxels());
+  for (size_t linear_idx = 0u; linear_idx < block.num_voxels(); ++linear_idx) {
+    compressLabelVoxel(block.getVoxelByLinearIndex(linear_idx),
+                       &compact_block->getVoxelByLinearIndex(linear_idx));
+  }
+  compact_block->set_has_data(block.has_data());
+}
+
+void decompressLabelBlock(const Block<CompactLabelVoxel>& compact_block,
+                          Block<LabelVoxel>* block) {
+  CHECK_NOTNULL(block);
+  CHECK_EQ(compact_block.num_voxels(), block->num_voxels());
+  for (size_t linear_idx = 0u; linear_idx < compact_block.num_voxels();
+       ++linear_idx) {
+    decompressLabelVoxel(compact_block.getVoxelByLinearIndex(linear_idx),
+                         &block->getVoxelByLinearIndex(linear_idx));
+  }
+  block->set_has_data(compact_block.has_data());
+}
+
+void compressLabelLayer(const Layer<LabelVoxel>& layer,
+                        Layer<CompactLabelVoxel>* compact_layer) {
+  CHECK_NOTNULL(compact_layer);
+  CHECK_EQ(layer.voxel_size(), compact_layer->voxel_size());
+  CHECK_EQ(layer.voxels_per_side(), compact_layer->voxels_per_side());
+
+  BlockIndexList block_indices;
+  layer.getAllAllocatedBlocks(&block_indices);
+  for (const BlockIndex& block_index : block_indices) {
+    const Block<LabelVoxel>& block = layer.getBlockByIndex(block_index);
+    compressLabelBlock(
+        block, compact_layer->allocateBlockPtrByIndex(block_index).get());
+  }
+}
+
+void decompressLabelLayer(const Layer<CompactLabelVoxel>& compact_layer,
+                          Layer<LabelVoxel>* layer) {
+  CHECK_NOTNULL(layer);
+  CHECK_EQ(compact_layer.voxel_size(), layer->voxel_size());
+  CHECK_EQ(compact_layer.voxels_per_side(), layer->voxels_per_side());
+
+  BlockIndexList block_indices;
+  compact_layer.getAllAllocatedBlocks(&block_indices);
+  for (const BlockIndex& block_index : block_indices) {
+    const Block<CompactLabelVoxel>& compact_block =
+        compact_layer.getBlockByIndex(block_index);
+    decompressLabelBlock(compact_block,
+                         layer->allocateBlockPtrByIndex(block_index).get());
+  }
+}
+
+}  // namespace voxblox
@@ -0,0 +1,81 @@
+#include "global_segment_map/utils/image_utils.h"
+
+#include <unordered_map>
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+bool CameraIntrinsics::isSphereInFrustum(const Point& center_C,
+                                         const FloatingPoint radius,
+                                         const FloatingPoint max_depth) const {
+  if (center_C.z() < -radius || center_C.z() > max_depth + radius) {
+    return false;
+  }
+  // Inward normals of the side planes of the frustum, which all pass through
+  // the camera center.
+  const FloatingPoint x_min = -cx / fx;
+  const FloatingPoint x_max = (width - cx) / fx;
+  const FloatingPoint y_min = -cy / fy;
+  const FloatingPoint y_max = (height - cy) / fy;
+  const Point plane_normals[4] = {
+      Point(1.0f, 0.0f, -x_min).normalized(),
+      Point(-1.0f, 0.0f, x_max).normalized(),
+      Point(0.0f, 1.0f, -y_min).normalized(),
+      Point(0.0f, -1.0f, y_max).normalized()};
+  for (const Point& plane_normal : plane_normals) {
+    if (plane_normal.dot(center_C) < -radius) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void extractImageSegments(const Transformation& T_G_C,
+                          const DepthImage& depth_image,
+                          const SegmentIdImage& segment_id_image,
+                          const CameraIntrinsics& intrinsics,
+                          SegmentIndexImage* segment_index_image,
+                          std::vector<uint32_t>* segment_ids,
+                          std::vector<Segment*>* segments) {
+  CHECK_NOTNULL(segment_index_image);
+  CHECK_NOTNULL(segment_ids);
+  CHECK_NOTNULL(segments);
+  CHECK_EQ(depth_image.rows(), segment_id_image.rows());
+  CHECK_EQ(depth_image.cols(), segment_id_image.cols());
+  CHECK_EQ(depth_image.rows(), intrinsics.height);
+  CHECK_EQ(depth_image.cols(), intrinsics.width);
+
+  // The images carry no color, the segments are colored uniformly.
+  const Color kSegmentColor = Color::Gray();
+
+  segment_index_image->setConstant(depth_image.rows(), depth_image.cols(),
+                                   kNoSegmentIndex);
+  segment_ids->clear();
+  segments->clear();
+  std::unordered_map<uint32_t, int32_t> segment_id_to_index;
+  for (int v = 0; v < depth_image.rows(); ++v) {
+    for (int u = 0; u < depth_image.cols(); ++u) {
+      const uint32_t segment_id = segment_id_image(v, u);
+      const float depth = depth_image(v, u);
+      if (segment_id == kNoSegmentId || !isValidDepth(depth)) {
+        continue;
+      }
+
+      auto insert_status = segment_id_to_index.emplace(
+          segment_id, static_cast<int32_t>(segments->size()));
+      if (insert_status.second) {
+        segment_ids->push_back(segment_id);
+        segments->push_back(new Segment(T_G_C));
+      }
+      const int32_t segment_idx = insert_status.first->second;
+      (*segment_index_image)(v, u) = segment_idx;
+
+      Segment* segment = (*segments)[segment_idx];
+      segment->points_C_.push_back(intrinsics.backProjectPixel(u, v, depth));
+      segment->colors_.push_back(kSegmentColor);
+    }
+  }
+}
+
+}  // namespace voxblox
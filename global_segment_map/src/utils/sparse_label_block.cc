@@ -0,0 +1,89 @@
+#include "global_segment_map/utils/sparse_label_block.h"
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+const LabelVoxel SparseLabelBlock::kEmptyVoxel = LabelVoxel();
+
+SparseLabelBlock::SparseLabelBlock(const size_t num_voxels)
+    : num_voxels_(num_voxels),
+      occupancy_((num_voxels + kBitsPerWord - 1u) / kBitsPerWord, 0u),
+      word_ranks_(occupancy_.size(), 0u) {}
+
+SparseLabelBlock::SparseLabelBlock(const Block<LabelVoxel>& block)
+    : SparseLabelBlock(block.num_voxels()) {
+  // Voxels are visited in linear index order, so they are appended.
+  for (size_t linear_idx = 0u; linear_idx < num_voxels_; ++linear_idx) {
+    const LabelVoxel& voxel = block.getVoxelByLinearIndex(linear_idx);
+    if (!isEmptyVoxel(voxel)) {
+      occupancy_[linear_idx / kBitsPerWord] |= getBit(linear_idx);
+      voxels_.push_back(voxel);
+    }
+  }
+  uint32_t rank = 0u;
+  for (size_t word_idx = 0u; word_idx < occupancy_.size(); ++word_idx) {
+    word_ranks_[word_idx] = rank;
+    rank += __builtin_popcountll(occupancy_[word_idx]);
+  }
+}
+
+LabelVoxel& SparseLabelBlock::getOrInsertVoxelByLinearIndex(
+    const size_t linear_idx) {
+  CHECK_LT(linear_idx, num_voxels_);
+  const size_t packed_idx = getPackedIndex(linear_idx);
+  if (isLabelled(linear_idx)) {
+    return voxels_[packed_idx];
+  }
+  const size_t word_idx = linear_idx / kBitsPerWord;
+  occupancy_[word_idx] |= getBit(linear_idx);
+  for (size_t next_word_idx = word_idx + 1u;
+       next_word_idx < word_ranks_.size(); ++next_word_idx) {
+    ++word_ranks_[next_word_idx];
+  }
+  return *voxels_.insert(voxels_.begin() + packed_idx, LabelVoxel());
+}
+
+void SparseLabelBlock::getDenseBlock(Block<LabelVoxel>* block) const {
+  CHECK_NOTNULL(block);
+  CHECK_EQ(block->num_voxels(), num_voxels_);
+  for (size_t linear_idx = 0u, packed_idx = 0u; linear_idx < num_voxels_;
+       ++linear_idx) {
+    block->getVoxelByLinearIndex(linear_idx) =
+        isLabelled(linear_idx) ? voxels_[packed_idx++] : kEmptyVoxel;
+  }
+}
+
+size_t SparseLabelBlock::getMemorySize() const {
+  return sizeof(*this) + occupancy_.capacity() * sizeof(uint64_t) +
+         word_ranks_.capacity() * sizeof(uint32_t) +
+         voxels_.capacity() * sizeof(LabelVoxel);
+}
+
+void sparsifyLabelLayer(const Layer<LabelVoxel>& label_layer,
+                        SparseLabelBlockMap* sparse_blocks) {
+  CHECK_NOTNULL(sparse_blocks);
+  sparse_blocks->clear();
+
+  BlockIndexList block_indices;
+  label_layer.getAllAllocatedBlocks(&block_indices);
+  for (const BlockIndex& block_index : block_indices) {
+    SparseLabelBlock::Ptr sparse_block = std::make_shared<SparseLabelBlock>(
+        label_layer.getBlockByIndex(block_index));
+    sparse_blocks->emplace(block_index, sparse_block);
+  }
+}
+
+void densifyLabelLayer(const SparseLabelBlockMap& sparse_blocks,
+                       Layer<LabelVoxel>* label_layer) {
+  CHECK_NOTNULL(label_layer);
+  for (const std::pair<const BlockIndex, SparseLabelBlock::Ptr>&
+           sparse_block_pair : sparse_blocks) {
+    Block<LabelVoxel>::Ptr label_block =
+        label_layer->allocateBlockPtrByIndex(sparse_block_pair.first);
+    sparse_block_pair.second->getDenseBlock(label_block.get());
+    label_block->set_has_data(true);
+  }
+}
+
+}  // namespace voxblox
@@ -0,0 +1,156 @@
+#include "global_segment_map/utils/thread_pool.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace voxblox {
+
+namespace {
+
+// The pool and worker index the current thread runs tasks for, if any.
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local size_t current_worker_idx = 0u;
+
+}  // namespace
+
+ThreadPool::ThreadPool(const size_t num_threads)
+    : num_threads_(std::max<size_t>(num_threads, 1u)),
+      task_(nullptr),
+      batch_id_(0u),
+      num_busy_workers_(0u),
+      stop_(false) {
+  if (num_threads_ == 1u) {
+    return;
+  }
+  work_queues_.reserve(num_threads_);
+  for (size_t worker_idx = 0u; worker_idx < num_threads_; ++worker_idx) {
+    work_queues_.emplace_back(new WorkQueue());
+  }
+  // Worker 0 is the thread calling parallelFor.
+  workers_.reserve(num_threads_ - 1u);
+  for (size_t worker_idx = 1u; worker_idx < num_threads_; ++worker_idx) {
+    workers_.emplace_back(&ThreadPool::workerLoop, this, worker_idx);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    stop_ = true;
+  }
+  batch_started_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::parallelFor(const size_t num_tasks, const Task& task) {
+  if (num_tasks == 0u) {
+    return;
+  }
+  // Waiting for a nested batch would block the worker the batch waits for,
+  // so it is run by the worker that submits it.
+  if (workers_.empty() || current_pool == this) {
+    const size_t worker_idx = current_pool == this ? current_worker_idx : 0u;
+    for (size_t task_idx = 0u; task_idx < num_tasks; ++task_idx) {
+      task(task_idx, worker_idx);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> batch_lock(batch_mutex_);
+
+  // Hand out contiguous ranges of tasks, so that without stealing every
+  // worker processes neighbouring indices.
+  for (size_t worker_idx = 0u; worker_idx < num_threads_; ++worker_idx) {
+    WorkQueue& work_queue = *work_queues_[worker_idx];
+    std::lock_guard<std::mutex> queue_lock(work_queue.mutex);
+    const size_t begin = worker_idx * num_tasks / num_threads_;
+    const size_t end = (worker_idx + 1u) * num_tasks / num_threads_;
+    for (size_t task_idx = begin; task_idx < end; ++task_idx) {
+      work_queue.task_indices.push_back(task_idx);
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    task_ = &task;
+    num_busy_workers_ = workers_.size();
+    ++batch_id_;
+  }
+  batch_started_.notify_all();
+
+  const ThreadPool* outer_pool = current_pool;
+  const size_t outer_worker_idx = current_worker_idx;
+  constexpr size_t kCallerWorkerIdx = 0u;
+  current_pool = this;
+  current_worker_idx = kCallerWorkerIdx;
+  runTasks(kCallerWorkerIdx, task);
+  current_pool = outer_pool;
+  current_worker_idx = outer_worker_idx;
+
+  std::unique_lock<std::mutex> lock(state_mutex_);
+  batch_done_.wait(lock, [this] { return num_busy_workers_ == 0u; });
+  task_ = nullptr;
+}
+
+void ThreadPool::workerLoop(const size_t worker_idx) {
+  current_pool = this;
+  current_worker_idx = worker_idx;
+  size_t last_batch_id = 0u;
+  while (true) {
+    const Task* task = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(state_mutex_);
+      batch_started_.wait(
+          lock, [&] { return stop_ || batch_id_ != last_batch_id; });
+      if (stop_) {
+        return;
+      }
+      last_batch_id = batch_id_;
+      task = task_;
+    }
+    CHECK_NOTNULL(task);
+    runTasks(worker_idx, *task);
+
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    if (--num_busy_workers_ == 0u) {
+      batch_done_.notify_one();
+    }
+  }
+}
+
+void ThreadPool::runTasks(const size_t worker_idx, const Task& task) {
+  size_t task_idx;
+  while (getNextTaskIndex(worker_idx, &task_idx)) {
+    task(task_idx, worker_idx);
+  }
+}
+
+bool ThreadPool::getNextTaskIndex(const size_t worker_idx, size_t* task_idx) {
+  CHECK_NOTNULL(task_idx);
+  {
+    WorkQueue& own_queue = *work_queues_[worker_idx];
+    std::lock_guard<std::mutex> lock(own_queue.mutex);
+    if (!own_queue.task_indices.empty()) {
+      *task_idx = own_queue.task_indices.front();
+      own_queue.task_indices.pop_front();
+      return true;
+    }
+  }
+  // Steal from the back of the other queues, starting with the neighbour.
+  for (size_t offset = 1u; offset < num_threads_; ++offset) {
+    WorkQueue& victim_queue =
+        *work_queues_[(worker_idx + offset) % num_threads_];
+    std::lock_guard<std::mutex> lock(victim_queue.mutex);
+    if (!victim_queue.task_indices.empty()) {
+      *task_idx = victim_queue.task_indices.back();
+      victim_queue.task_indices.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace voxblox
@@ -0,0 +1,161 @@
+#include <cmath>
+#include <memory>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/label_voxel.h"
+#include "global_segment_map/utils/active_block_set.h"
+
+using namespace voxblox;  // NOLINT
+
+class ActiveBlockSetTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    tsdf_layer_.reset(new Layer<TsdfVoxel>(kVoxelSize, kVoxelsPerSide));
+    label_layer_.reset(new Layer<LabelVoxel>(kVoxelSize, kVoxelsPerSide));
+
+    intrinsics_.fx = 50.0f;
+    intrinsics_.fy = 50.0f;
+    intrinsics_.cx = 32.0f;
+    intrinsics_.cy = 24.0f;
+    intrinsics_.width = 64;
+    intrinsics_.height = 48;
+  }
+
+  // Allocates the tsdf blocks of a cube of blocks around the origin and a
+  // label block for every other one.
+  void allocateBlocks(const int half_size) {
+    BlockIndex block_idx;
+    for (block_idx.x() = -half_size; block_idx.x() <= half_size;
+         ++block_idx.x()) {
+      for (block_idx.y() = -half_size; block_idx.y() <= half_size;
+           ++block_idx.y()) {
+        for (block_idx.z() = -half_size; block_idx.z() <= half_size;
+             ++block_idx.z()) {
+          tsdf_layer_->allocateBlockPtrByIndex(block_idx);
+          if ((block_idx.x() + block_idx.y() + block_idx.z()) % 2 == 0) {
+            label_layer_->allocateBlockPtrByIndex(block_idx);
+          }
+        }
+      }
+    }
+  }
+
+  // Checks every allocated block against is_active and the set.
+  template <typename IsActiveFunction>
+  void expectActiveBlocks(const ActiveBlockSet& active_blocks,
+                          const IsActiveFunction& is_active) const {
+    ASSERT_TRUE(active_blocks.isValid());
+    BlockIndexList allocated_blocks;
+    tsdf_layer_->getAllAllocatedBlocks(&allocated_blocks);
+    size_t num_active_blocks = 0u;
+    for (const BlockIndex& block_idx : allocated_blocks) {
+      const ActiveBlockSet::ActiveBlock* active_block =
+          active_blocks.getBlock(block_idx);
+      if (!is_active(block_idx)) {
+        EXPECT_TRUE(active_block == nullptr) << block_idx.transpose();
+        continue;
+      }
+      ++num_active_blocks;
+      ASSERT_TRUE(active_block != nullptr) << block_idx.transpose();
+      EXPECT_EQ(block_idx, active_block->block_idx);
+      EXPECT_EQ(tsdf_layer_->getBlockPtrByIndex(block_idx),
+                active_block->tsdf_block);
+      EXPECT_EQ(label_layer_->getBlockPtrByIndex(block_idx),
+                active_block->label_block);
+    }
+    EXPECT_EQ(num_active_blocks, active_blocks.size());
+    EXPECT_GT(num_active_blocks, 0u);
+  }
+
+  void expectBoxBlocks(const Point& min_G, const Point& max_G) const {
+    ActiveBlockSet active_blocks;
+    active_blocks.update(min_G, max_G, tsdf_layer_.get(), label_layer_.get());
+    const FloatingPoint block_size = tsdf_layer_->block_size();
+    expectActiveBlocks(active_blocks, [&](const BlockIndex& block_idx) {
+      const Point block_min_G =
+          getOriginPointFromGridIndex(block_idx, block_size);
+      return (block_min_G.array() <= max_G.array()).all() &&
+             (block_min_G.array() + block_size > min_G.array()).all();
+    });
+  }
+
+  // Blocks that intersect the frustum's bounding box and whose bounding
+  // sphere intersects the frustum.
+  void expectFrustumBlocks(const Transformation& T_G_C,
+                           const FloatingPoint max_depth) const {
+    ActiveBlockSet active_blocks;
+    active_blocks.update(T_G_C, intrinsics_, max_depth, tsdf_layer_.get(),
+                         label_layer_.get());
+    Point min_G = T_G_C.getPosition();
+    Point max_G = min_G;
+    for (const int u : {0, intrinsics_.width}) {
+      for (const int v : {0, intrinsics_.height}) {
+        const Point corner_G =
+            T_G_C * intrinsics_.backProjectPixel(u, v, max_depth);
+        min_G = min_G.cwiseMin(corner_G);
+        max_G = max_G.cwiseMax(corner_G);
+      }
+    }
+    const FloatingPoint block_size = tsdf_layer_->block_size();
+    const FloatingPoint block_radius = 0.5f * std::sqrt(3.0f) * block_size;
+    const Transformation T_C_G = T_G_C.inverse();
+    expectActiveBlocks(active_blocks, [&](const BlockIndex& block_idx) {
+      const Point block_min_G =
+          getOriginPointFromGridIndex(block_idx, block_size);
+      const Point block_center_G =
+          getCenterPointFromGridIndex(block_idx, block_size);
+      return (block_min_G.array() <= max_G.array()).all() &&
+             (block_min_G.array() + block_size > min_G.array()).all() &&
+             intrinsics_.isSphereInFrustum(T_C_G * block_center_G,
+                                           block_radius, max_depth);
+    });
+  }
+
+  static constexpr FloatingPoint kVoxelSize = 0.1f;
+  static constexpr size_t kVoxelsPerSide = 4u;
+
+  std::unique_ptr<Layer<TsdfVoxel>> tsdf_layer_;
+  std::unique_ptr<Layer<LabelVoxel>> label_layer_;
+  CameraIntrinsics intrinsics_;
+};
+
+TEST_F(ActiveBlockSetTest, CollectsTheBlocksInTheBox) {
+  // A box larger than the map, so the allocated blocks are checked, and a
+  // box smaller than the map, so the box is looked up block by block.
+  allocateBlocks(3);
+  expectBoxBlocks(Point(-2.0f, -1.9f, -0.5f), Point(0.05f, 2.5f, 0.9f));
+  expectBoxBlocks(Point(-0.35f, -0.1f, 0.0f), Point(0.4f, 0.15f, 0.61f));
+}
+
+TEST_F(ActiveBlockSetTest, CollectsTheBlocksInTheFrustum) {
+  allocateBlocks(5);
+  const Transformation T_G_C(
+      Eigen::Quaternion<FloatingPoint>(0.9f, 0.1f, -0.3f, 0.2f),
+      Point(0.3f, -0.2f, 0.1f));
+  // The frustum reaching beyond the map and within it.
+  expectFrustumBlocks(T_G_C, 4.0f);
+  expectFrustumBlocks(T_G_C, 0.8f);
+}
+
+TEST_F(ActiveBlockSetTest, ClearInvalidatesTheSet) {
+  allocateBlocks(1);
+  ActiveBlockSet active_blocks;
+  active_blocks.update(Point::Constant(-1.0f), Point::Constant(1.0f),
+                       tsdf_layer_.get(), label_layer_.get());
+  EXPECT_EQ(tsdf_layer_->getNumberOfAllocatedBlocks(), active_blocks.size());
+  active_blocks.clear();
+  EXPECT_FALSE(active_blocks.isValid());
+  EXPECT_EQ(0u, active_blocks.size());
+  EXPECT_TRUE(active_blocks.getBlock(BlockIndex::Zero()) == nullptr);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+
+  int result = RUN_ALL_TESTS();
+
+  return result;
+}
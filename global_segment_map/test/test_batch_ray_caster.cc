@@ -0,0 +1,114 @@
+#include <random>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <voxblox/integrator/integrator_utils.h>
+
+#include "global_segment_map/utils/batch_ray_caster.h"
+
+using namespace voxblox;  // NOLINT
+
+class BatchRayCasterTest : public ::testing::Test {
+ protected:
+  // Casts every ray with voxblox::RayCaster and with BatchRayCaster, and
+  // expects both to visit the same voxels in the same order.
+  void expectSameVoxels(const Point& origin,
+                        const AlignedVector<Point>& points_G,
+                        const bool voxel_carving_enabled,
+                        const bool clearing_ray) const {
+    const BatchRayCaster batch_ray_caster(
+        voxel_carving_enabled, kMaxRayLength, kVoxelSizeInv,
+        kTruncationDistance);
+    std::vector<GlobalIndexVector> ray_voxel_indices;
+    batch_ray_caster.castRays(origin, points_G, clearing_ray,
+                              &ray_voxel_indices);
+    ASSERT_EQ(points_G.size(), ray_voxel_indices.size());
+
+    for (size_t ray_idx = 0u; ray_idx < points_G.size(); ++ray_idx) {
+      RayCaster ray_caster(origin, points_G[ray_idx], clearing_ray,
+                           voxel_carving_enabled, kMaxRayLength,
+                           kVoxelSizeInv, kTruncationDistance);
+      GlobalIndexVector expected_voxel_indices;
+      GlobalIndex global_voxel_idx;
+      while (ray_caster.nextRayIndex(&global_voxel_idx)) {
+        expected_voxel_indices.push_back(global_voxel_idx);
+      }
+
+      const GlobalIndexVector& voxel_indices = ray_voxel_indices[ray_idx];
+      ASSERT_EQ(expected_voxel_indices.size(), voxel_indices.size())
+          << "Ray " << ray_idx << " to " << points_G[ray_idx].transpose();
+      for (size_t step = 0u; step < voxel_indices.size(); ++step) {
+        ASSERT_EQ(expected_voxel_indices[step], voxel_indices[step])
+            << "Ray " << ray_idx << " to " << points_G[ray_idx].transpose()
+            << ", step " << step;
+      }
+    }
+  }
+
+  // Runs all combinations of carving and clearing rays.
+  void expectSameVoxels(const Point& origin,
+                        const AlignedVector<Point>& points_G) const {
+    for (const bool voxel_carving_enabled : {false, true}) {
+      for (const bool clearing_ray : {false, true}) {
+        expectSameVoxels(origin, points_G, voxel_carving_enabled,
+                         clearing_ray);
+      }
+    }
+  }
+
+  static constexpr FloatingPoint kVoxelSizeInv = 20.0f;
+  static constexpr FloatingPoint kTruncationDistance = 0.2f;
+  static constexpr FloatingPoint kMaxRayLength = 3.0f;
+};
+
+TEST_F(BatchRayCasterTest, MatchesRayCasterOnRandomRays) {
+  std::mt19937 random_engine(7u);
+  std::uniform_real_distribution<FloatingPoint> coordinate_distribution(
+      -4.0f, 4.0f);
+  const Point origin(0.13f, -0.72f, 1.05f);
+  // Not a multiple of the number of lanes, so the last batch is partial.
+  constexpr size_t kNumRays = 20u * BatchRayCaster::kNumLanes + 3u;
+  AlignedVector<Point> points_G;
+  for (size_t ray_idx = 0u; ray_idx < kNumRays; ++ray_idx) {
+    points_G.push_back(Point(coordinate_distribution(random_engine),
+                             coordinate_distribution(random_engine),
+                             coordinate_distribution(random_engine)));
+  }
+  expectSameVoxels(origin, points_G);
+}
+
+TEST_F(BatchRayCasterTest, MatchesRayCasterOnAxisAlignedRays) {
+  // Rays without extent along some axes, and rays starting and ending on
+  // voxel boundaries.
+  const Point origin(0.5f, -0.25f, 0.0f);
+  AlignedVector<Point> points_G;
+  for (const FloatingPoint distance : {-1.5f, -0.05f, 0.05f, 2.0f}) {
+    for (size_t axis = 0u; axis < 3u; ++axis) {
+      Point point_G = origin;
+      point_G[axis] += distance;
+      points_G.push_back(point_G);
+    }
+    points_G.push_back(origin + Point(distance, distance, 0.0f));
+    points_G.push_back(origin + Point(distance, -distance, distance));
+  }
+  expectSameVoxels(origin, points_G);
+}
+
+TEST_F(BatchRayCasterTest, CastsNoRaysForNoPoints) {
+  const BatchRayCaster batch_ray_caster(true, kMaxRayLength, kVoxelSizeInv,
+                                        kTruncationDistance);
+  std::vector<GlobalIndexVector> ray_voxel_indices(3u);
+  batch_ray_caster.castRays(Point::Zero(), AlignedVector<Point>(), false,
+                            &ray_voxel_indices);
+  EXPECT_TRUE(ray_voxel_indices.empty());
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+
+  int result = RUN_ALL_TESTS();
+
+  return result;
+}
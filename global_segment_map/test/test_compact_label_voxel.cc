@@ -0,0 +1,284 @@
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+#include <gtest/gtest.h>
+
+#include "global_segment_map/label_block_serialization.h"
+#include "global_segment_map/label_tsdf_map.h"
+#include "global_segment_map/utils/compact_label_voxel.h"
+
+using namespace voxblox;  // NOLINT
+
+namespace {
+
+LabelVoxel makeLabelVoxel(const Label first_label,
+                          const LabelConfidence first_confidence,
+                          const Label second_label,
+                          const LabelConfidence second_confidence) {
+  LabelVoxel voxel;
+  voxel.label_count[0].label = first_label;
+  voxel.label_count[0].label_confidence = first_confidence;
+  voxel.label_count[1].label = second_label;
+  voxel.label_count[1].label_confidence = second_confidence;
+  voxel.label = first_label;
+  voxel.label_confidence = first_confidence;
+  return voxel;
+}
+
+}  // namespace
+
+class CompactLabelVoxelTest : public ::testing::Test {
+ protected:
+  static constexpr FloatingPoint kVoxelSize = 0.1f;
+  static constexpr size_t kVoxelsPerSide = 8u;
+};
+
+TEST_F(CompactLabelVoxelTest, RoundTripKeepsSmallConfidences) {
+  const LabelVoxel voxel = makeLabelVoxel(7u, 20u, 3u, 12u);
+
+  CompactLabelVoxel compact_voxel;
+  compressLabelVoxel(voxel, &compact_voxel);
+  EXPECT_EQ(7u, getCompactVoxelLabel(compact_voxel));
+  EXPECT_EQ(20u, getCompactVoxelLabelConfidence(compact_voxel));
+
+  LabelVoxel decompressed_voxel;
+  decompressLabelVoxel(compact_voxel, &decompressed_voxel);
+  EXPECT_EQ(voxel.label, decompressed_voxel.label);
+  EXPECT_EQ(voxel.label_confidence, decompressed_voxel.label_confidence);
+  EXPECT_EQ(7u, decompressed_voxel.label_count[0].label);
+  EXPECT_EQ(20u, decompressed_voxel.label_count[0].label_confidence);
+  EXPECT_EQ(3u, decompressed_voxel.label_count[1].label);
+  EXPECT_EQ(12u, decompressed_voxel.label_count[1].label_confidence);
+}
+
+TEST_F(CompactLabelVoxelTest, CompressionScalesLargeConfidences) {
+  const LabelVoxel voxel = makeLabelVoxel(7u, 1000u, 3u, 500u);
+
+  CompactLabelVoxel compact_voxel;
+  compressLabelVoxel(voxel, &compact_voxel);
+  EXPECT_EQ(7u, getCompactVoxelLabel(compact_voxel));
+  EXPECT_EQ(255u, getCompactVoxelLabelConfidence(compact_voxel));
+  // Scaled with rounding up.
+  EXPECT_EQ(128u, compact_voxel.confidences[1]);
+}
+
+TEST_F(CompactLabelVoxelTest, CompressionKeepsTheLabelOnTies) {
+  const LabelVoxel voxel = makeLabelVoxel(3u, 10u, 7u, 10u);
+  LabelVoxel tied_voxel = voxel;
+  tied_voxel.label = 7u;
+
+  CompactLabelVoxel compact_voxel;
+  compressLabelVoxel(tied_voxel, &compact_voxel);
+  EXPECT_EQ(7u, getCompactVoxelLabel(compact_voxel));
+}
+
+TEST_F(CompactLabelVoxelTest, OverflowHalvesAllConfidences) {
+  CompactLabelVoxel compact_voxel;
+  addCompactVoxelLabelConfidence(1u, 250u, &compact_voxel);
+  addCompactVoxelLabelConfidence(2u, 100u, &compact_voxel);
+
+  addCompactVoxelLabelConfidence(1u, 10u, &compact_voxel);
+  EXPECT_EQ(1u, getCompactVoxelLabel(compact_voxel));
+  EXPECT_EQ(130u, getCompactVoxelLabelConfidence(compact_voxel));
+  EXPECT_EQ(2u, compact_voxel.labels[1]);
+  EXPECT_EQ(50u, compact_voxel.confidences[1]);
+}
+
+TEST_F(CompactLabelVoxelTest, OverflowOfLargeVotesNeverWraps) {
+  CompactLabelVoxel compact_voxel;
+  addCompactVoxelLabelConfidence(1u, 255u, &compact_voxel);
+  addCompactVoxelLabelConfidence(2u, 1000u, &compact_voxel);
+  EXPECT_EQ(2u, getCompactVoxelLabel(compact_voxel));
+  EXPECT_LE(compact_voxel.confidences[0], compact_voxel.confidences[1]);
+  EXPECT_GT(compact_voxel.confidences[0], 0u);
+}
+
+TEST_F(CompactLabelVoxelTest, VotedLabelWinsTies) {
+  CompactLabelVoxel compact_voxel;
+  addCompactVoxelLabelConfidence(1u, 10u, &compact_voxel);
+  addCompactVoxelLabelConfidence(2u, 5u, &compact_voxel);
+  EXPECT_EQ(1u, getCompactVoxelLabel(compact_voxel));
+
+  addCompactVoxelLabelConfidence(2u, 5u, &compact_voxel);
+  EXPECT_EQ(2u, getCompactVoxelLabel(compact_voxel));
+  EXPECT_EQ(10u, getCompactVoxelLabelConfidence(compact_voxel));
+}
+
+TEST_F(CompactLabelVoxelTest, LayerRoundTrip) {
+  Layer<LabelVoxel> layer(kVoxelSize, kVoxelsPerSide);
+  Block<LabelVoxel>::Ptr block =
+      layer.allocateBlockPtrByIndex(BlockIndex(1, -2, 3));
+  for (size_t linear_idx = 0u; linear_idx < block->num_voxels();
+       linear_idx += 3u) {
+    block->getVoxelByLinearIndex(linear_idx) =
+        makeLabelVoxel(linear_idx % 200u + 1u, linear_idx % 50u + 10u, 300u,
+                       linear_idx % 7u);
+  }
+  block->set_has_data(true);
+
+  Layer<CompactLabelVoxel> compact_layer(kVoxelSize, kVoxelsPerSide);
+  compressLabelLayer(layer, &compact_layer);
+  EXPECT_EQ(1u, compact_layer.getNumberOfAllocatedBlocks());
+  EXPECT_EQ(layer.getMemorySize() / 2u, compact_layer.getMemorySize());
+
+  Layer<LabelVoxel> decompressed_layer(kVoxelSize, kVoxelsPerSide);
+  decompressLabelLayer(compact_layer, &decompressed_layer);
+  const Block<LabelVoxel>& decompressed_block =
+      decompressed_layer.getBlockByIndex(BlockIndex(1, -2, 3));
+  EXPECT_TRUE(decompressed_block.has_data());
+  for (size_t linear_idx = 0u; linear_idx < block->num_voxels();
+       ++linear_idx) {
+    const LabelVoxel& voxel = block->getVoxelByLinearIndex(linear_idx);
+    const LabelVoxel& decompressed_voxel =
+        decompressed_block.getVoxelByLinearIndex(linear_idx);
+    EXPECT_EQ(voxel.label, decompressed_voxel.label);
+    EXPECT_EQ(voxel.label_confidence, decompressed_voxel.label_confidence);
+  }
+}
+
+TEST_F(CompactLabelVoxelTest, BlockSerializationRoundTrip) {
+  Block<CompactLabelVoxel> block(kVoxelsPerSide, kVoxelSize, Point::Zero());
+  for (size_t linear_idx = 0u; linear_idx < block.num_voxels();
+       ++linear_idx) {
+    addCompactVoxelLabelConfidence(linear_idx % 100u + 1u,
+                                   linear_idx % 255u + 1u,
+                                   &block.getVoxelByLinearIndex(linear_idx));
+  }
+  std::vector<uint32_t> data;
+  block.serializeToIntegers(&data);
+
+  Block<CompactLabelVoxel> deserialized_block(kVoxelsPerSide, kVoxelSize,
+                                              Point::Zero());
+  deserialized_block.deserializeFromIntegers(data);
+  for (size_t linear_idx = 0u; linear_idx < block.num_voxels();
+       ++linear_idx) {
+    const CompactLabelVoxel& voxel = block.getVoxelByLinearIndex(linear_idx);
+    const CompactLabelVoxel& deserialized_voxel =
+        deserialized_block.getVoxelByLinearIndex(linear_idx);
+    for (size_t slot_idx = 0u; slot_idx < kNumCompactLabelVoxelSlots;
+         ++slot_idx) {
+      EXPECT_EQ(voxel.labels[slot_idx], deserialized_voxel.labels[slot_idx]);
+      EXPECT_EQ(voxel.confidences[slot_idx],
+                deserialized_voxel.confidences[slot_idx]);
+    }
+  }
+}
+
+TEST_F(CompactLabelVoxelTest, MapFileRoundTripWithCompactLabels) {
+  LabelTsdfMap::Config config;
+  config.voxel_size = kVoxelSize;
+  config.voxels_per_side = kVoxelsPerSide;
+  config.compact_label_layer_on_save = true;
+  LabelTsdfMap map(config);
+
+  const BlockIndex block_idx(0, 1, 2);
+  map.getTsdfLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  Block<LabelVoxel>::Ptr label_block =
+      map.getLabelLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  label_block->getVoxelByLinearIndex(5u) = makeLabelVoxel(4u, 900u, 2u, 30u);
+  label_block->getVoxelByLinearIndex(6u) = makeLabelVoxel(4u, 8u, 0u, 0u);
+  label_block->getVoxelByLinearIndex(9u) = makeLabelVoxel(11u, 3u, 4u, 1u);
+
+  const std::string file_path = ::testing::TempDir() + "compact_map.gsm";
+  ASSERT_TRUE(map.saveToFile(file_path));
+
+  LabelTsdfMap loaded_map(config);
+  ASSERT_TRUE(loaded_map.loadFromFile(file_path));
+  std::remove(file_path.c_str());
+
+  const Block<LabelVoxel>::ConstPtr loaded_block =
+      loaded_map.getLabelLayer().getBlockPtrByIndex(block_idx);
+  ASSERT_TRUE(loaded_block != nullptr);
+  EXPECT_EQ(4u, loaded_block->getVoxelByLinearIndex(5u).label);
+  EXPECT_EQ(255u, loaded_block->getVoxelByLinearIndex(5u).label_confidence);
+  EXPECT_EQ(4u, loaded_block->getVoxelByLinearIndex(6u).label);
+  EXPECT_EQ(11u, loaded_block->getVoxelByLinearIndex(9u).label);
+
+  // The voxel counts of the labels are restored.
+  EXPECT_EQ(2, loaded_map.getLabelCountPtr()->at(4u));
+  EXPECT_EQ(1, loaded_map.getLabelCountPtr()->at(11u));
+  EXPECT_EQ(11u, *loaded_map.getHighestLabelPtr());
+}
+
+TEST_F(CompactLabelVoxelTest, MapPacksLabelBlocksAndDensifiesThemOnAccess) {
+  LabelTsdfMap::Config config;
+  config.voxel_size = kVoxelSize;
+  config.voxels_per_side = kVoxelsPerSide;
+  config.inactive_label_block_encoding = LabelTsdfMap::kCompact;
+  LabelTsdfMap map(config);
+
+  const BlockIndex block_idx(0, 1, 2);
+  map.getTsdfLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  Block<LabelVoxel>::Ptr label_block =
+      map.getLabelLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  label_block->getVoxelByLinearIndex(5u) = makeLabelVoxel(4u, 20u, 2u, 3u);
+  label_block->getVoxelByLinearIndex(9u) = makeLabelVoxel(11u, 3u, 4u, 1u);
+  (*map.getLabelCountPtr())[4u] = 1;
+  (*map.getLabelCountPtr())[11u] = 1;
+
+  map.packLabelBlock(block_idx);
+  EXPECT_FALSE(map.getLabelLayer().hasBlock(block_idx));
+  EXPECT_TRUE(map.isLabelBlockPacked(block_idx));
+  EXPECT_EQ(1u, map.getNumberOfPackedLabelBlocks());
+  BlockIndexList block_indices;
+  map.getAllLabelBlockIndices(&block_indices);
+  ASSERT_EQ(1u, block_indices.size());
+  EXPECT_EQ(block_idx, block_indices.front());
+  const Block<LabelVoxel>::ConstPtr decoded_block =
+      map.getLabelBlockPtrByIndex(block_idx);
+  ASSERT_TRUE(decoded_block != nullptr);
+  EXPECT_EQ(4u, decoded_block->getVoxelByLinearIndex(5u).label);
+  EXPECT_EQ(11u, decoded_block->getVoxelByLinearIndex(9u).label);
+  EXPECT_FALSE(map.getLabelLayer().hasBlock(block_idx));
+
+  // The segment layers are extracted from the packed blocks.
+  std::unordered_map<Label, LabelTsdfMap::LayerPair> label_layers;
+  map.extractSegmentLayers({4u, 11u}, &label_layers);
+  ASSERT_EQ(1u, label_layers.count(4u));
+  const Block<LabelVoxel>::ConstPtr segment_block =
+      label_layers.at(4u).second.getBlockPtrByIndex(block_idx);
+  ASSERT_TRUE(segment_block != nullptr);
+  EXPECT_EQ(4u, segment_block->getVoxelByLinearIndex(5u).label);
+
+  // Packed blocks are saved with the label layer.
+  const std::string file_path = ::testing::TempDir() + "packed_map.gsm";
+  ASSERT_TRUE(map.saveToFile(file_path));
+  LabelTsdfMap loaded_map(config);
+  ASSERT_TRUE(loaded_map.loadFromFile(file_path));
+  std::remove(file_path.c_str());
+  const Block<LabelVoxel>::ConstPtr loaded_block =
+      loaded_map.getLabelLayer().getBlockPtrByIndex(block_idx);
+  ASSERT_TRUE(loaded_block != nullptr);
+  EXPECT_EQ(4u, loaded_block->getVoxelByLinearIndex(5u).label);
+  EXPECT_EQ(1, loaded_map.getLabelCountPtr()->at(11u));
+
+  label_block = map.unpackLabelBlock(block_idx);
+  ASSERT_TRUE(label_block != nullptr);
+  EXPECT_TRUE(map.getLabelLayer().hasBlock(block_idx));
+  EXPECT_FALSE(map.hasPackedLabelBlocks());
+  EXPECT_EQ(4u, label_block->getVoxelByLinearIndex(5u).label);
+  EXPECT_EQ(20u, label_block->getVoxelByLinearIndex(5u).label_confidence);
+}
+
+TEST_F(CompactLabelVoxelTest, DenseMapDoesNotPackLabelBlocks) {
+  LabelTsdfMap::Config config;
+  config.voxel_size = kVoxelSize;
+  config.voxels_per_side = kVoxelsPerSide;
+  LabelTsdfMap map(config);
+
+  const BlockIndex block_idx(3, 0, -1);
+  map.getLabelLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  map.packLabelBlock(block_idx);
+  EXPECT_TRUE(map.getLabelLayer().hasBlock(block_idx));
+  EXPECT_FALSE(map.hasPackedLabelBlocks());
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+
+  int result = RUN_ALL_TESTS();
+
+  return result;
+}
@@ -0,0 +1,187 @@
+#include <limits>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/segment.h"
+#include "global_segment_map/utils/image_utils.h"
+
+using namespace voxblox;  // NOLINT
+
+class ImageUtilsTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    intrinsics_.fx = 50.0f;
+    intrinsics_.fy = 40.0f;
+    intrinsics_.cx = 2.5f;
+    intrinsics_.cy = 1.5f;
+    intrinsics_.width = kWidth;
+    intrinsics_.height = kHeight;
+
+    depth_image_.resize(kHeight, kWidth);
+    segment_id_image_.resize(kHeight, kWidth);
+    for (int v = 0; v < kHeight; ++v) {
+      for (int u = 0; u < kWidth; ++u) {
+        depth_image_(v, u) = 1.0f + 0.1f * u + 0.01f * v;
+      }
+    }
+  }
+
+  virtual void TearDown() { deleteSegments(); }
+
+  void extractSegments(const Transformation& T_G_C) {
+    deleteSegments();
+    extractImageSegments(T_G_C, depth_image_, segment_id_image_, intrinsics_,
+                         &segment_index_image_, &segment_ids_, &segments_);
+  }
+
+  void deleteSegments() {
+    for (Segment* segment : segments_) {
+      delete segment;
+    }
+    segments_.clear();
+  }
+
+  static constexpr int kWidth = 6;
+  static constexpr int kHeight = 4;
+
+  CameraIntrinsics intrinsics_;
+  DepthImage depth_image_;
+  SegmentIdImage segment_id_image_;
+  SegmentIndexImage segment_index_image_;
+  std::vector<uint32_t> segment_ids_;
+  std::vector<Segment*> segments_;
+};
+
+TEST_F(ImageUtilsTest, GroupsPixelsBySegmentId) {
+  // Segments are numbered in the order their first pixel is scanned.
+  segment_id_image_ << 7, 7, 7, 3, 3, 3,
+                       7, 7, 0, 3, 3, 3,
+                       9, 9, 0, 0, 3, 3,
+                       9, 9, 9, 7, 7, 3;
+  const Transformation T_G_C(
+      Eigen::Quaternion<FloatingPoint>(0.9f, 0.1f, -0.3f, 0.2f),
+      Point(1.0f, -2.0f, 0.5f));
+  extractSegments(T_G_C);
+
+  ASSERT_EQ(3u, segment_ids_.size());
+  ASSERT_EQ(3u, segments_.size());
+  EXPECT_EQ(7u, segment_ids_[0]);
+  EXPECT_EQ(3u, segment_ids_[1]);
+  EXPECT_EQ(9u, segment_ids_[2]);
+
+  std::vector<size_t> num_pixels(segments_.size(), 0u);
+  for (int v = 0; v < kHeight; ++v) {
+    for (int u = 0; u < kWidth; ++u) {
+      const int32_t segment_idx = segment_index_image_(v, u);
+      if (segment_id_image_(v, u) == kNoSegmentId) {
+        EXPECT_EQ(kNoSegmentIndex, segment_idx);
+        continue;
+      }
+      ASSERT_GE(segment_idx, 0);
+      ASSERT_LT(segment_idx, static_cast<int32_t>(segments_.size()));
+      EXPECT_EQ(segment_ids_[segment_idx], segment_id_image_(v, u));
+
+      // Points are stored in scan order and project back into their pixel
+      // at their depth.
+      const Segment& segment = *segments_[segment_idx];
+      ASSERT_LT(num_pixels[segment_idx], segment.points_C_.size());
+      const Point& point_C = segment.points_C_[num_pixels[segment_idx]];
+      ++num_pixels[segment_idx];
+      EXPECT_FLOAT_EQ(depth_image_(v, u), point_C.z());
+      int projected_u, projected_v;
+      ASSERT_TRUE(
+          intrinsics_.projectToPixel(point_C, &projected_u, &projected_v));
+      EXPECT_EQ(u, projected_u);
+      EXPECT_EQ(v, projected_v);
+    }
+  }
+
+  for (size_t segment_idx = 0u; segment_idx < segments_.size();
+       ++segment_idx) {
+    const Segment& segment = *segments_[segment_idx];
+    EXPECT_EQ(num_pixels[segment_idx], segment.points_C_.size());
+    EXPECT_EQ(segment.points_C_.size(), segment.colors_.size());
+    EXPECT_TRUE(segment.T_G_C_.getTransformationMatrix().isApprox(
+        T_G_C.getTransformationMatrix()));
+  }
+}
+
+TEST_F(ImageUtilsTest, SkipsPixelsWithoutValidDepth) {
+  segment_id_image_.setConstant(5u);
+  segment_id_image_(0, 0) = 6u;
+  depth_image_(0, 0) = std::numeric_limits<float>::quiet_NaN();
+  depth_image_(1, 2) = 0.0f;
+  depth_image_(2, 3) = -1.0f;
+  depth_image_(3, 5) = std::numeric_limits<float>::infinity();
+  extractSegments(Transformation());
+
+  // The only pixel of segment 6 has no depth, so there is no segment for it.
+  ASSERT_EQ(1u, segments_.size());
+  EXPECT_EQ(5u, segment_ids_[0]);
+  EXPECT_EQ(static_cast<size_t>(kWidth * kHeight - 4),
+            segments_[0]->points_C_.size());
+  EXPECT_EQ(kNoSegmentIndex, segment_index_image_(0, 0));
+  EXPECT_EQ(kNoSegmentIndex, segment_index_image_(1, 2));
+  EXPECT_EQ(kNoSegmentIndex, segment_index_image_(2, 3));
+  EXPECT_EQ(kNoSegmentIndex, segment_index_image_(3, 5));
+  EXPECT_EQ(0, segment_index_image_(0, 1));
+}
+
+TEST_F(ImageUtilsTest, ResetsOutputsOfThePreviousFrame) {
+  segment_id_image_.setConstant(5u);
+  extractSegments(Transformation());
+  ASSERT_EQ(1u, segments_.size());
+
+  // The caller owns the segments of the previous frame.
+  deleteSegments();
+  segment_id_image_.setConstant(kNoSegmentId);
+  extractSegments(Transformation());
+  EXPECT_TRUE(segments_.empty());
+  EXPECT_TRUE(segment_ids_.empty());
+  EXPECT_EQ(depth_image_.rows(), segment_index_image_.rows());
+  EXPECT_EQ(depth_image_.cols(), segment_index_image_.cols());
+  EXPECT_TRUE((segment_index_image_.array() == kNoSegmentIndex).all());
+}
+
+TEST_F(ImageUtilsTest, ProjectsOnlyPointsInFrontOfTheImage) {
+  int u, v;
+  EXPECT_FALSE(intrinsics_.projectToPixel(Point(0.0f, 0.0f, -1.0f), &u, &v));
+  EXPECT_FALSE(intrinsics_.projectToPixel(Point(0.0f, 0.0f, 0.0f), &u, &v));
+  EXPECT_FALSE(intrinsics_.projectToPixel(Point(1.0f, 0.0f, 1.0f), &u, &v));
+  ASSERT_TRUE(intrinsics_.projectToPixel(Point(0.0f, 0.0f, 1.0f), &u, &v));
+  EXPECT_EQ(3, u);
+  EXPECT_EQ(2, v);
+}
+
+TEST_F(ImageUtilsTest, CullsSpheresOutsideOfTheFrustum) {
+  constexpr FloatingPoint kMaxDepth = 5.0f;
+  constexpr FloatingPoint kRadius = 0.1f;
+  EXPECT_TRUE(intrinsics_.isSphereInFrustum(Point(0.0f, 0.0f, 2.0f), kRadius,
+                                            kMaxDepth));
+  // Behind the camera and beyond the maximum depth.
+  EXPECT_FALSE(intrinsics_.isSphereInFrustum(Point(0.0f, 0.0f, -0.2f),
+                                             kRadius, kMaxDepth));
+  EXPECT_FALSE(intrinsics_.isSphereInFrustum(Point(0.0f, 0.0f, 5.2f),
+                                             kRadius, kMaxDepth));
+  EXPECT_TRUE(intrinsics_.isSphereInFrustum(Point(0.0f, 0.0f, 5.05f),
+                                            kRadius, kMaxDepth));
+  // The image spans x in [-0.05, 0.07] at depth 1, so a sphere centered just
+  // outside of it still reaches in, one further away does not.
+  EXPECT_TRUE(intrinsics_.isSphereInFrustum(Point(0.1f, 0.0f, 1.0f), kRadius,
+                                            kMaxDepth));
+  EXPECT_FALSE(intrinsics_.isSphereInFrustum(Point(0.5f, 0.0f, 1.0f),
+                                             kRadius, kMaxDepth));
+  EXPECT_FALSE(intrinsics_.isSphereInFrustum(Point(0.0f, -0.5f, 1.0f),
+                                             kRadius, kMaxDepth));
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+
+  int result = RUN_ALL_TESTS();
+
+  return result;
+}
@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "global_segment_map/label_block_serialization.h"
+#include "global_segment_map/label_tsdf_map.h"
+
+using namespace voxblox;  // NOLINT
+
+namespace {
+
+// Every slot gets a different label and confidence, derived from the index
+// of the voxel.
+LabelVoxel makeLabelVoxel(const size_t linear_idx) {
+  LabelVoxel voxel;
+  for (size_t slot_idx = 0u; slot_idx < kNumLabelVoxelSlots; ++slot_idx) {
+    voxel.label_count[slot_idx].label =
+        static_cast<Label>(linear_idx * kNumLabelVoxelSlots + slot_idx + 1u);
+    voxel.label_count[slot_idx].label_confidence =
+        static_cast<LabelConfidence>(60000u - linear_idx - slot_idx);
+  }
+  voxel.label = voxel.label_count[0].label;
+  voxel.label_confidence = voxel.label_count[0].label_confidence;
+  return voxel;
+}
+
+void expectSameVoxel(const LabelVoxel& expected_voxel,
+                     const LabelVoxel& voxel) {
+  EXPECT_EQ(expected_voxel.label, voxel.label);
+  EXPECT_EQ(expected_voxel.label_confidence, voxel.label_confidence);
+  for (size_t slot_idx = 0u; slot_idx < kNumLabelVoxelSlots; ++slot_idx) {
+    EXPECT_EQ(expected_voxel.label_count[slot_idx].label,
+              voxel.label_count[slot_idx].label);
+    EXPECT_EQ(expected_voxel.label_count[slot_idx].label_confidence,
+              voxel.label_count[slot_idx].label_confidence);
+  }
+}
+
+// Packets of a voxel as written before the votes were serialized: the four
+// bytes starting at the confidence, followed by the four bytes starting at
+// the label, of a voxel laid out as label, confidence and votes.
+void appendLegacyPackets(const Label label, const LabelConfidence confidence,
+                         const Label first_vote_label,
+                         std::vector<uint32_t>* data) {
+  const uint16_t legacy_voxel[] = {label, confidence, first_vote_label};
+  uint32_t packet;
+  std::memcpy(&packet, &legacy_voxel[1], sizeof(packet));
+  data->push_back(packet);
+  std::memcpy(&packet, &legacy_voxel[0], sizeof(packet));
+  data->push_back(packet);
+}
+
+}  // namespace
+
+class LabelBlockSerializationTest : public ::testing::Test {
+ protected:
+  static constexpr FloatingPoint kVoxelSize = 0.1f;
+  static constexpr size_t kVoxelsPerSide = 8u;
+};
+
+TEST_F(LabelBlockSerializationTest, BlockRoundTripKeepsVotes) {
+  Block<LabelVoxel> block(kVoxelsPerSide, kVoxelSize, Point::Zero());
+  for (size_t linear_idx = 0u; linear_idx < block.num_voxels();
+       ++linear_idx) {
+    block.getVoxelByLinearIndex(linear_idx) = makeLabelVoxel(linear_idx);
+  }
+  std::vector<uint32_t> data;
+  block.serializeToIntegers(&data);
+  EXPECT_EQ(block.num_voxels() * (1u + kNumLabelVoxelSlots), data.size());
+
+  Block<LabelVoxel> deserialized_block(kVoxelsPerSide, kVoxelSize,
+                                       Point::Zero());
+  deserialized_block.deserializeFromIntegers(data);
+  for (size_t linear_idx = 0u; linear_idx < block.num_voxels();
+       ++linear_idx) {
+    expectSameVoxel(block.getVoxelByLinearIndex(linear_idx),
+                    deserialized_block.getVoxelByLinearIndex(linear_idx));
+  }
+}
+
+TEST_F(LabelBlockSerializationTest, ReadsLegacyBlocksWithoutVotes) {
+  Block<LabelVoxel> block(kVoxelsPerSide, kVoxelSize, Point::Zero());
+  std::vector<uint32_t> data;
+  for (size_t linear_idx = 0u; linear_idx < block.num_voxels();
+       ++linear_idx) {
+    appendLegacyPackets(linear_idx + 1u, 2u * linear_idx + 3u, 999u, &data);
+    // Votes left over in the block are dropped.
+    block.getVoxelByLinearIndex(linear_idx) = makeLabelVoxel(linear_idx);
+  }
+
+  block.deserializeFromIntegers(data);
+  for (size_t linear_idx = 0u; linear_idx < block.num_voxels();
+       ++linear_idx) {
+    const LabelVoxel& voxel = block.getVoxelByLinearIndex(linear_idx);
+    EXPECT_EQ(linear_idx + 1u, voxel.label);
+    EXPECT_EQ(2u * linear_idx + 3u, voxel.label_confidence);
+    for (const LabelCount& label_count : voxel.label_count) {
+      EXPECT_EQ(0u, label_count.label);
+      EXPECT_EQ(0u, label_count.label_confidence);
+    }
+  }
+}
+
+TEST_F(LabelBlockSerializationTest, MapFileRoundTripKeepsVotes) {
+  LabelTsdfMap::Config config;
+  config.voxel_size = kVoxelSize;
+  config.voxels_per_side = kVoxelsPerSide;
+  LabelTsdfMap map(config);
+
+  const BlockIndex block_idx(-1, 0, 3);
+  map.getTsdfLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  Block<LabelVoxel>::Ptr label_block =
+      map.getLabelLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  for (size_t linear_idx = 0u; linear_idx < label_block->num_voxels();
+       ++linear_idx) {
+    label_block->getVoxelByLinearIndex(linear_idx) =
+        makeLabelVoxel(linear_idx);
+  }
+
+  const std::string file_path = ::testing::TempDir() + "label_map.gsm";
+  ASSERT_TRUE(map.saveToFile(file_path));
+
+  LabelTsdfMap loaded_map(config);
+  ASSERT_TRUE(loaded_map.loadFromFile(file_path));
+  std::remove(file_path.c_str());
+
+  const Block<LabelVoxel>::ConstPtr loaded_block =
+      loaded_map.getLabelLayer().getBlockPtrByIndex(block_idx);
+  ASSERT_TRUE(loaded_block != nullptr);
+  for (size_t linear_idx = 0u; linear_idx < label_block->num_voxels();
+       ++linear_idx) {
+    expectSameVoxel(label_block->getVoxelByLinearIndex(linear_idx),
+                    loaded_block->getVoxelByLinearIndex(linear_idx));
+  }
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+
+  int result = RUN_ALL_TESTS();
+
+  return result;
+}
@@ -0,0 +1,846 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "global_segment_map/label_tsdf_integrator.h"
+#include "global_segment_map/label_tsdf_map.h"
+#include "global_segment_map/segment.h"
+#include "global_segment_map/utils/compact_label_voxel.h"
+
+using namespace voxblox;  // NOLINT
+
+namespace {
+
+// Exposes the voxel label updates and the label bookkeeping.
+class TestLabelTsdfIntegrator : public LabelTsdfIntegrator {
+ public:
+  using LabelTsdfIntegrator::LabelTsdfIntegrator;
+  using LabelTsdfIntegrator::BlockVoxelsMap;
+  using LabelTsdfIntegrator::addVoxelLabelConfidence;
+  using LabelTsdfIntegrator::changeLabelCount;
+  using LabelTsdfIntegrator::getFreshLabel;
+  using LabelTsdfIntegrator::getSegmentVoxelsByBlock;
+  using LabelTsdfIntegrator::indexLabelBlock;
+  using LabelTsdfIntegrator::updateVoxelLabelAndConfidence;
+  using LabelTsdfIntegrator::updated_labels_;
+};
+
+}  // namespace
+
+class LabelTsdfIntegratorTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    label_tsdf_config_.enable_label_recycling = true;
+    label_tsdf_config_.label_recycling_min_frames = kRecyclingMinFrames;
+    // Labels are published in the frame their recycling is due.
+    label_tsdf_config_.max_segment_age = kRecyclingMinFrames - 1;
+
+    LabelTsdfMap::Config map_config;
+    map_config.voxel_size = 0.1f;
+    map_config.voxels_per_side = 8u;
+    map_.reset(new LabelTsdfMap(map_config));
+
+    TsdfIntegratorBase::Config tsdf_config;
+    tsdf_config.integrator_threads = 1u;
+    integrator_.reset(new TestLabelTsdfIntegrator(
+        tsdf_config, label_tsdf_config_, map_.get()));
+    *map_->getHighestLabelPtr() = kHighestLabel;
+  }
+
+  // Integrates an empty frame.
+  std::vector<Label> endFrame() {
+    std::vector<Label> labels_to_publish;
+    integrator_->getLabelsToPublish(&labels_to_publish);
+    return labels_to_publish;
+  }
+
+  // Lets the label win a voxel and lose it again in the current frame.
+  void killLabel(const Label label) {
+    integrator_->changeLabelCount(label, 1);
+    integrator_->changeLabelCount(label, -1);
+  }
+
+  static constexpr int kRecyclingMinFrames = 2;
+  static constexpr Label kHighestLabel = 10u;
+
+  LabelTsdfIntegrator::LabelTsdfConfig label_tsdf_config_;
+  std::unique_ptr<LabelTsdfMap> map_;
+  std::unique_ptr<TestLabelTsdfIntegrator> integrator_;
+};
+
+TEST_F(LabelTsdfIntegratorTest, ConfidencesSaturate) {
+  constexpr LabelConfidence kMaxConfidence =
+      std::numeric_limits<LabelConfidence>::max();
+  LabelVoxel voxel;
+  integrator_->addVoxelLabelConfidence(1u, kMaxConfidence - 10u, &voxel);
+  integrator_->addVoxelLabelConfidence(1u, 100u, &voxel);
+  integrator_->updateVoxelLabelAndConfidence(&voxel);
+  EXPECT_EQ(1u, voxel.label);
+  EXPECT_EQ(kMaxConfidence, voxel.label_confidence);
+}
+
+TEST_F(LabelTsdfIntegratorTest, EvictionInheritsSaturatedConfidence) {
+  constexpr LabelConfidence kMaxConfidence =
+      std::numeric_limits<LabelConfidence>::max();
+  LabelVoxel voxel;
+  for (size_t slot_idx = 0u; slot_idx < kNumLabelVoxelSlots; ++slot_idx) {
+    integrator_->addVoxelLabelConfidence(slot_idx + 1u, kMaxConfidence - 1u,
+                                         &voxel);
+  }
+  integrator_->addVoxelLabelConfidence(100u, 10u, &voxel);
+  for (const LabelCount& label_count : voxel.label_count) {
+    EXPECT_GE(label_count.label_confidence, kMaxConfidence - 1u);
+  }
+  EXPECT_EQ(100u, voxel.label_count[0].label);
+  EXPECT_EQ(kMaxConfidence, voxel.label_count[0].label_confidence);
+}
+
+TEST_F(LabelTsdfIntegratorTest, MajorityLabelSurvivesEvictionChurn) {
+  constexpr Label kMajorityLabel = 1u;
+  constexpr size_t kNumRounds = 1000u;
+  LabelVoxel voxel;
+  Label churn_label = 100u;
+  for (size_t round = 0u; round < kNumRounds; ++round) {
+    // The majority label is seen in half of the observations, every other
+    // observation is a label that is never seen again.
+    integrator_->addVoxelLabelConfidence(kMajorityLabel, 1u, &voxel);
+    integrator_->updateVoxelLabelAndConfidence(&voxel);
+    EXPECT_EQ(kMajorityLabel, voxel.label);
+    integrator_->addVoxelLabelConfidence(churn_label++, 1u, &voxel);
+    integrator_->updateVoxelLabelAndConfidence(&voxel, kMajorityLabel);
+    EXPECT_EQ(kMajorityLabel, voxel.label);
+  }
+  EXPECT_EQ(kNumRounds, voxel.label_confidence);
+}
+
+TEST_F(LabelTsdfIntegratorTest, RecyclesDeadLabelsAndRemovesTheirVotes) {
+  constexpr Label kDeadLabel = 5u;
+  Block<LabelVoxel>::Ptr label_block =
+      map_->getLabelLayerPtr()->allocateBlockPtrByIndex(BlockIndex::Zero());
+  LabelVoxel& voxel = label_block->getVoxelByLinearIndex(0u);
+  integrator_->addVoxelLabelConfidence(7u, 4u, &voxel);
+  integrator_->addVoxelLabelConfidence(kDeadLabel, 2u, &voxel);
+  integrator_->updateVoxelLabelAndConfidence(&voxel);
+  integrator_->indexLabelBlock(BlockIndex::Zero(), *label_block);
+  killLabel(kDeadLabel);
+
+  for (int frame = 1; frame < kRecyclingMinFrames; ++frame) {
+    endFrame();
+    EXPECT_EQ(voxel.label_count[1].label, kDeadLabel);
+  }
+  endFrame();
+  EXPECT_EQ(7u, voxel.label);
+  EXPECT_EQ(0u, voxel.label_count[1].label);
+  EXPECT_EQ(0u, voxel.label_count[1].label_confidence);
+
+  // The recycled label is issued before new ones.
+  EXPECT_EQ(kDeadLabel, integrator_->getFreshLabel());
+  EXPECT_EQ(kHighestLabel + 1u, integrator_->getFreshLabel());
+}
+
+TEST_F(LabelTsdfIntegratorTest, DecidesScrubbedVoxelsAgain) {
+  constexpr Label kDeadLabel = 5u;
+  constexpr Label kRunnerUpLabel = 7u;
+  Block<LabelVoxel>::Ptr label_block =
+      map_->getLabelLayerPtr()->allocateBlockPtrByIndex(BlockIndex::Zero());
+  LabelVoxel& voxel = label_block->getVoxelByLinearIndex(3u);
+  integrator_->addVoxelLabelConfidence(kRunnerUpLabel, 2u, &voxel);
+  integrator_->addVoxelLabelConfidence(kDeadLabel, 4u, &voxel);
+  integrator_->updateVoxelLabelAndConfidence(&voxel);
+  ASSERT_EQ(kDeadLabel, voxel.label);
+  integrator_->indexLabelBlock(BlockIndex::Zero(), *label_block);
+  killLabel(kDeadLabel);
+  label_block->updated() = false;
+
+  for (int frame = 0; frame < kRecyclingMinFrames; ++frame) {
+    endFrame();
+  }
+  EXPECT_EQ(kRunnerUpLabel, voxel.label);
+  EXPECT_EQ(2u, voxel.label_confidence);
+  EXPECT_TRUE(label_block->updated());
+  const LMap& label_count_map = *map_->getLabelCountPtr();
+  ASSERT_EQ(1u, label_count_map.count(kRunnerUpLabel));
+  EXPECT_EQ(1, label_count_map.at(kRunnerUpLabel));
+  EXPECT_EQ(0u, label_count_map.count(kDeadLabel));
+}
+
+TEST_F(LabelTsdfIntegratorTest, RecyclesLabelsThatNeverWonAVoxel) {
+  const Label unused_label = integrator_->getFreshLabel();
+  EXPECT_EQ(kHighestLabel + 1u, unused_label);
+  for (int frame = 1; frame < kRecyclingMinFrames; ++frame) {
+    endFrame();
+  }
+  EXPECT_EQ(kHighestLabel + 2u, integrator_->getFreshLabel());
+  endFrame();
+  EXPECT_EQ(unused_label, integrator_->getFreshLabel());
+}
+
+TEST_F(LabelTsdfIntegratorTest, DoesNotRecycleLabelsPublishedInTheSameFrame) {
+  constexpr Label kDeadLabel = 6u;
+  integrator_->updated_labels_.insert(kDeadLabel);
+  killLabel(kDeadLabel);
+  for (int frame = 1; frame < kRecyclingMinFrames; ++frame) {
+    endFrame();
+  }
+
+  const std::vector<Label> published_labels = endFrame();
+  ASSERT_EQ(1u, published_labels.size());
+  EXPECT_EQ(kDeadLabel, published_labels.front());
+  EXPECT_EQ(kHighestLabel + 1u, integrator_->getFreshLabel());
+
+  // Once published, it is recycled after the minimum number of frames.
+  for (int frame = 0; frame < kRecyclingMinFrames; ++frame) {
+    endFrame();
+  }
+  EXPECT_EQ(kDeadLabel, integrator_->getFreshLabel());
+}
+
+TEST_F(LabelTsdfIntegratorTest, DoesNotRecycleRevivedLabels) {
+  constexpr Label kRevivedLabel = 3u;
+  killLabel(kRevivedLabel);
+  endFrame();
+  integrator_->changeLabelCount(kRevivedLabel, 1);
+  for (int frame = 0; frame < 2 * kRecyclingMinFrames; ++frame) {
+    endFrame();
+  }
+  EXPECT_EQ(kHighestLabel + 1u, integrator_->getFreshLabel());
+
+  // It is recycled once it dies again.
+  integrator_->changeLabelCount(kRevivedLabel, -1);
+  for (int frame = 0; frame < kRecyclingMinFrames; ++frame) {
+    endFrame();
+  }
+  EXPECT_EQ(kRevivedLabel, integrator_->getFreshLabel());
+}
+
+class LabelAssignmentTest : public LabelTsdfIntegratorTest {
+ protected:
+  virtual void SetUp() {
+    // Small counts, so that many pairs are eligible and counts tie often.
+    label_tsdf_config_.min_label_voxel_count = 2u;
+    LabelTsdfIntegratorTest::SetUp();
+    for (int x = 0; x < kNumBlocksPerSide; ++x) {
+      for (int y = 0; y < kNumBlocksPerSide; ++y) {
+        for (int z = 0; z < kNumBlocksPerSide; ++z) {
+          const BlockIndex block_idx(x, y, z);
+          map_->getTsdfLayerPtr()->allocateBlockPtrByIndex(block_idx);
+          map_->getLabelLayerPtr()->allocateBlockPtrByIndex(block_idx);
+        }
+      }
+    }
+  }
+
+  LabelVoxel* getVoxel(const GlobalIndex& global_voxel_idx) {
+    const int voxels_per_side = map_->getLabelLayerPtr()->voxels_per_side();
+    const BlockIndex block_idx =
+        (global_voxel_idx / voxels_per_side).cast<IndexElement>();
+    const VoxelIndex voxel_idx =
+        (global_voxel_idx - block_idx.cast<LongIndexElement>() *
+                                voxels_per_side).cast<IndexElement>();
+    return &map_->getLabelLayerPtr()
+                ->getBlockByIndex(block_idx)
+                .getVoxelByVoxelIndex(voxel_idx);
+  }
+
+  void addVoxelLabel(const GlobalIndex& global_voxel_idx, const Label label,
+                     const LabelConfidence confidence) {
+    LabelVoxel* voxel = getVoxel(global_voxel_idx);
+    integrator_->addVoxelLabelConfidence(label, confidence, voxel);
+    integrator_->updateVoxelLabelAndConfidence(voxel);
+  }
+
+  // Adds num_points points at the center of the voxel to the segment.
+  void addPoints(const GlobalIndex& global_voxel_idx, const size_t num_points,
+                 Segment* segment) {
+    const Point point = (global_voxel_idx.cast<FloatingPoint>() +
+                         Point::Constant(0.5f)) *
+                        map_->getTsdfLayerPtr()->voxel_size();
+    for (size_t point_idx = 0u; point_idx < num_points; ++point_idx) {
+      segment->points_C_.push_back(point);
+      segment->colors_.push_back(Color());
+    }
+  }
+
+  // Assigns the labels with decideLabelPointClouds().
+  std::map<Segment*, Label> assignLabels(std::vector<Segment*> segments) {
+    std::map<Label, std::map<Segment*, size_t>> candidates;
+    std::map<Segment*, std::vector<Label>> segment_merge_candidates;
+    integrator_->computeFrameLabelCandidates(segments, &candidates,
+                                             &segment_merge_candidates);
+    integrator_->decideLabelPointClouds(&segments, &candidates,
+                                        &segment_merge_candidates);
+    std::map<Segment*, Label> segment_labels;
+    for (Segment* segment : segments) {
+      segment_labels[segment] = segment->label_;
+    }
+    return segment_labels;
+  }
+
+  // Assigns the labels like decideLabelPointClouds() did before the heap:
+  // every pair is found by scanning all candidates for the largest count,
+  // so ties go to the smaller label and then to the smaller segment.
+  std::map<Segment*, Label> assignLabelsByScan(
+      const std::vector<Segment*>& segments) {
+    std::map<Label, std::map<Segment*, size_t>> candidates;
+    std::map<Segment*, std::vector<Label>> segment_merge_candidates;
+    for (Segment* segment : segments) {
+      integrator_->computeSegmentLabelCandidates(segment, &candidates,
+                                                 &segment_merge_candidates);
+    }
+
+    LabelSet assigned_labels;
+    std::map<Segment*, Label> segment_labels;
+    while (true) {
+      size_t max_count = 0u;
+      Label max_label = 0u;
+      Segment* max_segment = nullptr;
+      for (const auto& label_segments : candidates) {
+        for (const std::pair<Segment* const, size_t>& segment_count :
+             label_segments.second) {
+          if (segment_count.second > max_count &&
+              segment_count.second > label_tsdf_config_.min_label_voxel_count &&
+              segment_labels.count(segment_count.first) == 0u) {
+            max_count = segment_count.second;
+            max_label = label_segments.first;
+            max_segment = segment_count.first;
+          }
+        }
+      }
+      if (max_segment == nullptr) {
+        break;
+      }
+      segment_labels[max_segment] = max_label;
+      assigned_labels.insert(max_label);
+
+      const std::map<Segment*, size_t> segments_to_recompute =
+          candidates[max_label];
+      for (const std::pair<Segment* const, size_t>& segment_count :
+           segments_to_recompute) {
+        if (segment_count.first == max_segment) {
+          continue;
+        }
+        for (auto& label_segments : candidates) {
+          if (label_segments.first != max_label) {
+            label_segments.second.erase(segment_count.first);
+          }
+        }
+        integrator_->computeSegmentLabelCandidates(
+            segment_count.first, &candidates, &segment_merge_candidates,
+            assigned_labels);
+      }
+      candidates.erase(max_label);
+    }
+
+    for (Segment* segment : segments) {
+      if (segment_labels.count(segment) == 0u) {
+        segment_labels[segment] = integrator_->getFreshLabel();
+      }
+    }
+    return segment_labels;
+  }
+
+  // Both assignments start from the same highest label, so that they hand
+  // out the same fresh labels.
+  void expectSameAssignment(const std::vector<Segment*>& segments) {
+    const Label highest_label = *map_->getHighestLabelPtr();
+    const std::map<Segment*, Label> expected_labels =
+        assignLabelsByScan(segments);
+    *map_->getHighestLabelPtr() = highest_label;
+    const std::map<Segment*, Label> labels = assignLabels(segments);
+    EXPECT_EQ(expected_labels, labels);
+  }
+
+  static constexpr int kNumBlocksPerSide = 2;
+};
+
+TEST_F(LabelAssignmentTest, TiesGoToTheSmallerLabelAndSegment) {
+  constexpr Label kFirstLabel = 1u;
+  constexpr Label kSecondLabel = 2u;
+  const GlobalIndex first_voxel_idx(1, 1, 1);
+  const GlobalIndex second_voxel_idx(2, 1, 1);
+  addVoxelLabel(first_voxel_idx, kFirstLabel, 2u);
+  addVoxelLabel(first_voxel_idx, kSecondLabel, 1u);
+  addVoxelLabel(second_voxel_idx, kSecondLabel, 2u);
+  addVoxelLabel(second_voxel_idx, kFirstLabel, 1u);
+
+  // Two identical segments that vote the same count for both labels.
+  std::vector<std::unique_ptr<Segment>> segments;
+  for (size_t segment_idx = 0u; segment_idx < 2u; ++segment_idx) {
+    segments.emplace_back(new Segment(Transformation()));
+    addPoints(first_voxel_idx, 5u, segments.back().get());
+    addPoints(second_voxel_idx, 5u, segments.back().get());
+  }
+  Segment* first_segment = std::min(segments[0].get(), segments[1].get());
+  Segment* second_segment = std::max(segments[0].get(), segments[1].get());
+
+  // The larger segment pointer comes first in the frame.
+  const std::vector<Segment*> frame_segments = {second_segment,
+                                                first_segment};
+  expectSameAssignment(frame_segments);
+  assignLabels(frame_segments);
+  EXPECT_EQ(kFirstLabel, first_segment->label_);
+  EXPECT_EQ(kSecondLabel, second_segment->label_);
+}
+
+TEST_F(LabelAssignmentTest, HeapMatchesScanOnClutteredFrames) {
+  constexpr size_t kNumFrames = 20u;
+  constexpr size_t kNumSegments = 40u;
+  constexpr Label kNumLabels = 8u;
+  const int kNumVoxelsPerSide =
+      kNumBlocksPerSide * map_->getLabelLayerPtr()->voxels_per_side();
+  std::mt19937 random_engine(42u);
+  std::uniform_int_distribution<int> voxel_distribution(
+      0, kNumVoxelsPerSide - 1);
+  std::uniform_int_distribution<Label> label_distribution(1u, kNumLabels);
+  std::uniform_int_distribution<int> count_distribution(1, 3);
+
+  for (int x = 0; x < kNumVoxelsPerSide; ++x) {
+    for (int y = 0; y < kNumVoxelsPerSide; ++y) {
+      for (int z = 0; z < kNumVoxelsPerSide; ++z) {
+        const int num_labels = count_distribution(random_engine);
+        for (int label_idx = 0; label_idx < num_labels; ++label_idx) {
+          addVoxelLabel(GlobalIndex(x, y, z),
+                        label_distribution(random_engine),
+                        count_distribution(random_engine));
+        }
+      }
+    }
+  }
+
+  size_t num_propagated_labels = 0u;
+  for (size_t frame = 0u; frame < kNumFrames; ++frame) {
+    // Segments are small overlapping patches, some of them duplicated, so
+    // that they compete for the same labels with the same counts.
+    std::vector<std::unique_ptr<Segment>> segments;
+    for (size_t segment_idx = 0u; segment_idx < kNumSegments;
+         ++segment_idx) {
+      segments.emplace_back(new Segment(Transformation()));
+      if (segment_idx % 4u == 3u) {
+        segments.back()->points_C_ = segments[segment_idx - 1u]->points_C_;
+        segments.back()->colors_ = segments[segment_idx - 1u]->colors_;
+        continue;
+      }
+      const GlobalIndex center_idx(voxel_distribution(random_engine),
+                                   voxel_distribution(random_engine),
+                                   voxel_distribution(random_engine));
+      for (int dx = -1; dx <= 1; ++dx) {
+        for (int dy = -1; dy <= 1; ++dy) {
+          const GlobalIndex voxel_idx = center_idx + GlobalIndex(dx, dy, 0);
+          if ((voxel_idx.array() >= 0).all() &&
+              (voxel_idx.array() < kNumVoxelsPerSide).all()) {
+            addPoints(voxel_idx, count_distribution(random_engine),
+                      segments.back().get());
+          }
+        }
+      }
+    }
+    std::vector<Segment*> frame_segments;
+    for (const std::unique_ptr<Segment>& segment : segments) {
+      frame_segments.push_back(segment.get());
+    }
+    std::shuffle(frame_segments.begin(), frame_segments.end(),
+                 random_engine);
+    expectSameAssignment(frame_segments);
+    for (const Segment* segment : frame_segments) {
+      if (segment->label_ <= kNumLabels) {
+        ++num_propagated_labels;
+      }
+    }
+  }
+  // Most labels of the map are assigned in every frame.
+  EXPECT_GT(num_propagated_labels, kNumFrames * kNumLabels / 2u);
+}
+
+TEST_F(LabelTsdfIntegratorTest, SkipsRecycledLabelsThatWonVoxelsBack) {
+  constexpr Label kDeadLabel = 4u;
+  killLabel(kDeadLabel);
+  for (int frame = 0; frame < kRecyclingMinFrames; ++frame) {
+    endFrame();
+  }
+  integrator_->changeLabelCount(kDeadLabel, 1);
+  EXPECT_EQ(kHighestLabel + 1u, integrator_->getFreshLabel());
+}
+
+TEST_F(LabelTsdfIntegratorTest, PreprocessedVoxelsMatchPointByPoint) {
+  // Points on voxel and block boundaries, where rounding decides the voxel.
+  Segment segment{Transformation()};
+  for (int i = -20; i <= 20; ++i) {
+    segment.points_C_.push_back(Point(i * 0.1f, i * 0.3f, -i * 0.8f));
+    segment.colors_.push_back(Color());
+  }
+  TestLabelTsdfIntegrator::BlockVoxelsMap expected_block_voxels;
+  integrator_->getSegmentVoxelsByBlock(segment, &expected_block_voxels);
+
+  integrator_->preprocessFrame({&segment});
+  TestLabelTsdfIntegrator::BlockVoxelsMap block_voxels;
+  integrator_->getSegmentVoxelsByBlock(segment, &block_voxels);
+  ASSERT_EQ(expected_block_voxels.size(), block_voxels.size());
+  for (const auto& block_voxels_pair : expected_block_voxels) {
+    auto it = block_voxels.find(block_voxels_pair.first);
+    ASSERT_TRUE(it != block_voxels.end());
+    EXPECT_TRUE(block_voxels_pair.second == it->second);
+  }
+}
+
+class RayIntegrationTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    map_config_.voxel_size = 0.05f;
+    map_config_.voxels_per_side = 8u;
+
+    // Without carving every voxel only sees the rays ending close to it, so
+    // that it collects fewer labels than it has slots and the label votes
+    // do not depend on the order of the updates.
+    tsdf_config_.voxel_carving_enabled = false;
+    tsdf_config_.default_truncation_distance = 4.0f * map_config_.voxel_size;
+    tsdf_config_.max_ray_length_m = 3.0f;
+  }
+
+  // Integrates the same frames into a new map and returns it.
+  std::unique_ptr<LabelTsdfMap> integrateFrames(
+      const TsdfIntegratorBase::Config& tsdf_config,
+      const LabelTsdfIntegrator::LabelTsdfConfig& label_tsdf_config) {
+    std::unique_ptr<LabelTsdfMap> map(new LabelTsdfMap(map_config_));
+    LabelTsdfIntegrator integrator(tsdf_config, label_tsdf_config, map.get());
+    for (size_t frame = 0u; frame < kNumFrames; ++frame) {
+      Transformation T_G_C;
+      T_G_C.getPosition() = Point(0.02f * frame, -0.03f * frame, 0.0f);
+      Pointcloud points_C;
+      Colors colors;
+      Labels labels;
+      getFramePoints(&points_C, &colors, &labels);
+      integrator.integratePointCloud(T_G_C, points_C, colors, labels, false);
+    }
+    return map;
+  }
+
+  // A wall split into vertical stripes with one label each, a box in front
+  // of one stripe and a few points beyond the maximum ray length.
+  void getFramePoints(Pointcloud* points_C, Colors* colors,
+                      Labels* labels) const {
+    constexpr int kNumSteps = 60;
+    constexpr FloatingPoint kWallDepth = 2.0f;
+    constexpr FloatingPoint kBoxDepth = 1.3f;
+    constexpr FloatingPoint kStep = 0.02f;
+    for (int u = -kNumSteps; u < kNumSteps; ++u) {
+      for (int v = -kNumSteps; v < kNumSteps; ++v) {
+        const FloatingPoint x = kStep * (u + 0.5f);
+        const FloatingPoint y = kStep * (v + 0.5f);
+        const bool in_box = std::abs(x - 0.25f) < 0.15f && std::abs(y) < 0.15f;
+        const bool is_far = u == v;
+        const FloatingPoint depth =
+            is_far ? 2.0f * tsdf_config_.max_ray_length_m
+                   : (in_box ? kBoxDepth : kWallDepth);
+        points_C->push_back(Point(x, y, 1.0f) * depth);
+        colors->push_back(Color::Gray());
+        labels->push_back(in_box ? kBoxLabel
+                                 : static_cast<Label>(
+                                       std::floor(x / kStripeWidth) + 10));
+      }
+    }
+  }
+
+  static constexpr size_t kNumFrames = 5u;
+  static constexpr Label kBoxLabel = 1u;
+  static constexpr FloatingPoint kStripeWidth = 0.5f;
+
+  LabelTsdfMap::Config map_config_;
+  TsdfIntegratorBase::Config tsdf_config_;
+  LabelTsdfIntegrator::LabelTsdfConfig label_tsdf_config_;
+};
+
+// The confidence the voxel holds for the label, 0 if it holds none.
+LabelConfidence getLabelConfidence(const LabelVoxel& voxel,
+                                   const Label label) {
+  for (const LabelCount& label_count : voxel.label_count) {
+    if (label_count.label == label) {
+      return label_count.label_confidence;
+    }
+  }
+  return 0u;
+}
+
+// Whether no other label of the voxel is as confident as its label.
+bool hasUniqueLabel(const LabelVoxel& voxel) {
+  for (const LabelCount& label_count : voxel.label_count) {
+    if (label_count.label != voxel.label &&
+        label_count.label_confidence == voxel.label_confidence) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Compares the voxels of both maps up to the order of the updates. The
+// distance is clamped to the truncation distance after every update, so
+// towards the ends of the band it depends on the order. Labels that tie on
+// confidence are decided by the slot order.
+void expectSameLayers(const LabelTsdfMap& expected_map,
+                      const LabelTsdfMap& map,
+                      const FloatingPoint truncation_distance,
+                      const bool same_order) {
+  const float distance_tolerance = same_order ? 0.0f : 1e-4f;
+  const float band_end_distance_tolerance =
+      same_order ? 0.0f : 0.1f * truncation_distance;
+  const float weight_tolerance = same_order ? 0.0f : 1e-4f;
+  const Layer<TsdfVoxel>& expected_tsdf_layer = expected_map.getTsdfLayer();
+  const Layer<LabelVoxel>& expected_label_layer =
+      expected_map.getLabelLayer();
+  ASSERT_EQ(expected_tsdf_layer.getNumberOfAllocatedBlocks(),
+            map.getTsdfLayer().getNumberOfAllocatedBlocks());
+  ASSERT_EQ(expected_label_layer.getNumberOfAllocatedBlocks(),
+            map.getLabelLayer().getNumberOfAllocatedBlocks());
+
+  BlockIndexList block_indices;
+  expected_tsdf_layer.getAllAllocatedBlocks(&block_indices);
+  size_t num_labelled_voxels = 0u;
+  for (const BlockIndex& block_idx : block_indices) {
+    ASSERT_TRUE(map.getTsdfLayer().hasBlock(block_idx));
+    ASSERT_TRUE(map.getLabelLayer().hasBlock(block_idx));
+    const Block<TsdfVoxel>& expected_tsdf_block =
+        expected_tsdf_layer.getBlockByIndex(block_idx);
+    const Block<TsdfVoxel>& tsdf_block =
+        map.getTsdfLayer().getBlockByIndex(block_idx);
+    const Block<LabelVoxel>& expected_label_block =
+        expected_label_layer.getBlockByIndex(block_idx);
+    const Block<LabelVoxel>& label_block =
+        map.getLabelLayer().getBlockByIndex(block_idx);
+    for (size_t linear_idx = 0u; linear_idx < tsdf_block.num_voxels();
+         ++linear_idx) {
+      const TsdfVoxel& expected_tsdf_voxel =
+          expected_tsdf_block.getVoxelByLinearIndex(linear_idx);
+      const TsdfVoxel& tsdf_voxel =
+          tsdf_block.getVoxelByLinearIndex(linear_idx);
+      const bool is_band_end = std::abs(expected_tsdf_voxel.distance) >
+                               0.5f * truncation_distance;
+      EXPECT_NEAR(expected_tsdf_voxel.distance, tsdf_voxel.distance,
+                  is_band_end ? band_end_distance_tolerance
+                              : distance_tolerance);
+      EXPECT_NEAR(expected_tsdf_voxel.weight, tsdf_voxel.weight,
+                  weight_tolerance * expected_tsdf_voxel.weight);
+
+      const LabelVoxel& expected_label_voxel =
+          expected_label_block.getVoxelByLinearIndex(linear_idx);
+      const LabelVoxel& label_voxel =
+          label_block.getVoxelByLinearIndex(linear_idx);
+      if (same_order || hasUniqueLabel(expected_label_voxel)) {
+        EXPECT_EQ(expected_label_voxel.label, label_voxel.label);
+      }
+      EXPECT_EQ(expected_label_voxel.label_confidence,
+                label_voxel.label_confidence);
+      for (const LabelCount& label_count : expected_label_voxel.label_count) {
+        EXPECT_EQ(label_count.label_confidence,
+                  getLabelConfidence(label_voxel, label_count.label));
+      }
+      if (expected_label_voxel.label != 0u) {
+        ++num_labelled_voxels;
+      }
+    }
+  }
+  EXPECT_GT(num_labelled_voxels, 0u);
+}
+
+// Expects both layers of the map to be views of its combined blocks.
+void expectCombinedBlocks(const LabelTsdfMap& map) {
+  const Layer<TsdfVoxel>& tsdf_layer = map.getTsdfLayer();
+  const Layer<LabelVoxel>& label_layer = map.getLabelLayer();
+  EXPECT_GT(map.getNumberOfCombinedBlocks(), 0u);
+  EXPECT_EQ(map.getNumberOfCombinedBlocks(),
+            tsdf_layer.getNumberOfAllocatedBlocks());
+  EXPECT_EQ(map.getNumberOfCombinedBlocks(),
+            label_layer.getNumberOfAllocatedBlocks());
+  BlockIndexList block_indices;
+  tsdf_layer.getAllAllocatedBlocks(&block_indices);
+  for (const BlockIndex& block_idx : block_indices) {
+    const LabelTsdfMap::CombinedBlock* combined_block =
+        map.getCombinedBlockPtrByIndex(block_idx);
+    ASSERT_TRUE(combined_block != nullptr);
+    EXPECT_EQ(tsdf_layer.getBlockPtrByIndex(block_idx).get(),
+              combined_block->tsdf_block.get());
+    EXPECT_EQ(label_layer.getBlockPtrByIndex(block_idx).get(),
+              combined_block->label_block.get());
+  }
+}
+
+TEST_F(RayIntegrationTest, StripedIntegrationMatchesSingleThreaded) {
+  TsdfIntegratorBase::Config single_threaded_tsdf_config = tsdf_config_;
+  single_threaded_tsdf_config.integrator_threads = 1u;
+  const std::unique_ptr<LabelTsdfMap> expected_map =
+      integrateFrames(single_threaded_tsdf_config, label_tsdf_config_);
+
+  // All surface rays are integrated before the clearing rays, so only the
+  // order of the updates within each pass differs.
+  TsdfIntegratorBase::Config striped_tsdf_config = tsdf_config_;
+  striped_tsdf_config.integrator_threads = 4u;
+  const std::unique_ptr<LabelTsdfMap> map =
+      integrateFrames(striped_tsdf_config, label_tsdf_config_);
+  expectSameLayers(*expected_map, *map,
+                   tsdf_config_.default_truncation_distance, false);
+}
+
+TEST_F(RayIntegrationTest, PartitionedIntegrationMatchesStriped) {
+  TsdfIntegratorBase::Config striped_tsdf_config = tsdf_config_;
+  striped_tsdf_config.integrator_threads = 1u;
+  const std::unique_ptr<LabelTsdfMap> expected_map =
+      integrateFrames(striped_tsdf_config, label_tsdf_config_);
+
+  TsdfIntegratorBase::Config partitioned_tsdf_config = tsdf_config_;
+  partitioned_tsdf_config.integrator_threads = 4u;
+  LabelTsdfIntegrator::LabelTsdfConfig partitioned_label_tsdf_config =
+      label_tsdf_config_;
+  partitioned_label_tsdf_config.enable_spatially_partitioned_integration =
+      true;
+  // Small regions, so that rays cross many of them.
+  partitioned_label_tsdf_config.partition_region_size_blocks = 1;
+  const std::unique_ptr<LabelTsdfMap> map = integrateFrames(
+      partitioned_tsdf_config, partitioned_label_tsdf_config);
+  const FloatingPoint truncation_distance =
+      tsdf_config_.default_truncation_distance;
+  expectSameLayers(*expected_map, *map, truncation_distance, false);
+
+  // The partitioned update order does not depend on the scheduling.
+  const std::unique_ptr<LabelTsdfMap> repeated_map = integrateFrames(
+      partitioned_tsdf_config, partitioned_label_tsdf_config);
+  expectSameLayers(*map, *repeated_map, truncation_distance, true);
+
+  partitioned_label_tsdf_config.enable_batch_ray_casting = true;
+  const std::unique_ptr<LabelTsdfMap> batch_map = integrateFrames(
+      partitioned_tsdf_config, partitioned_label_tsdf_config);
+  expectSameLayers(*expected_map, *batch_map, truncation_distance, false);
+}
+
+TEST_F(RayIntegrationTest, WritesToPackedLabelBlocks) {
+  TsdfIntegratorBase::Config tsdf_config = tsdf_config_;
+  tsdf_config.integrator_threads = 1u;
+  // The label layer of the expected map goes through the compact encoding
+  // after every frame, the one of the other map is packed.
+  std::unique_ptr<LabelTsdfMap> expected_map(new LabelTsdfMap(map_config_));
+  LabelTsdfIntegrator expected_integrator(tsdf_config, label_tsdf_config_,
+                                          expected_map.get());
+  LabelTsdfMap::Config packed_map_config = map_config_;
+  packed_map_config.inactive_label_block_encoding = LabelTsdfMap::kCompact;
+  std::unique_ptr<LabelTsdfMap> map(new LabelTsdfMap(packed_map_config));
+  LabelTsdfIntegrator integrator(tsdf_config, label_tsdf_config_, map.get());
+
+  Layer<CompactLabelVoxel> compact_label_layer(map_config_.voxel_size,
+                                               map_config_.voxels_per_side);
+  for (size_t frame = 0u; frame < kNumFrames; ++frame) {
+    Transformation T_G_C;
+    T_G_C.getPosition() = Point(0.02f * frame, -0.03f * frame, 0.0f);
+    Pointcloud points_C;
+    Colors colors;
+    Labels labels;
+    getFramePoints(&points_C, &colors, &labels);
+    expected_integrator.integratePointCloud(T_G_C, points_C, colors, labels,
+                                            false);
+    compressLabelLayer(expected_map->getLabelLayer(), &compact_label_layer);
+    decompressLabelLayer(compact_label_layer,
+                         expected_map->getLabelLayerPtr());
+
+    integrator.integratePointCloud(T_G_C, points_C, colors, labels, false);
+    // Without active blocks all label blocks are inactive.
+    integrator.clearActiveBlocks();
+    EXPECT_EQ(0u, map->getLabelLayer().getNumberOfAllocatedBlocks());
+    EXPECT_EQ(expected_map->getLabelLayer().getNumberOfAllocatedBlocks(),
+              map->getNumberOfPackedLabelBlocks());
+  }
+  EXPECT_EQ(*expected_map->getLabelCountPtr(), *map->getLabelCountPtr());
+
+  BlockIndexList block_indices;
+  map->getAllLabelBlockIndices(&block_indices);
+  for (const BlockIndex& block_idx : block_indices) {
+    map->unpackLabelBlock(block_idx);
+  }
+  expectSameLayers(*expected_map, *map,
+                   tsdf_config_.default_truncation_distance, true);
+}
+
+TEST_F(RayIntegrationTest, WritesToSparseLabelBlocks) {
+  TsdfIntegratorBase::Config tsdf_config = tsdf_config_;
+  tsdf_config.integrator_threads = 1u;
+  const std::unique_ptr<LabelTsdfMap> expected_map =
+      integrateFrames(tsdf_config, label_tsdf_config_);
+
+  // The sparse encoding is lossless, so packing the label blocks after every
+  // frame does not change the map.
+  LabelTsdfMap::Config packed_map_config = map_config_;
+  packed_map_config.inactive_label_block_encoding = LabelTsdfMap::kSparse;
+  std::unique_ptr<LabelTsdfMap> map(new LabelTsdfMap(packed_map_config));
+  LabelTsdfIntegrator integrator(tsdf_config, label_tsdf_config_, map.get());
+  for (size_t frame = 0u; frame < kNumFrames; ++frame) {
+    Transformation T_G_C;
+    T_G_C.getPosition() = Point(0.02f * frame, -0.03f * frame, 0.0f);
+    Pointcloud points_C;
+    Colors colors;
+    Labels labels;
+    getFramePoints(&points_C, &colors, &labels);
+    integrator.integratePointCloud(T_G_C, points_C, colors, labels, false);
+    integrator.clearActiveBlocks();
+    EXPECT_EQ(0u, map->getLabelLayer().getNumberOfAllocatedBlocks());
+  }
+  EXPECT_EQ(*expected_map->getLabelCountPtr(), *map->getLabelCountPtr());
+  EXPECT_LT(map->getPackedLabelBlocksMemorySize(),
+            expected_map->getLabelLayer().getMemorySize());
+
+  BlockIndexList block_indices;
+  map->getAllLabelBlockIndices(&block_indices);
+  for (const BlockIndex& block_idx : block_indices) {
+    map->unpackLabelBlock(block_idx);
+  }
+  expectSameLayers(*expected_map, *map,
+                   tsdf_config_.default_truncation_distance, true);
+}
+
+TEST_F(RayIntegrationTest, CombinedBlocksMatchSeparateLayers) {
+  TsdfIntegratorBase::Config tsdf_config = tsdf_config_;
+  tsdf_config.integrator_threads = 1u;
+  const std::unique_ptr<LabelTsdfMap> expected_map =
+      integrateFrames(tsdf_config, label_tsdf_config_);
+
+  // Without a label band every tsdf voxel gets a label voxel, so both
+  // storage modes allocate the same blocks.
+  LabelTsdfMap::Config combined_map_config = map_config_;
+  combined_map_config.use_combined_blocks = true;
+  std::unique_ptr<LabelTsdfMap> map(new LabelTsdfMap(combined_map_config));
+  LabelTsdfIntegrator integrator(tsdf_config, label_tsdf_config_, map.get());
+  for (size_t frame = 0u; frame < kNumFrames; ++frame) {
+    Transformation T_G_C;
+    T_G_C.getPosition() = Point(0.02f * frame, -0.03f * frame, 0.0f);
+    Pointcloud points_C;
+    Colors colors;
+    Labels labels;
+    getFramePoints(&points_C, &colors, &labels);
+    integrator.integratePointCloud(T_G_C, points_C, colors, labels, false);
+    expectCombinedBlocks(*map);
+  }
+  EXPECT_EQ(*expected_map->getLabelCountPtr(), *map->getLabelCountPtr());
+  expectSameLayers(*expected_map, *map,
+                   tsdf_config_.default_truncation_distance, true);
+
+  // The loaded blocks are combined again.
+  const std::string file_path = ::testing::TempDir() + "combined_map.gsm";
+  ASSERT_TRUE(map->saveToFile(file_path));
+  LabelTsdfMap loaded_map(combined_map_config);
+  ASSERT_TRUE(loaded_map.loadFromFile(file_path));
+  std::remove(file_path.c_str());
+  expectCombinedBlocks(loaded_map);
+  EXPECT_EQ(map->getNumberOfCombinedBlocks(),
+            loaded_map.getNumberOfCombinedBlocks());
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+
+  int result = RUN_ALL_TESTS();
+
+  return result;
+}
@@ -0,0 +1,182 @@
+#include <cstdio>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "global_segment_map/label_tsdf_map.h"
+#include "global_segment_map/utils/sparse_label_block.h"
+
+using namespace voxblox;  // NOLINT
+
+class SparseLabelBlockTest : public ::testing::Test {
+ protected:
+  static constexpr FloatingPoint kVoxelSize = 0.1f;
+  static constexpr size_t kVoxelsPerSide = 8u;
+
+  static void setLabel(const Label label, const LabelConfidence confidence,
+                       LabelVoxel* voxel) {
+    voxel->label = label;
+    voxel->label_confidence = confidence;
+    voxel->label_count[0].label = label;
+    voxel->label_count[0].label_confidence = confidence;
+  }
+
+  static void expectSameVoxel(const LabelVoxel& expected_voxel,
+                              const LabelVoxel& voxel) {
+    EXPECT_EQ(expected_voxel.label, voxel.label);
+    EXPECT_EQ(expected_voxel.label_confidence, voxel.label_confidence);
+    for (size_t slot_idx = 0u; slot_idx < kNumLabelVoxelSlots; ++slot_idx) {
+      EXPECT_EQ(expected_voxel.label_count[slot_idx].label,
+                voxel.label_count[slot_idx].label);
+      EXPECT_EQ(expected_voxel.label_count[slot_idx].label_confidence,
+                voxel.label_count[slot_idx].label_confidence);
+    }
+  }
+};
+
+TEST_F(SparseLabelBlockTest, ReadsDenseBlockVoxels) {
+  Block<LabelVoxel> block(kVoxelsPerSide, kVoxelSize, Point::Zero());
+  // Labelled voxels in the first and last bitmask words and in between.
+  for (const size_t linear_idx : {0u, 1u, 63u, 64u, 200u, 511u}) {
+    setLabel(linear_idx + 1u, 2u, &block.getVoxelByLinearIndex(linear_idx));
+  }
+
+  SparseLabelBlock sparse_block(block);
+  EXPECT_EQ(block.num_voxels(), sparse_block.num_voxels());
+  EXPECT_EQ(6u, sparse_block.num_labelled_voxels());
+  EXPECT_LT(sparse_block.getMemorySize(),
+            block.num_voxels() * sizeof(LabelVoxel));
+  for (size_t linear_idx = 0u; linear_idx < block.num_voxels();
+       ++linear_idx) {
+    expectSameVoxel(block.getVoxelByLinearIndex(linear_idx),
+                    sparse_block.getVoxelByLinearIndex(linear_idx));
+  }
+}
+
+TEST_F(SparseLabelBlockTest, InsertsOutOfOrder) {
+  Block<LabelVoxel> expected_block(kVoxelsPerSide, kVoxelSize, Point::Zero());
+  SparseLabelBlock sparse_block(expected_block.num_voxels());
+  for (const size_t linear_idx : {300u, 5u, 511u, 64u, 6u, 63u, 0u}) {
+    LabelVoxel& voxel = sparse_block.getOrInsertVoxelByLinearIndex(linear_idx);
+    EXPECT_EQ(0u, voxel.label);
+    setLabel(linear_idx + 1u, 3u, &voxel);
+    setLabel(linear_idx + 1u, 3u,
+             &expected_block.getVoxelByLinearIndex(linear_idx));
+  }
+  // Writing an inserted voxel again does not insert it twice.
+  setLabel(7u, 9u, &sparse_block.getOrInsertVoxelByLinearIndex(5u));
+  setLabel(7u, 9u, &expected_block.getVoxelByLinearIndex(5u));
+  EXPECT_EQ(7u, sparse_block.num_labelled_voxels());
+
+  for (size_t linear_idx = 0u; linear_idx < expected_block.num_voxels();
+       ++linear_idx) {
+    EXPECT_EQ(expected_block.getVoxelByLinearIndex(linear_idx).label != 0u,
+              sparse_block.isLabelled(linear_idx));
+    expectSameVoxel(expected_block.getVoxelByLinearIndex(linear_idx),
+                    sparse_block.getVoxelByLinearIndex(linear_idx));
+  }
+
+  Block<LabelVoxel> dense_block(kVoxelsPerSide, kVoxelSize, Point::Zero());
+  sparse_block.getDenseBlock(&dense_block);
+  for (size_t linear_idx = 0u; linear_idx < expected_block.num_voxels();
+       ++linear_idx) {
+    expectSameVoxel(expected_block.getVoxelByLinearIndex(linear_idx),
+                    dense_block.getVoxelByLinearIndex(linear_idx));
+  }
+}
+
+TEST_F(SparseLabelBlockTest, LayerRoundTrip) {
+  Layer<LabelVoxel> layer(kVoxelSize, kVoxelsPerSide);
+  Block<LabelVoxel>::Ptr block =
+      layer.allocateBlockPtrByIndex(BlockIndex(-1, 0, 4));
+  setLabel(4u, 1u, &block->getVoxelByLinearIndex(100u));
+  layer.allocateBlockPtrByIndex(BlockIndex(2, 2, 2));
+
+  SparseLabelBlockMap sparse_blocks;
+  sparsifyLabelLayer(layer, &sparse_blocks);
+  EXPECT_EQ(2u, sparse_blocks.size());
+  EXPECT_EQ(0u, sparse_blocks.at(BlockIndex(2, 2, 2))->num_labelled_voxels());
+
+  Layer<LabelVoxel> dense_layer(kVoxelSize, kVoxelsPerSide);
+  densifyLabelLayer(sparse_blocks, &dense_layer);
+  EXPECT_EQ(2u, dense_layer.getNumberOfAllocatedBlocks());
+  const Block<LabelVoxel>& dense_block =
+      dense_layer.getBlockByIndex(BlockIndex(-1, 0, 4));
+  EXPECT_EQ(4u, dense_block.getVoxelByLinearIndex(100u).label);
+  EXPECT_EQ(0u, dense_block.getVoxelByLinearIndex(101u).label);
+}
+
+TEST_F(SparseLabelBlockTest, MapPacksLabelBlocksAndDensifiesThemOnAccess) {
+  LabelTsdfMap::Config config;
+  config.voxel_size = kVoxelSize;
+  config.voxels_per_side = kVoxelsPerSide;
+  config.inactive_label_block_encoding = LabelTsdfMap::kSparse;
+  LabelTsdfMap map(config);
+
+  const BlockIndex block_idx(-2, 1, 0);
+  map.getTsdfLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  Block<LabelVoxel>::Ptr label_block =
+      map.getLabelLayerPtr()->allocateBlockPtrByIndex(block_idx);
+  Block<LabelVoxel> expected_block(kVoxelsPerSide, kVoxelSize,
+                                   label_block->origin());
+  for (Block<LabelVoxel>* block : {label_block.get(), &expected_block}) {
+    setLabel(4u, 20u, &block->getVoxelByLinearIndex(5u));
+    setLabel(11u, 3u, &block->getVoxelByLinearIndex(300u));
+  }
+  (*map.getLabelCountPtr())[4u] = 1;
+  (*map.getLabelCountPtr())[11u] = 1;
+  label_block.reset();
+
+  map.packLabelBlock(block_idx);
+  EXPECT_FALSE(map.getLabelLayer().hasBlock(block_idx));
+  EXPECT_TRUE(map.isLabelBlockPacked(block_idx));
+  EXPECT_EQ(1u, map.getNumberOfPackedLabelBlocks());
+  EXPECT_LT(map.getPackedLabelBlocksMemorySize(),
+            expected_block.num_voxels() * sizeof(LabelVoxel));
+  BlockIndexList block_indices;
+  map.getAllLabelBlockIndices(&block_indices);
+  ASSERT_EQ(1u, block_indices.size());
+  EXPECT_EQ(block_idx, block_indices.front());
+
+  // Reads densify the block without moving it back into the label layer.
+  const Block<LabelVoxel>::ConstPtr decoded_block =
+      map.getLabelBlockPtrByIndex(block_idx);
+  ASSERT_TRUE(decoded_block != nullptr);
+  EXPECT_TRUE(decoded_block->origin().isApprox(expected_block.origin()));
+  EXPECT_TRUE(decoded_block->has_data());
+  for (size_t linear_idx = 0u; linear_idx < expected_block.num_voxels();
+       ++linear_idx) {
+    expectSameVoxel(expected_block.getVoxelByLinearIndex(linear_idx),
+                    decoded_block->getVoxelByLinearIndex(linear_idx));
+  }
+  EXPECT_FALSE(map.getLabelLayer().hasBlock(block_idx));
+
+  // Sparse blocks are saved with the label layer.
+  const std::string file_path = ::testing::TempDir() + "sparse_map.gsm";
+  ASSERT_TRUE(map.saveToFile(file_path));
+  LabelTsdfMap loaded_map(config);
+  ASSERT_TRUE(loaded_map.loadFromFile(file_path));
+  std::remove(file_path.c_str());
+  const Block<LabelVoxel>::ConstPtr loaded_block =
+      loaded_map.getLabelLayer().getBlockPtrByIndex(block_idx);
+  ASSERT_TRUE(loaded_block != nullptr);
+  expectSameVoxel(expected_block.getVoxelByLinearIndex(300u),
+                  loaded_block->getVoxelByLinearIndex(300u));
+  EXPECT_EQ(1, loaded_map.getLabelCountPtr()->at(4u));
+
+  label_block = map.unpackLabelBlock(block_idx);
+  ASSERT_TRUE(label_block != nullptr);
+  EXPECT_TRUE(map.getLabelLayer().hasBlock(block_idx));
+  EXPECT_FALSE(map.hasPackedLabelBlocks());
+  expectSameVoxel(expected_block.getVoxelByLinearIndex(5u),
+                  label_block->getVoxelByLinearIndex(5u));
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+
+  int result = RUN_ALL_TESTS();
+
+  return result;
+}
@@ -0,0 +1,201 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "global_segment_map/utils/thread_pool.h"
+
+using namespace voxblox;  // NOLINT
+
+class ThreadPoolTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kNumThreads = 4u;
+};
+
+TEST_F(ThreadPoolTest, RunsEveryTaskOnce) {
+  ThreadPool thread_pool(kNumThreads);
+  for (const size_t num_tasks : {1u, 3u, 1000u}) {
+    std::vector<std::atomic<int>> task_counts(num_tasks);
+    for (std::atomic<int>& task_count : task_counts) {
+      task_count = 0;
+    }
+    std::atomic<bool> has_valid_worker_indices(true);
+    thread_pool.parallelFor(
+        num_tasks, [&](const size_t task_idx, const size_t worker_idx) {
+          ++task_counts[task_idx];
+          if (worker_idx >= kNumThreads) {
+            has_valid_worker_indices = false;
+          }
+        });
+    for (const std::atomic<int>& task_count : task_counts) {
+      EXPECT_EQ(1, task_count);
+    }
+    EXPECT_TRUE(has_valid_worker_indices);
+  }
+}
+
+TEST_F(ThreadPoolTest, SingleThreadRunsTasksOnTheCaller) {
+  ThreadPool thread_pool(1u);
+  const std::thread::id caller_id = std::this_thread::get_id();
+  size_t num_tasks_run = 0u;
+  thread_pool.parallelFor(10u, [&](const size_t task_idx,
+                                   const size_t worker_idx) {
+    EXPECT_EQ(num_tasks_run, task_idx);
+    EXPECT_EQ(0u, worker_idx);
+    EXPECT_EQ(caller_id, std::this_thread::get_id());
+    ++num_tasks_run;
+  });
+  EXPECT_EQ(10u, num_tasks_run);
+}
+
+TEST_F(ThreadPoolTest, CallerRunsTasksAsFirstWorker) {
+  // Tasks on the other workers block until the caller ran a task, which
+  // only happens if the caller works on the batch instead of waiting.
+  constexpr size_t kNumTasks = 2u * kNumThreads;
+  ThreadPool thread_pool(kNumThreads);
+  const std::thread::id caller_id = std::this_thread::get_id();
+  std::mutex mutex;
+  std::condition_variable caller_ran_task;
+  bool has_caller_run_task = false;
+  bool has_wait_timed_out = false;
+  std::atomic<bool> has_valid_caller_worker_index(true);
+  thread_pool.parallelFor(kNumTasks, [&](const size_t /*task_idx*/,
+                                         const size_t worker_idx) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (std::this_thread::get_id() == caller_id) {
+      if (worker_idx != 0u) {
+        has_valid_caller_worker_index = false;
+      }
+      has_caller_run_task = true;
+      caller_ran_task.notify_all();
+    } else if (!has_wait_timed_out &&
+               !caller_ran_task.wait_for(lock, std::chrono::seconds(10),
+                                         [&] { return has_caller_run_task; })) {
+      has_wait_timed_out = true;
+    }
+  });
+  EXPECT_TRUE(has_caller_run_task);
+  EXPECT_FALSE(has_wait_timed_out);
+  EXPECT_TRUE(has_valid_caller_worker_index);
+}
+
+TEST_F(ThreadPoolTest, RunsNestedBatchesOnTheWorker) {
+  constexpr size_t kNumTasks = 2u * kNumThreads;
+  constexpr size_t kNumNestedTasks = 5u;
+  ThreadPool thread_pool(kNumThreads);
+  std::atomic<size_t> num_nested_tasks_run(0u);
+  std::atomic<bool> have_nested_tasks_moved(false);
+  thread_pool.parallelFor(kNumTasks, [&](const size_t /*task_idx*/,
+                                         const size_t worker_idx) {
+    const std::thread::id worker_id = std::this_thread::get_id();
+    thread_pool.parallelFor(
+        kNumNestedTasks,
+        [&](const size_t /*nested_task_idx*/, const size_t nested_worker_idx) {
+          if (nested_worker_idx != worker_idx ||
+              std::this_thread::get_id() != worker_id) {
+            have_nested_tasks_moved = true;
+          }
+          ++num_nested_tasks_run;
+        });
+  });
+  EXPECT_EQ(kNumTasks * kNumNestedTasks, num_nested_tasks_run);
+  EXPECT_FALSE(have_nested_tasks_moved);
+}
+
+TEST_F(ThreadPoolTest, IdleWorkersStealQueuedTasks) {
+  // Every worker queues two tasks. The first task blocks until all other
+  // tasks are done, which requires another worker to steal the task queued
+  // behind it.
+  constexpr size_t kNumTasks = 2u * kNumThreads;
+  ThreadPool thread_pool(kNumThreads);
+  std::mutex mutex;
+  std::condition_variable tasks_done;
+  size_t num_tasks_done = 0u;
+  bool has_blocked_task_finished = false;
+  thread_pool.parallelFor(kNumTasks, [&](const size_t task_idx,
+                                         const size_t /*worker_idx*/) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (task_idx == 0u) {
+      has_blocked_task_finished = tasks_done.wait_for(
+          lock, std::chrono::seconds(10),
+          [&] { return num_tasks_done == kNumTasks - 1u; });
+    } else {
+      ++num_tasks_done;
+      tasks_done.notify_all();
+    }
+  });
+  EXPECT_TRUE(has_blocked_task_finished);
+}
+
+TEST_F(ThreadPoolTest, ConcurrentBatchesRunOneAfterTheOther) {
+  constexpr size_t kNumBatches = 2u;
+  constexpr size_t kNumTasks = 200u;
+  ThreadPool thread_pool(kNumThreads);
+  std::atomic<int> num_running_tasks[kNumBatches];
+  std::atomic<int> num_tasks_run[kNumBatches];
+  for (size_t batch_idx = 0u; batch_idx < kNumBatches; ++batch_idx) {
+    num_running_tasks[batch_idx] = 0;
+    num_tasks_run[batch_idx] = 0;
+  }
+  std::atomic<bool> have_batches_overlapped(false);
+
+  std::vector<std::thread> callers;
+  for (size_t batch_idx = 0u; batch_idx < kNumBatches; ++batch_idx) {
+    callers.emplace_back([&, batch_idx]() {
+      thread_pool.parallelFor(
+          kNumTasks,
+          [&](const size_t /*task_idx*/, const size_t /*worker_idx*/) {
+            ++num_running_tasks[batch_idx];
+            for (size_t other_batch_idx = 0u; other_batch_idx < kNumBatches;
+                 ++other_batch_idx) {
+              if (other_batch_idx != batch_idx &&
+                  num_running_tasks[other_batch_idx] > 0) {
+                have_batches_overlapped = true;
+              }
+            }
+            std::this_thread::yield();
+            ++num_tasks_run[batch_idx];
+            --num_running_tasks[batch_idx];
+          });
+    });
+  }
+  for (std::thread& caller : callers) {
+    caller.join();
+  }
+  EXPECT_FALSE(have_batches_overlapped);
+  for (size_t batch_idx = 0u; batch_idx < kNumBatches; ++batch_idx) {
+    EXPECT_EQ(static_cast<int>(kNumTasks), num_tasks_run[batch_idx]);
+  }
+}
+
+TEST_F(ThreadPoolTest, ShutsDownIdleAndUsedPools) {
+  // Pools are destroyed while their workers wait for the first batch, and
+  // right after a batch, when workers may not have gone back to waiting.
+  constexpr size_t kNumPools = 100u;
+  std::atomic<size_t> num_tasks_run(0u);
+  for (size_t pool_idx = 0u; pool_idx < kNumPools; ++pool_idx) {
+    ThreadPool thread_pool(kNumThreads);
+    if (pool_idx % 2u == 0u) {
+      thread_pool.parallelFor(
+          kNumThreads,
+          [&](const size_t /*task_idx*/, const size_t /*worker_idx*/) {
+            ++num_tasks_run;
+          });
+    }
+  }
+  EXPECT_EQ(kNumPools / 2u * kNumThreads, num_tasks_run);
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+
+  int result = RUN_ALL_TESTS();
+
+  return result;
+}
@@ -4,6 +4,7 @@
 #ifndef VOXBLOX_GSM_CONTROLLER_H_
 #define VOXBLOX_GSM_CONTROLLER_H_
 
+#include <memory>
 #include <vector>
 
 #include <geometry_msgs/Transform.h>
@@ -11,14 +12,21 @@
 #include <global_segment_map/label_tsdf_map.h>
 #include <global_segment_map/label_voxel.h>
 #include <global_segment_map/meshing/label_tsdf_mesh_integrator.h>
+#include <global_segment_map/utils/image_utils.h>
 #include <global_segment_map/utils/visualizer.h>
+#include <message_filters/subscriber.h>
+#include <message_filters/sync_policies/approximate_time.h>
+#include <message_filters/synchronizer.h>
 #include <ros/ros.h>
+#include <sensor_msgs/CameraInfo.h>
+#include <sensor_msgs/Image.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <std_srvs/Empty.h>
 #include <std_srvs/SetBool.h>
 #include <tf/transform_listener.h>
 #include <tf2_ros/transform_broadcaster.h>
 #include <voxblox/io/mesh_ply.h>
+#include <voxblox_msgs/FilePath.h>
 #include <voxblox_ros/conversions.h>
 #include <vpp_msgs/GetAlignedInstanceBoundingBox.h>
 #include <vpp_msgs/GetListSemanticInstances.h>
@@ -38,6 +46,10 @@ class Controller {
   void subscribeSegmentPointCloudTopic(
       ros::Subscriber* segment_point_cloud_sub);
 
+  // Subscribes to the synchronized depth image, segment image and camera info
+  // topics of the image input mode.
+  void subscribeImageTopics();
+
   void advertiseSceneMeshTopic();
 
   void advertiseSceneCloudTopic();
@@ -57,6 +69,10 @@ class Controller {
   void advertiseSaveSegmentsAsMeshService(
       ros::ServiceServer* save_segments_as_mesh_srv);
 
+  void advertiseSaveMapService(ros::ServiceServer* save_map_srv);
+
+  void advertiseLoadMapService(ros::ServiceServer* load_map_srv);
+
   void advertiseExtractInstancesService(
       ros::ServiceServer* extract_instances_srv);
 
@@ -73,7 +89,26 @@ class Controller {
 
   bool use_label_propagation_;
 
+  // Integrate all segments of a frame with a single bundling and ray casting
+  // pass instead of one pass per segment. Faster, but points of different
+  // segments that end in the same voxel are merged into one ray voting for
+  // their majority label, and the surface and clearing rays share a pass, so
+  // the map differs from the per-segment path.
+  bool integrate_segments_in_one_pass_;
+
+  // Compute the label candidates of all segments of a frame concurrently
+  // once the frame is complete, instead of one by one on arrival.
+  bool parallel_label_propagation_;
+
+  // Receive a depth image and a segment image per frame instead of one
+  // pointcloud per segment, and integrate them projectively.
+  bool use_image_input_;
+
  protected:
+  typedef message_filters::sync_policies::ApproximateTime<
+      sensor_msgs::Image, sensor_msgs::Image, sensor_msgs::CameraInfo>
+      ImageSyncPolicy;
+
   void processSegment(
       const sensor_msgs::PointCloud2::Ptr& segment_point_cloud_msg);
 
@@ -88,6 +123,11 @@ class Controller {
   virtual void segmentPointCloudCallback(
       const sensor_msgs::PointCloud2::Ptr& segment_point_cloud_msg);
 
+  virtual void imageCallback(
+      const sensor_msgs::Image::ConstPtr& depth_image_msg,
+      const sensor_msgs::Image::ConstPtr& segment_image_msg,
+      const sensor_msgs::CameraInfo::ConstPtr& camera_info_msg);
+
   bool generateMeshCallback(std_srvs::Empty::Request& request,
                             std_srvs::Empty::Response& response);
 
@@ -98,6 +138,12 @@ class Controller {
   bool saveSegmentsAsMeshCallback(std_srvs::Empty::Request& request,
                                   std_srvs::Empty::Response& response);
 
+  bool saveMapCallback(voxblox_msgs::FilePath::Request& request,
+                       voxblox_msgs::FilePath::Response& response);
+
+  bool loadMapCallback(voxblox_msgs::FilePath::Request& request,
+                       voxblox_msgs::FilePath::Response& response);
+
   bool extractInstancesCallback(std_srvs::Empty::Request& request,
                                 std_srvs::Empty::Response& response);
 
@@ -177,6 +223,21 @@ class Controller {
   std::map<Label, std::map<Segment*, size_t>> segment_label_candidates;
   std::map<Segment*, std::vector<Label>> segment_merge_candidates_;
 
+  // Current frame images, in the image input mode. The segment index image
+  // refers to the segments in segments_to_integrate_.
+  DepthImage depth_image_;
+  SegmentIndexImage segment_index_image_;
+  CameraIntrinsics camera_intrinsics_;
+
+  std::unique_ptr<message_filters::Subscriber<sensor_msgs::Image>>
+      depth_image_sub_;
+  std::unique_ptr<message_filters::Subscriber<sensor_msgs::Image>>
+      segment_image_sub_;
+  std::unique_ptr<message_filters::Subscriber<sensor_msgs::CameraInfo>>
+      camera_info_sub_;
+  std::unique_ptr<message_filters::Synchronizer<ImageSyncPolicy>>
+      image_sync_;
+
   ros::Publisher* bbox_pub_;
 
   std::thread viz_thread_;
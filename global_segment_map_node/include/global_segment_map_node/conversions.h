@@ -1,10 +1,16 @@
 #ifndef VOXBLOX_GSM_CONVERSIONS_H_
 #define VOXBLOX_GSM_CONVERSIONS_H_
 
+#include <cstring>
+#include <string>
 #include <vector>
 
 #include <geometry_msgs/Transform.h>
+#include <global_segment_map/utils/image_utils.h>
 #include <pcl/point_types.h>
+#include <sensor_msgs/CameraInfo.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/image_encodings.h>
 #include <visualization_msgs/Marker.h>
 #include <voxblox/core/common.h>
 #include <voxblox/io/sdf_ply.h>
@@ -118,6 +124,87 @@ inline void convertVoxelGridToPointCloud(
   surfel_cloud->height = 1u;
 }
 
+// Copies the pixels of image_msg, stored as PixelType, into image.
+template <typename PixelType, typename ImageType>
+inline void copyImageMsgPixels(const sensor_msgs::Image& image_msg,
+                               ImageType* image) {
+  CHECK_NOTNULL(image);
+  image->resize(image_msg.height, image_msg.width);
+  for (uint32_t v = 0u; v < image_msg.height; ++v) {
+    const uint8_t* row_data = image_msg.data.data() + v * image_msg.step;
+    for (uint32_t u = 0u; u < image_msg.width; ++u) {
+      PixelType pixel;
+      std::memcpy(&pixel, row_data + u * sizeof(PixelType), sizeof(PixelType));
+      (*image)(v, u) = static_cast<typename ImageType::Scalar>(pixel);
+    }
+  }
+}
+
+// Converts a depth image in meters (32FC1) or millimeters (16UC1).
+inline bool convertDepthImageMsg(const sensor_msgs::Image& depth_image_msg,
+                                 DepthImage* depth_image) {
+  CHECK_NOTNULL(depth_image);
+  if (depth_image_msg.is_bigendian) {
+    LOG(ERROR) << "Big endian depth images are not supported.";
+    return false;
+  }
+  const std::string& encoding = depth_image_msg.encoding;
+  if (encoding == sensor_msgs::image_encodings::TYPE_32FC1) {
+    copyImageMsgPixels<float>(depth_image_msg, depth_image);
+  } else if (encoding == sensor_msgs::image_encodings::TYPE_16UC1 ||
+             encoding == sensor_msgs::image_encodings::MONO16) {
+    constexpr float kMillimetersToMeters = 1.0e-3f;
+    copyImageMsgPixels<uint16_t>(depth_image_msg, depth_image);
+    *depth_image *= kMillimetersToMeters;
+  } else {
+    LOG(ERROR) << "Unsupported depth image encoding " << encoding << ".";
+    return false;
+  }
+  return true;
+}
+
+// Converts a segment image with one segment id per pixel (8UC1, 16UC1 or
+// 32SC1). Negative ids are treated as pixels without a segment.
+inline bool convertSegmentImageMsg(const sensor_msgs::Image& segment_image_msg,
+                                   SegmentIdImage* segment_id_image) {
+  CHECK_NOTNULL(segment_id_image);
+  if (segment_image_msg.is_bigendian) {
+    LOG(ERROR) << "Big endian segment images are not supported.";
+    return false;
+  }
+  const std::string& encoding = segment_image_msg.encoding;
+  if (encoding == sensor_msgs::image_encodings::TYPE_8UC1 ||
+      encoding == sensor_msgs::image_encodings::MONO8) {
+    copyImageMsgPixels<uint8_t>(segment_image_msg, segment_id_image);
+  } else if (encoding == sensor_msgs::image_encodings::TYPE_16UC1 ||
+             encoding == sensor_msgs::image_encodings::MONO16) {
+    copyImageMsgPixels<uint16_t>(segment_image_msg, segment_id_image);
+  } else if (encoding == sensor_msgs::image_encodings::TYPE_32SC1) {
+    Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+        signed_segment_id_image;
+    copyImageMsgPixels<int32_t>(segment_image_msg, &signed_segment_id_image);
+    *segment_id_image =
+        signed_segment_id_image.cwiseMax(static_cast<int32_t>(kNoSegmentId))
+            .cast<uint32_t>();
+  } else {
+    LOG(ERROR) << "Unsupported segment image encoding " << encoding << ".";
+    return false;
+  }
+  return true;
+}
+
+// Only the camera matrix is used, the images need to be rectified.
+inline void convertCameraInfoMsg(const sensor_msgs::CameraInfo& camera_info_msg,
+                                 CameraIntrinsics* intrinsics) {
+  CHECK_NOTNULL(intrinsics);
+  intrinsics->fx = camera_info_msg.K[0];
+  intrinsics->fy = camera_info_msg.K[4];
+  intrinsics->cx = camera_info_msg.K[2];
+  intrinsics->cy = camera_info_msg.K[5];
+  intrinsics->width = camera_info_msg.width;
+  intrinsics->height = camera_info_msg.height;
+}
+
 }  // namespace voxblox_gsm
 }  // namespace voxblox
 #endif  // VOXBLOX_GSM_CONVERSIONS_H_
@@ -16,6 +16,7 @@
 #include <utility>
 #include <vector>
 
+#include <boost/bind.hpp>
 #include <geometry_msgs/TransformStamped.h>
 #include <global_segment_map/label_voxel.h>
 #include <global_segment_map/utils/file_utils.h>
@@ -133,7 +134,10 @@ Controller::Controller(ros::NodeHandle* node_handle_private)
       need_full_remesh_(false),
       enable_semantic_instance_segmentation_(true),
       compute_and_publish_bbox_(false),
-      use_label_propagation_(true) {
+      use_label_propagation_(true),
+      integrate_segments_in_one_pass_(false),
+      parallel_label_propagation_(false),
+      use_image_input_(false) {
   CHECK_NOTNULL(node_handle_private_);
 
   bool verbose_log = false;
@@ -160,6 +164,23 @@ Controller::Controller(ros::NodeHandle* node_handle_private)
     voxels_per_side = map_config_.voxels_per_side;
   }
   map_config_.voxels_per_side = voxels_per_side;
+  node_handle_private_->param<bool>("gsm/compact_label_layer_on_save",
+                                    map_config_.compact_label_layer_on_save,
+                                    map_config_.compact_label_layer_on_save);
+  std::string inactive_label_block_encoding("dense");
+  node_handle_private_->param<std::string>("gsm/inactive_label_block_encoding",
+                                           inactive_label_block_encoding,
+                                           inactive_label_block_encoding);
+  if (inactive_label_block_encoding.compare("compact") == 0) {
+    map_config_.inactive_label_block_encoding = LabelTsdfMap::kCompact;
+  } else if (inactive_label_block_encoding.compare("sparse") == 0) {
+    map_config_.inactive_label_block_encoding = LabelTsdfMap::kSparse;
+  } else {
+    map_config_.inactive_label_block_encoding = LabelTsdfMap::kDense;
+  }
+  node_handle_private_->param<bool>("gsm/use_combined_blocks",
+                                    map_config_.use_combined_blocks,
+                                    map_config_.use_combined_blocks);
 
   map_.reset(new LabelTsdfMap(map_config_));
 
@@ -232,6 +253,76 @@ Controller::Controller(ros::NodeHandle* node_handle_private)
     label_tsdf_mesh_config_.class_task = SemanticColorMap::ClassTask::kCoco80;
   }
 
+  node_handle_private_->param<bool>("gsm/integrate_segments_in_one_pass",
+                                    integrate_segments_in_one_pass_,
+                                    integrate_segments_in_one_pass_);
+
+  node_handle_private_->param<bool>("gsm/parallel_label_propagation",
+                                    parallel_label_propagation_,
+                                    parallel_label_propagation_);
+
+  node_handle_private_->param<bool>(
+      "gsm/enable_spatially_partitioned_integration",
+      label_tsdf_integrator_config_.enable_spatially_partitioned_integration,
+      label_tsdf_integrator_config_.enable_spatially_partitioned_integration);
+  node_handle_private_->param<int>(
+      "gsm/partition_region_size_blocks",
+      label_tsdf_integrator_config_.partition_region_size_blocks,
+      label_tsdf_integrator_config_.partition_region_size_blocks);
+  node_handle_private_->param<bool>(
+      "gsm/enable_lock_free_label_updates",
+      label_tsdf_integrator_config_.enable_lock_free_label_updates,
+      label_tsdf_integrator_config_.enable_lock_free_label_updates);
+  node_handle_private_->param<bool>(
+      "gsm/enable_batch_ray_casting",
+      label_tsdf_integrator_config_.enable_batch_ray_casting,
+      label_tsdf_integrator_config_.enable_batch_ray_casting);
+
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/label_band_truncation_factor",
+      label_tsdf_integrator_config_.label_band_truncation_factor,
+      label_tsdf_integrator_config_.label_band_truncation_factor);
+  node_handle_private_->param<bool>(
+      "gsm/enable_voxel_deduplicated_propagation",
+      label_tsdf_integrator_config_.enable_voxel_deduplicated_propagation,
+      label_tsdf_integrator_config_.enable_voxel_deduplicated_propagation);
+  node_handle_private_->param<bool>(
+      "gsm/enable_label_propagation_cache",
+      label_tsdf_integrator_config_.enable_label_propagation_cache,
+      label_tsdf_integrator_config_.enable_label_propagation_cache);
+  node_handle_private_->param<bool>(
+      "gsm/enable_rendered_label_propagation",
+      label_tsdf_integrator_config_.enable_rendered_label_propagation,
+      label_tsdf_integrator_config_.enable_rendered_label_propagation);
+  node_handle_private_->param<bool>(
+      "gsm/enable_temporal_label_cache",
+      label_tsdf_integrator_config_.enable_temporal_label_cache,
+      label_tsdf_integrator_config_.enable_temporal_label_cache);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/temporal_cache_max_translation",
+      label_tsdf_integrator_config_.temporal_cache_max_translation,
+      label_tsdf_integrator_config_.temporal_cache_max_translation);
+  node_handle_private_->param<FloatingPoint>(
+      "gsm/temporal_cache_max_rotation",
+      label_tsdf_integrator_config_.temporal_cache_max_rotation,
+      label_tsdf_integrator_config_.temporal_cache_max_rotation);
+  node_handle_private_->param<int>(
+      "gsm/temporal_cache_max_voxel_label_changes",
+      label_tsdf_integrator_config_.temporal_cache_max_voxel_label_changes,
+      label_tsdf_integrator_config_.temporal_cache_max_voxel_label_changes);
+  node_handle_private_->param<bool>(
+      "gsm/enable_frame_preprocessing",
+      label_tsdf_integrator_config_.enable_frame_preprocessing,
+      label_tsdf_integrator_config_.enable_frame_preprocessing);
+  node_handle_private_->param<bool>(
+      "gsm/enable_label_recycling",
+      label_tsdf_integrator_config_.enable_label_recycling,
+      label_tsdf_integrator_config_.enable_label_recycling);
+  node_handle_private_->param<int>(
+      "gsm/label_recycling_min_frames",
+      label_tsdf_integrator_config_.label_recycling_min_frames,
+      label_tsdf_integrator_config_.label_recycling_min_frames);
+
   node_handle_private_->param<bool>("icp/enable_icp",
                                     label_tsdf_integrator_config_.enable_icp,
                                     label_tsdf_integrator_config_.enable_icp);
@@ -301,6 +392,13 @@ Controller::Controller(ros::NodeHandle* node_handle_private)
   node_handle_private_->param<bool>(
       "use_label_propagation", use_label_propagation_, use_label_propagation_);
 
+  node_handle_private_->param<bool>("image_input/use_image_input",
+                                    use_image_input_, use_image_input_);
+  if (use_image_input_ && enable_semantic_instance_segmentation_) {
+    LOG(WARNING) << "Segment images carry no semantic instance labels, the "
+                    "segments are integrated without them.";
+  }
+
 #ifndef APPROXMVBB_AVAILABLE
   if (compute_and_publish_bbox_) {
     LOG(WARNING) << "ApproxMVBB is not available and therefore "
@@ -345,6 +443,38 @@ void Controller::subscribeSegmentPointCloudTopic(
       &Controller::segmentPointCloudCallback, this);
 }
 
+void Controller::subscribeImageTopics() {
+  std::string depth_image_topic = "/camera/depth/image_rect";
+  std::string segment_image_topic = "/depth_segmentation_node/segment_image";
+  std::string camera_info_topic = "/camera/depth/camera_info";
+  node_handle_private_->param<std::string>("image_input/depth_image_topic",
+                                           depth_image_topic,
+                                           depth_image_topic);
+  node_handle_private_->param<std::string>("image_input/segment_image_topic",
+                                           segment_image_topic,
+                                           segment_image_topic);
+  node_handle_private_->param<std::string>("image_input/camera_info_topic",
+                                           camera_info_topic,
+                                           camera_info_topic);
+
+  // A whole frame arrives in a single message per topic, so a small queue
+  // suffices.
+  constexpr int kImageQueueSize = 10;
+  depth_image_sub_.reset(new message_filters::Subscriber<sensor_msgs::Image>(
+      *node_handle_private_, depth_image_topic, kImageQueueSize));
+  segment_image_sub_.reset(
+      new message_filters::Subscriber<sensor_msgs::Image>(
+          *node_handle_private_, segment_image_topic, kImageQueueSize));
+  camera_info_sub_.reset(
+      new message_filters::Subscriber<sensor_msgs::CameraInfo>(
+          *node_handle_private_, camera_info_topic, kImageQueueSize));
+  image_sync_.reset(new message_filters::Synchronizer<ImageSyncPolicy>(
+      ImageSyncPolicy(kImageQueueSize), *depth_image_sub_,
+      *segment_image_sub_, *camera_info_sub_));
+  image_sync_->registerCallback(
+      boost::bind(&Controller::imageCallback, this, _1, _2, _3));
+}
+
 void Controller::advertiseSceneMeshTopic() {
   scene_mesh_pub_ = new ros::Publisher(
       node_handle_private_->advertise<voxblox_msgs::Mesh>("mesh", 1, true));
@@ -396,6 +526,18 @@ void Controller::advertiseSaveSegmentsAsMeshService(
       "save_segments_as_mesh", &Controller::saveSegmentsAsMeshCallback, this);
 }
 
+void Controller::advertiseSaveMapService(ros::ServiceServer* save_map_srv) {
+  CHECK_NOTNULL(save_map_srv);
+  *save_map_srv = node_handle_private_->advertiseService(
+      "save_map", &Controller::saveMapCallback, this);
+}
+
+void Controller::advertiseLoadMapService(ros::ServiceServer* load_map_srv) {
+  CHECK_NOTNULL(load_map_srv);
+  *load_map_srv = node_handle_private_->advertiseService(
+      "load_map", &Controller::loadMapCallback, this);
+}
+
 void Controller::advertiseExtractInstancesService(
     ros::ServiceServer* extract_instances_srv) {
   CHECK_NOTNULL(extract_instances_srv);
@@ -460,7 +602,10 @@ void Controller::processSegment(
 
     timing::Timer label_candidates_timer("compute_label_candidates");
 
-    if (use_label_propagation_) {
+    // With parallel label propagation or frame preprocessing the candidates
+    // of all segments are computed together once the frame is complete.
+    if (use_label_propagation_ && !parallel_label_propagation_ &&
+        !label_tsdf_integrator_config_.enable_frame_preprocessing) {
       integrator_->computeSegmentLabelCandidates(
           segment, &segment_label_candidates, &segment_merge_candidates_);
     }
@@ -473,6 +618,44 @@ void Controller::integrateFrame(ros::Time msg_timestamp) {
   ros::WallTime start;
   ros::WallTime end;
 
+  // With image input the active blocks are collected and the frame is
+  // preprocessed once the image is converted. Otherwise the label candidates
+  // were deferred until the frame is preprocessed, so that they are voted
+  // from the shared voxel indices.
+  if (!use_image_input_) {
+    // Collecting the active blocks unpacks their label blocks.
+    std::lock_guard<std::mutex> label_tsdf_layers_lock(
+        label_tsdf_layers_mutex_);
+    integrator_->updateActiveBlocks(segments_to_integrate_.at(0)->T_G_C_,
+                                    segments_to_integrate_);
+  }
+  if (!use_image_input_ &&
+      label_tsdf_integrator_config_.enable_frame_preprocessing) {
+    integrator_->preprocessFrame(segments_to_integrate_);
+    if (use_label_propagation_ && !parallel_label_propagation_) {
+      timing::Timer label_candidates_timer("compute_label_candidates");
+      for (Segment* segment : segments_to_integrate_) {
+        integrator_->computeSegmentLabelCandidates(
+            segment, &segment_label_candidates, &segment_merge_candidates_);
+      }
+      label_candidates_timer.Stop();
+    }
+  }
+
+  if (use_label_propagation_ && parallel_label_propagation_) {
+    start = ros::WallTime::now();
+    timing::Timer label_candidates_timer("compute_label_candidates");
+
+    integrator_->computeFrameLabelCandidates(segments_to_integrate_,
+                                             &segment_label_candidates,
+                                             &segment_merge_candidates_);
+    label_candidates_timer.Stop();
+    end = ros::WallTime::now();
+    LOG(INFO) << "Computed label candidates for "
+              << segments_to_integrate_.size() << " pointclouds in "
+              << (end - start).toSec() << " seconds.";
+  }
+
   if (use_label_propagation_) {
     start = ros::WallTime::now();
     timing::Timer propagation_timer("label_propagation");
@@ -491,34 +674,58 @@ void Controller::integrateFrame(ros::Time msg_timestamp) {
   start = ros::WallTime::now();
   timing::Timer integrate_timer("integrate_frame_pointclouds");
   Transformation T_G_C = segments_to_integrate_.at(0)->T_G_C_;
-  Pointcloud point_cloud_all_segments_t;
-  for (Segment* segment : segments_to_integrate_) {
-    // Concatenate point clouds. (NOTE(ff): We should probably just use
-    // the original cloud here instead.)
-    Pointcloud::iterator it = point_cloud_all_segments_t.end();
-    point_cloud_all_segments_t.insert(it, segment->points_C_.begin(),
-                                      segment->points_C_.end());
-  }
   Transformation T_Gicp_C = T_G_C;
   if (label_tsdf_integrator_config_.enable_icp) {
+    // The preprocessed frame already holds the concatenated point clouds. The
+    // shared world frame points and indices depend on the pose ICP refines,
+    // so ICP aligns the camera frame points.
+    Pointcloud point_cloud_all_segments_t;
+    if (!label_tsdf_integrator_config_.enable_frame_preprocessing) {
+      for (Segment* segment : segments_to_integrate_) {
+        // Concatenate point clouds. (NOTE(ff): We should probably just use
+        // the original cloud here instead.)
+        Pointcloud::iterator it = point_cloud_all_segments_t.end();
+        point_cloud_all_segments_t.insert(it, segment->points_C_.begin(),
+                                          segment->points_C_.end());
+      }
+    }
     // TODO(ntonci): Make icp config members ros params.
     // integrator_->icp_.reset(new
     // ICP(getICPConfigFromRosParam(nh_private)));
-    T_Gicp_C =
-        integrator_->getIcpRefined_T_G_C(T_G_C, point_cloud_all_segments_t);
+    // The active blocks of the initial pose are kept for the integration,
+    // blocks only seen from the refined pose are looked up in the layers.
+    T_Gicp_C = integrator_->getIcpRefined_T_G_C(
+        T_G_C, label_tsdf_integrator_config_.enable_frame_preprocessing
+                   ? integrator_->getPreprocessedPointsC()
+                   : point_cloud_all_segments_t);
   }
 
   {
     std::lock_guard<std::mutex> label_tsdf_layers_lock(
         label_tsdf_layers_mutex_);
+    Labels segment_labels;
+    segment_labels.reserve(segments_to_integrate_.size());
     for (Segment* segment : segments_to_integrate_) {
       CHECK_NOTNULL(segment);
       segment->T_G_C_ = T_Gicp_C;
+      segment_labels.push_back(segment->label_);
 
-      integrator_->integratePointCloud(segment->T_G_C_, segment->points_C_,
-                                       segment->colors_, segment->label_,
-                                       kIsFreespacePointcloud);
+      if (!use_image_input_ && !integrate_segments_in_one_pass_) {
+        integrator_->integratePointCloud(segment->T_G_C_, segment->points_C_,
+                                         segment->colors_, segment->label_,
+                                         kIsFreespacePointcloud);
+      }
+    }
+    if (use_image_input_) {
+      integrator_->integrateDepthImage(T_Gicp_C, depth_image_,
+                                       segment_index_image_,
+                                       camera_intrinsics_, segment_labels);
+    } else if (integrate_segments_in_one_pass_) {
+      integrator_->integrateSegments(segments_to_integrate_,
+                                     kIsFreespacePointcloud);
     }
+    integrator_->clearPreprocessedFrame();
+    integrator_->clearActiveBlocks();
   }
 
   integrate_timer.Stop();
@@ -531,11 +738,28 @@ void Controller::integrateFrame(ros::Time msg_timestamp) {
             << " tsdf and "
             << map_->getLabelLayerPtr()->getNumberOfAllocatedBlocks()
             << " label blocks.";
+  constexpr double kBytesToMegabytes = 1.0 / (1024.0 * 1024.0);
+  LOG(INFO) << "The tsdf layer uses "
+            << map_->getTsdfLayerPtr()->getMemorySize() * kBytesToMegabytes
+            << " MB and the label layer "
+            << map_->getLabelLayerPtr()->getMemorySize() * kBytesToMegabytes
+            << " MB.";
+  if (map_->hasPackedLabelBlocks()) {
+    LOG(INFO) << map_->getNumberOfPackedLabelBlocks()
+              << " packed label blocks use "
+              << map_->getPackedLabelBlocksMemorySize() * kBytesToMegabytes
+              << " MB.";
+  }
 
   start = ros::WallTime::now();
 
-  integrator_->mergeLabels(&merges_to_publish_);
-  integrator_->getLabelsToPublish(&segment_labels_to_publish_);
+  {
+    // Merging and recycling labels unpack and pack label blocks.
+    std::lock_guard<std::mutex> label_tsdf_layers_lock(
+        label_tsdf_layers_mutex_);
+    integrator_->mergeLabels(&merges_to_publish_);
+    integrator_->getLabelsToPublish(&segment_labels_to_publish_);
+  }
 
   end = ros::WallTime::now();
   LOG(INFO) << "Merged segments in " << (end - start).toSec() << " seconds.";
@@ -555,6 +779,77 @@ void Controller::integrateFrame(ros::Time msg_timestamp) {
   LOG(INFO) << "Timings: " << std::endl << timing::Timing::Print() << std::endl;
 }
 
+void Controller::imageCallback(
+    const sensor_msgs::Image::ConstPtr& depth_image_msg,
+    const sensor_msgs::Image::ConstPtr& segment_image_msg,
+    const sensor_msgs::CameraInfo::ConstPtr& camera_info_msg) {
+  if (!integration_on_) {
+    return;
+  }
+  // Look up transform from camera frame to world frame.
+  Transformation T_G_C;
+  if (!lookupTransform(depth_image_msg->header.frame_id, world_frame_,
+                       depth_image_msg->header.stamp, &T_G_C)) {
+    return;
+  }
+
+  timing::Timer image_timer("image_preprocess");
+  SegmentIdImage segment_id_image;
+  if (!convertDepthImageMsg(*depth_image_msg, &depth_image_) ||
+      !convertSegmentImageMsg(*segment_image_msg, &segment_id_image)) {
+    return;
+  }
+  convertCameraInfoMsg(*camera_info_msg, &camera_intrinsics_);
+  if (depth_image_.rows() != segment_id_image.rows() ||
+      depth_image_.cols() != segment_id_image.cols() ||
+      depth_image_.rows() != camera_intrinsics_.height ||
+      depth_image_.cols() != camera_intrinsics_.width) {
+    LOG(ERROR) << "The depth image, segment image and camera info of a frame "
+                  "need to have the same size.";
+    return;
+  }
+
+  std::vector<uint32_t> segment_ids;
+  extractImageSegments(T_G_C, depth_image_, segment_id_image,
+                       camera_intrinsics_, &segment_index_image_, &segment_ids,
+                       &segments_to_integrate_);
+  image_timer.Stop();
+  if (segments_to_integrate_.empty()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> label_tsdf_layers_lock(
+        label_tsdf_layers_mutex_);
+    integrator_->updateActiveBlocks(T_G_C, camera_intrinsics_);
+  }
+  if (label_tsdf_integrator_config_.enable_frame_preprocessing) {
+    integrator_->preprocessFrame(segments_to_integrate_);
+  }
+  if (use_label_propagation_ &&
+      label_tsdf_integrator_config_.enable_rendered_label_propagation) {
+    integrator_->renderLabelImage(T_G_C, camera_intrinsics_);
+  }
+
+  if (use_label_propagation_ && !parallel_label_propagation_) {
+    timing::Timer label_candidates_timer("compute_label_candidates");
+    for (Segment* segment : segments_to_integrate_) {
+      integrator_->computeSegmentLabelCandidates(
+          segment, &segment_label_candidates, &segment_merge_candidates_);
+    }
+    label_candidates_timer.Stop();
+  } else if (!use_label_propagation_) {
+    // The segment ids are the labels.
+    for (size_t segment_idx = 0u; segment_idx < segment_ids.size();
+         ++segment_idx) {
+      segments_to_integrate_[segment_idx]->label_ =
+          static_cast<Label>(segment_ids[segment_idx]);
+    }
+  }
+
+  integrateFrame(depth_image_msg->header.stamp);
+}
+
 void Controller::segmentPointCloudCallback(
     const sensor_msgs::PointCloud2::Ptr& segment_point_cloud_msg) {
   if (!integration_on_) {
@@ -681,6 +976,41 @@ bool Controller::getScenePointcloudCallback(
   return true;
 }
 
+bool Controller::saveMapCallback(voxblox_msgs::FilePath::Request& request,
+                                 voxblox_msgs::FilePath::Response& response) {
+  std::lock_guard<std::mutex> label_tsdf_layers_lock(label_tsdf_layers_mutex_);
+  return map_->saveToFile(request.file_path);
+}
+
+bool Controller::loadMapCallback(voxblox_msgs::FilePath::Request& request,
+                                 voxblox_msgs::FilePath::Response& response) {
+  {
+    std::lock_guard<std::mutex> label_tsdf_layers_lock(
+        label_tsdf_layers_mutex_);
+
+    LabelTsdfMap::Ptr map(new LabelTsdfMap(map_config_));
+    if (!map->loadFromFile(request.file_path)) {
+      LOG(ERROR) << "Could not load the map from " << request.file_path;
+      return false;
+    }
+    map_ = map;
+    integrator_.reset(new LabelTsdfIntegrator(
+        tsdf_integrator_config_, label_tsdf_integrator_config_, map_.get()));
+  }
+  {
+    std::lock_guard<std::mutex> mesh_layer_lock(mesh_layer_mutex_);
+
+    mesh_label_layer_->clear();
+    mesh_semantic_layer_->clear();
+    mesh_instance_layer_->clear();
+    mesh_merged_layer_->clear();
+
+    resetMeshIntegrators();
+    need_full_remesh_ = true;
+  }
+  return true;
+}
+
 bool Controller::saveSegmentsAsMeshCallback(
     std_srvs::Empty::Request& request, std_srvs::Empty::Response& response) {
   Labels labels;
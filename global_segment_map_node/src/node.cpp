@@ -31,7 +31,11 @@ int main(int argc, char** argv) {
   controller->advertiseToggleIntegrationService(&toggle_integration_srv);
 
   ros::Subscriber segment_point_cloud_sub;
-  controller->subscribeSegmentPointCloudTopic(&segment_point_cloud_sub);
+  if (controller->use_image_input_) {
+    controller->subscribeImageTopics();
+  } else {
+    controller->subscribeSegmentPointCloudTopic(&segment_point_cloud_sub);
+  }
 
   if (controller->publish_scene_mesh_) {
     controller->advertiseSceneMeshTopic();
@@ -51,6 +55,12 @@ int main(int argc, char** argv) {
   ros::ServiceServer save_segments_as_mesh_srv;
   controller->advertiseSaveSegmentsAsMeshService(&save_segments_as_mesh_srv);
 
+  ros::ServiceServer save_map_srv;
+  controller->advertiseSaveMapService(&save_map_srv);
+
+  ros::ServiceServer load_map_srv;
+  controller->advertiseLoadMapService(&load_map_srv);
+
   ros::ServiceServer extract_instances_srv;
   ros::ServiceServer get_list_semantic_instances_srv;
   ros::ServiceServer get_instance_bounding_box_srv;